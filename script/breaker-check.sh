@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Checks that a dead NVP endpoint costs bounded time and then no calls at
+# all. The stand-in runs with --mode stall (reads each call, never answers)
+# or --mode blackhole (never accepts a connection). With both modes by
+# default, for each one:
+#
+#   concurrent first clicks all end within ApiCallTimeout plus a second,
+#   with 401 or 503, and a page outside /paid still answers meanwhile,
+#   the circuit breaker is then open and the next clicks get 503 with
+#   Retry-After at once, without waiting for the endpoint.
+#
+#   breaker-check.sh <mod_paypal_ec.so> [stall|blackhole]
+#
+# Environment: APXS, PORT (8089), CONCURRENCY (8), CALL_TIMEOUT (1000).
+
+set -e
+
+if [ $# -lt 1 ] || [ ! -f "$1" ]
+then
+	echo "usage: $0 <mod_paypal_ec.so> [stall|blackhole]" >&2
+	exit 2
+fi
+if [ $# -lt 2 ]
+then
+	"$0" "$1" stall && "$0" "$1" blackhole
+	exit
+fi
+
+MODULE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+MODE=$2
+PORT=${PORT:-8089}
+CONCURRENCY=${CONCURRENCY:-8}
+CALL_TIMEOUT=${CALL_TIMEOUT:-1000}
+FILE_SIZE=1024
+FILES=1
+STANDIN="--mode $MODE"
+EXTRA_CONF=$(printf 'ApiConnectTimeout 300\nApiCallTimeout %s\nApiBreakerThreshold 4\nApiBreakerCooldown 60\nApiMaxInFlight %s' \
+	"$CALL_TIMEOUT" "$CONCURRENCY")
+. "$(dirname "$0")/private-httpd.sh"
+echo ok > "$WORK/htdocs/index.html"
+failures=0
+
+fail() {
+	echo "$MODE: $1" >&2
+	failures=$((failures + 1))
+}
+
+# A click from its own page, so checkouts are not coalesced
+awk -v n="$CONCURRENCY" -v url="$URL" 'BEGIN {
+	for (i = 0; i < n; i++)
+		printf "url = \"%s/paid/book.pdf?buyer=%d\"\noutput = \"/dev/null\"\n", url, i
+}' > "$WORK/urls"
+curl -s --parallel --parallel-max "$CONCURRENCY" -K "$WORK/urls" -w '%{http_code} %{time_total}\n' > "$WORK/stalled" 2>/dev/null &
+clicks=$!
+sleep 0.2
+page=$(curl -s -o /dev/null -m 5 -w '%{http_code} %{time_total}' "$URL/")
+wait $clicks
+
+slowest=$(awk -v limit="$CALL_TIMEOUT" '
+	$1 != 401 && $1 != 503 { print "click answered " $1 > "/dev/stderr"; bad = 1 }
+	$2 > max { max = $2 }
+	END { print max; exit bad || max > limit / 1000 + 1 }' "$WORK/stalled") || fail "stalled clicks: slowest $slowest s"
+case $page in
+200\ 0.[0-4]*) ;;
+*) fail "page outside /paid during the stall: $page" ;;
+esac
+
+curl -s "$URL/paypal-ec-status?auto" > "$WORK/status"
+grep -q '^BreakerOpen: 1' "$WORK/status" || fail "breaker not open after $CONCURRENCY failed calls"
+i=0
+while [ $i -lt 20 ]
+do
+	curl -s -o /dev/null -D "$WORK/rejected.h" -w '%{http_code} %{time_total}\n' "$URL/paid/book.pdf?buyer=open$i" >> "$WORK/rejected"
+	grep -qi '^Retry-After:' "$WORK/rejected.h" || fail "no Retry-After with the breaker open"
+	i=$((i + 1))
+done
+rejectedMax=$(awk '$1 != 503 { print "open breaker answered " $1 > "/dev/stderr"; bad = 1 }
+	$2 > max { max = $2 }
+	END { print max; exit bad || max > 0.2 }' "$WORK/rejected") || fail "clicks with the breaker open: slowest $rejectedMax s"
+rejects=$(curl -s "$URL/paypal-ec-status?auto" | awk -F': ' '$1 == "BreakerRejects" { print $2 }')
+[ "${rejects:-0}" -ge 20 ] || fail "BreakerRejects $rejects after 20 clicks"
+
+echo "$MODE: $CONCURRENCY stalled clicks, slowest $slowest s; page meanwhile ${page#* } s;" \
+	"20 clicks refused, slowest $rejectedMax s; $failures failures"
+[ $failures -eq 0 ]
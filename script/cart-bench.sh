@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# What a cart saves: ITEMS files are bought once per bundle size, against
+# the NVP stand-in (see private-httpd.sh). Size 1 buys each file on its
+# own, the way buyers did before carts. A larger size buys ITEMS / size
+# carts, each with its click, its return to the cart page and one
+# download per file through the links of that page. For each size it
+# prints the API calls the stand-in answered and the wall time, in total
+# and per file.
+#
+#   cart-bench.sh <mod_paypal_ec.so> [sizes...]
+#
+# Environment: APXS, PORT (8089), CONCURRENCY (16), ITEMS (1000), STANDIN
+# (the stand-in's options, "--latency 80 --jitter 40").
+
+set -e
+
+if [ $# -lt 1 ] || [ ! -f "$1" ]
+then
+	echo "usage: $0 <mod_paypal_ec.so> [sizes...]" >&2
+	exit 2
+fi
+
+MODULE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+SIZES=${*:-1 2 5 10 25 50}
+PORT=${PORT:-8089}
+CONCURRENCY=${CONCURRENCY:-16}
+ITEMS=${ITEMS:-1000}
+FILE_SIZE=16384
+FILES=50
+STANDIN=${STANDIN:---latency 80 --jitter 40}
+EXTRA_CONF="DownloadGrantKey bench cart-bench-secret-0123"
+. "$(dirname "$0")/private-httpd.sh"
+
+calls() {
+	curl -s "http://127.0.0.1:$STANDIN_PORT/stats" | awk -F': ' '$1 == "Calls" { print $2 }'
+}
+
+# Runs WORK/urls.<leg>; one line per request: code, effective and
+# redirect URL
+leg() {
+	curl -s --parallel --parallel-max "$CONCURRENCY" -K "$WORK/urls.$1" \
+		-w '%{http_code} %{url_effective} %{redirect_url}\n' > "$WORK/out.$1" 2>/dev/null
+}
+
+printf "%-6s %8s %8s %10s %10s %8s %10s %8s\n" size carts files api_calls calls/file wall_s ms/file errors
+for size in $SIZES
+do
+	[ "$size" -ge 1 ] && [ "$size" -le $FILES ] || { echo "$0: sizes are 1 to $FILES" >&2; exit 2; }
+	carts=$((ITEMS / size))
+	rm -rf "$WORK/pages"
+	mkdir "$WORK/pages"
+	before=$(calls)
+	start=$(date +%s.%N)
+	awk -v n="$carts" -v size="$size" -v url="$URL" -v files=$FILES 'BEGIN {
+		for (i = 0; i < n; i++) {
+			list = ""
+			for (j = 0; j < size; j++) {
+				f = (i * size + j) % files
+				list = list (j ? "," : "") "book" (f ? f : "") ".pdf"
+			}
+			if (size == 1)
+				printf "url = \"%s/paid/%s?buyer=%d\"\n", url, list, i
+			else
+				printf "url = \"%s/paid/?items=%s&buyer=%d\"\n", url, list, i
+			print "output = \"/dev/null\""
+		}
+	}' > "$WORK/urls.click"
+	leg click
+	awk -v pages="$WORK/pages" '$1 == 302 {
+		token = $3
+		sub(/.*token=/, "", token)
+		printf "url = \"%s&status=ok&token=%s&PayerID=CART%d\"\noutput = \"%s/%d\"\n", $2, token, NR, pages, NR
+	}' "$WORK/out.click" > "$WORK/urls.return"
+	leg return
+	# A single file comes with the return, a cart as links with grants
+	: > "$WORK/urls.download"
+	if [ "$size" -gt 1 ]
+	then
+		for page in "$WORK"/pages/*
+		do
+			grep -o 'href="[^"]*"' "$page" | sed "s|^href=\"|url = \"$URL/paid/|; s|&amp;|\&|g; s|\$|\noutput = \"/dev/null\"|"
+		done > "$WORK/urls.download"
+		leg download
+	else
+		: > "$WORK/out.download"
+	fi
+	end=$(date +%s.%N)
+	after=$(calls)
+	awk -v size="$size" -v carts="$carts" -v apiCalls=$((after - before)) -v start="$start" -v end="$end" \
+		-v click="$WORK/out.click" -v ret="$WORK/out.return" -v download="$WORK/out.download" 'BEGIN {
+		while ((getline < click) > 0) if ($1 != 302) errors++
+		while ((getline < ret) > 0) { if ($1 != 200) errors++; else if (size == 1) files++ }
+		while ((getline < download) > 0) { if ($1 != 200) errors++; else files++ }
+		wall = end - start
+		printf "%-6d %8d %8d %10d %10.2f %8.1f %10.1f %8d\n", size, carts, files, apiCalls,
+			files ? apiCalls / files : 0, wall, files ? wall * 1000 / files : 0, errors
+	}'
+done
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Price list scaling: for each catalog size, a text Pricelist and the same
+# list compiled with pricelist_compile are loaded by a private httpd in
+# turn (ApiTransport fake, see private-httpd.sh). For each run it prints
+#
+#   startup_s   from starting httpd until it answers, 0.1 s resolution
+#   p50/p99_ms  first clicks on LOOKUPS random names of the catalog; each
+#               is one price lookup plus the fake SetExpressCheckout
+#   rss_kb      mean RSS of a child after the clicks
+#   private_kb  mean private memory of a child (smaps_rollup), what each
+#               further child costs
+#
+#   catalog-bench.sh <mod_paypal_ec.so> [sizes...]
+#
+# Environment: APXS, PORT (8089), CONCURRENCY (8), LOOKUPS (5000),
+# COMPILER (src/pricelist_compile), DATA (a temporary directory for the
+# generated lists).
+
+set -e
+
+if [ $# -lt 1 ] || [ ! -f "$1" ]
+then
+	echo "usage: $0 <mod_paypal_ec.so> [sizes...]" >&2
+	exit 2
+fi
+
+# One run: catalog-bench.sh <module> -run <size> <format> <pricelist>
+if [ "$2" = -run ]
+then
+	MODULE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+	SIZE=$3
+	FORMAT=$4
+	PRICELIST=$5
+	PORT=${PORT:-8089}
+	CONCURRENCY=${CONCURRENCY:-8}
+	FILE_SIZE=1024
+	FILES=1
+	start=$(date +%s.%N)
+	. "$(dirname "$0")/private-httpd.sh"
+	ready=$(date +%s.%N)
+	awk -v n="$SIZE" -v lookups="${LOOKUPS:-5000}" -v url="$URL" 'BEGIN {
+		srand(1)
+		for (i = 0; i < lookups; i++)
+			printf "url = \"%s/paid/item%d.pdf\"\noutput = \"/dev/null\"\n", url, int(rand() * n)
+	}' > "$WORK/urls"
+	curl -s --parallel --parallel-max "$CONCURRENCY" -K "$WORK/urls" -w '%{http_code} %{time_total}\n' > "$WORK/times" 2>/dev/null
+	for pid in $(ps -o pid= --ppid "$(cat "$WORK/httpd.pid")")
+	do
+		awk '/^Rss:/ { rss = $2 } /^Private_(Clean|Dirty):/ { private += $2 } END { print rss, private }' "/proc/$pid/smaps_rollup" 2>/dev/null || true
+	done > "$WORK/memory"
+	sort -k2n "$WORK/times" | awk -v size="$SIZE" -v format="$FORMAT" -v start="$start" -v ready="$ready" -v memory="$WORK/memory" '
+		{ t[NR] = $2 * 1000; if ($1 != 302) errors++ }
+		END {
+			while ((getline line < memory) > 0) { split(line, m, " "); children++; rss += m[1]; private += m[2] }
+			printf "%-10d %-9s %9.1f %8.2f %8.2f %10d %10d %7d\n", size, format, ready - start,
+				t[int(NR * 0.5) + 1], t[int(NR * 0.99) + 1], children ? rss / children : 0, children ? private / children : 0, errors
+		}'
+	exit
+fi
+
+MODULE=$1
+shift
+SIZES=${*:-10000 1000000 10000000}
+COMPILER=${COMPILER:-$(dirname "$0")/../src/pricelist_compile}
+DATA=${DATA:-$(mktemp -d)}
+trap 'rm -rf "$DATA"' EXIT
+if [ ! -x "$COMPILER" ]
+then
+	echo "$0: build $COMPILER first (make -C src pricelist_compile)" >&2
+	exit 2
+fi
+
+printf "%-10s %-9s %9s %8s %8s %10s %10s %7s\n" items format startup_s p50_ms p99_ms rss_kb private_kb errors
+for size in $SIZES
+do
+	awk -v n="$size" 'BEGIN {
+		print "book.pdf=9.99"
+		for (i = 0; i < n; i++)
+			printf "item%d.pdf=%d.%02d\n", i, i % 100, i % 97
+	}' > "$DATA/list.$size"
+	"$COMPILER" "$DATA/list.$size" "$DATA/catalog.$size" >&2
+	"$0" "$MODULE" -run "$size" text "$DATA/list.$size"
+	"$0" "$MODULE" -run "$size" compiled "$DATA/catalog.$size"
+	rm -f "$DATA/list.$size" "$DATA/catalog.$size"
+done
@@ -0,0 +1,122 @@
+#!/bin/sh
+#
+# End-to-end load test of the checkout flow against the local NVP stand-in
+# (nvp-standin.py). A private httpd is started on PORT with the given
+# module and ApiTransport curl (see private-httpd.sh). Every buyer makes
+# the two legs a browser makes: the first click, answered with the 302 to
+# PayPal, and the return from PayPal with status=ok, its token and a
+# PayerID, answered with the file. All first clicks run before the returns.
+# For each leg the requests per second, the body bytes per second, the
+# latency and time to first byte percentiles seen by the client and the
+# busy workers sampled from mod_status are printed, followed by the
+# module's own phase percentiles from the status page.
+#
+#   checkout-load.sh <mod_paypal_ec.so> [buyers]
+#
+# Environment: APXS, PORT (8089), CONCURRENCY (16), FILE_SIZE (65536),
+# FILES (4), MPM (event, worker or prefork), STANDIN (the stand-in's
+# options, "--latency 80 --jitter 40"), EXTRA_CONF.
+
+set -e
+
+if [ $# -lt 1 ] || [ ! -f "$1" ]
+then
+	echo "usage: $0 <mod_paypal_ec.so> [buyers]" >&2
+	exit 2
+fi
+
+MODULE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+BUYERS=${2:-2000}
+PORT=${PORT:-8089}
+CONCURRENCY=${CONCURRENCY:-16}
+FILE_SIZE=${FILE_SIZE:-65536}
+FILES=${FILES:-4}
+STANDIN=${STANDIN:---latency 80 --jitter 40}
+. "$(dirname "$0")/private-httpd.sh"
+
+# Busy workers every 100 ms until the leg is over; the sampling request
+# itself takes one
+sampleWorkers() {
+	while [ ! -f "$WORK/leg.done" ]
+	do
+		curl -s "$URL/server-status?auto" | awk -F': ' '$1 == "BusyWorkers" { print $2 - 1 }'
+		sleep 0.1
+	done > "$WORK/busy.$1"
+}
+
+# Runs the requests of WORK/urls.<leg> and keeps one line per request:
+# code, seconds to the first byte, seconds in total, effective and
+# redirect URL, and the body bytes as the last field, since the redirect
+# URL may be empty. Some curl versions show the parallel progress meter
+# despite -s.
+runLeg() {
+	rm -f "$WORK/leg.done"
+	sampleWorkers "$1" &
+	sampler=$!
+	start=$(date +%s.%N)
+	curl -s --parallel --parallel-max "$CONCURRENCY" -K "$WORK/urls.$1" \
+		-w '%{http_code} %{time_starttransfer} %{time_total} %{url_effective} %{redirect_url} %{size_download}\n' > "$WORK/times.$1" 2>/dev/null
+	end=$(date +%s.%N)
+	touch "$WORK/leg.done"
+	wait $sampler
+	echo "$start $end" > "$WORK/span.$1"
+}
+
+# Latency percentiles are of the whole response, ttfb of its first byte
+report() {
+	sort -k2n "$WORK/times.$1" | awk '{ print $2 * 1000 }' > "$WORK/ttfb.$1"
+	sort -k3n "$WORK/times.$1" | awk -v leg="$1" -v want="$2" -v span="$(cat "$WORK/span.$1")" -v busy="$WORK/busy.$1" \
+		-v ttfb="$WORK/ttfb.$1" '
+		{ t[NR] = $3 * 1000; bytes += $NF; if ($1 != want) errors++ }
+		END {
+			split(span, s, " ")
+			while ((getline b < busy) > 0) { n++; sum += b; if (b > max) max = b }
+			while ((getline f < ttfb) > 0) first[++m] = f
+			printf "%-9s %8d %8.0f %8.1f %8.1f %8.1f %8.1f %9.1f %9.1f %8d %6.1f/%d\n", leg, NR, NR / (s[2] - s[1]),
+				bytes / (s[2] - s[1]) / 1048576,
+				t[int(NR * 0.5) + 1], t[int(NR * 0.99) + 1], t[int(NR * 0.999) + 1],
+				first[int(m * 0.5) + 1], first[int(m * 0.99) + 1], errors, n ? sum / n : 0, max
+		}'
+}
+
+# Check both legs before timing anything
+location=$(curl -s -o /dev/null -w '%{redirect_url}' "$URL/paid/book.pdf")
+token=${location##*token=}
+download=$(curl -s -o /dev/null -w '%{http_code}' "$URL/paid/book.pdf?status=ok&token=$token&PayerID=LOAD")
+if [ -z "$token" ] || [ "$download" != 200 ]
+then
+	echo "unexpected responses: checkout to '$location', download $download" >&2
+	cat "$WORK/error.log" >&2
+	exit 1
+fi
+
+# Every buyer has its own URL, as buyers coming from different pages do
+awk -v n="$BUYERS" -v url="$URL" -v files="$FILES" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		f = i % files
+		printf "url = \"%s/paid/book%s.pdf?buyer=%d\"\noutput = \"/dev/null\"\n", url, f ? f : "", i
+	}
+}' > "$WORK/urls.checkout"
+runLeg checkout
+# PayPal sends the buyer back to RETURNURL, the clicked URL with status=ok
+awk '$1 == 302 {
+	token = $5
+	sub(/.*token=/, "", token)
+	printf "url = \"%s&status=ok&token=%s&PayerID=LOAD%d\"\noutput = \"/dev/null\"\n", $4, token, NR
+}' "$WORK/times.checkout" > "$WORK/urls.return"
+runLeg return
+
+echo "mpm $mpm, $BUYERS buyers, concurrency $CONCURRENCY, stand-in $STANDIN"
+printf "%-9s %8s %8s %8s %8s %8s %8s %9s %9s %8s %8s\n" leg requests req/s MB/s p50_ms p99_ms p999_ms ttfb50_ms ttfb99_ms errors busy
+report checkout 302
+report return 200
+curl -s "$URL/paypal-ec-status?auto" | awk -F': ' '
+	BEGIN { printf "\n%-20s %8s %10s %10s %10s\n", "module phase", "count", "p50_us", "p99_us", "p999_us" }
+	{ v[$1] = $2 }
+	END {
+		split("SetExpressCheckout GetExpressCheckout DoExpressCheckout SendFile", phases, " ")
+		for (i = 1; i <= 4; i++) {
+			p = phases[i]
+			printf "%-20s %8d %10d %10d %10d\n", p, v[p "Count"], v[p "P50"], v[p "P99"], v[p "P999"]
+		}
+	}'
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Drives a checkout and download workload through mod_paypal_ec and prints
+# the requests per second. A private httpd is started on PORT with the given
+# module and ApiTransport fake, or with ApiTransport curl against the NVP
+# stand-in when STANDIN is set (see private-httpd.sh).
+# With MIX=checkout (the default) half of the requests start a checkout
+# (SetExpressCheckout and the 302 to PayPal), the other half return from
+# PayPal (GetExpressCheckoutDetails, DoExpressCheckoutPayment and the
+# download). MIX=spike is a launch: every request returns from PayPal and
+# downloads one of a few FILES, as when a release sells out in minutes.
+# DOWNLOAD_CACHE, e.g. "256 16", turns on the shared download cache, and
+# PAYMENT_LEDGER=1 the payment ledger. The status page values named in
+# STATUS_KEYS are printed to stderr after the run.
+#
+#   checkout-workload.sh <mod_paypal_ec.so> [requests]
+#
+# Environment: APXS, PORT (8089), CONCURRENCY (8), FILE_SIZE (65536),
+# MIX (checkout), FILES (4), DOWNLOAD_CACHE (off), PAYMENT_LEDGER (off),
+# STANDIN (off), STATUS_KEYS.
+
+set -e
+
+if [ $# -lt 1 ] || [ ! -f "$1" ]
+then
+	echo "usage: $0 <mod_paypal_ec.so> [requests]" >&2
+	exit 2
+fi
+
+MODULE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+REQUESTS=${2:-10000}
+PORT=${PORT:-8089}
+CONCURRENCY=${CONCURRENCY:-8}
+FILE_SIZE=${FILE_SIZE:-65536}
+MIX=${MIX:-checkout}
+FILES=${FILES:-4}
+. "$(dirname "$0")/private-httpd.sh"
+
+# Check both legs before timing anything
+checkout=$(curl -s -o /dev/null -w '%{http_code}' "$URL/paid/book.pdf")
+download=$(curl -s -o /dev/null -w '%{http_code}' "$URL/paid/book.pdf?status=ok&token=EC-CHECK&PayerID=WORKLOAD")
+if [ "$checkout" != 302 ] || [ "$download" != 200 ]
+then
+	echo "unexpected responses: checkout $checkout, download $download" >&2
+	cat "$WORK/error.log" >&2
+	exit 1
+fi
+
+awk -v n="$REQUESTS" -v url="$URL" -v mix="$MIX" -v files="$FILES" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		if (mix == "spike") {
+			f = i % files
+			printf "url = \"%s/paid/book%s.pdf?status=ok&token=EC-W%d&PayerID=WORKLOAD\"\n", url, f ? f : "", i
+		} else if (i % 2 == 0) {
+			printf "url = \"%s/paid/book.pdf\"\n", url
+		} else {
+			printf "url = \"%s/paid/book.pdf?status=ok&token=EC-W%d&PayerID=WORKLOAD\"\n", url, i
+		}
+		print "output = \"/dev/null\""
+	}
+}' > "$WORK/urls"
+
+# Some curl versions show the parallel progress meter despite -s
+start=$(date +%s.%N)
+curl -s --parallel --parallel-max "$CONCURRENCY" -K "$WORK/urls" 2>/dev/null
+end=$(date +%s.%N)
+awk -v n="$REQUESTS" -v s="$start" -v e="$end" 'BEGIN { printf "%.0f\n", n / (e - s) }'
+if [ -n "$STATUS_KEYS" ]
+then
+	# Let the writer threads finish their last batch
+	sleep 1
+	curl -s "$URL/paypal-ec-status?auto" | awk -F': ' -v keys="$STATUS_KEYS" '
+		BEGIN { n = split(keys, k, " "); for (i = 1; i <= n; i++) want[k[i]] = 1 }
+		$1 in want' >&2
+fi
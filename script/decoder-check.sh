@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Checks the incremental NVP decoder against the stand-in with --fragment:
+# every response comes in chunks of 1 to 7 bytes with every value byte
+# percent-encoded, so escapes and fields are split across reads. A share
+# of the calls fails with ACK=Failure, so the error fields are decoded too.
+# Each buyer checks out and returns; then for every token
+#
+#   the Location of the 302 carries the token the stand-in set,
+#   the return got the file exactly when the stand-in completed its Do,
+#   the PaymentLedger holds the transaction id the stand-in gave it.
+#
+#   decoder-check.sh <mod_paypal_ec.so> [buyers]
+#
+# Environment: APXS, PORT (8089), CONCURRENCY (8), ERROR_RATE (0.05).
+
+set -e
+
+if [ $# -lt 1 ] || [ ! -f "$1" ]
+then
+	echo "usage: $0 <mod_paypal_ec.so> [buyers]" >&2
+	exit 2
+fi
+
+MODULE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+BUYERS=${2:-500}
+PORT=${PORT:-8089}
+CONCURRENCY=${CONCURRENCY:-8}
+FILE_SIZE=1024
+FILES=1
+STANDIN="--fragment --error-rate ${ERROR_RATE:-0.05}"
+PAYMENT_LEDGER=1
+. "$(dirname "$0")/private-httpd.sh"
+
+awk -v n="$BUYERS" -v url="$URL" 'BEGIN {
+	for (i = 0; i < n; i++)
+		printf "url = \"%s/paid/book.pdf?buyer=%d\"\noutput = \"/dev/null\"\n", url, i
+}' > "$WORK/urls.checkout"
+curl -s --parallel --parallel-max "$CONCURRENCY" -K "$WORK/urls.checkout" \
+	-w '%{http_code} %{url_effective} %{redirect_url}\n' > "$WORK/checkout" 2>/dev/null
+awk '$1 == 302 {
+	token = $3
+	sub(/.*token=/, "", token)
+	printf "url = \"%s&status=ok&token=%s&PayerID=CHECK%d\"\noutput = \"/dev/null\"\n", $2, token, NR
+}' "$WORK/checkout" > "$WORK/urls.return"
+curl -s --parallel --parallel-max "$CONCURRENCY" -K "$WORK/urls.return" \
+	-w '%{http_code} %{url_effective}\n' > "$WORK/return" 2>/dev/null
+# The ledger writer flushes every 200 ms
+sleep 1
+
+awk -v checkout="$WORK/checkout" -v ret="$WORK/return" -v ledger="$WORK/payments.ledger" '
+	function tokenOf(u) { sub(/.*token=/, "", u); sub(/&.*/, "", u); return u }
+	BEGIN { FS = "\t" }
+	$1 == "SetExpressCheckout" && $3 == "Success" { set[$2] = 1; sets++ }
+	$1 == "DoExpressCheckoutPayment" && $3 == "Success" { paid[$2] = $4 }
+	END {
+		FS = " "
+		while ((getline < checkout) > 0) {
+			if ($1 != 302) {
+				failedSets++
+				continue
+			}
+			t = tokenOf($3)
+			if (!(t in set)) { print "checkout: token " t " was never set"; bad++ }
+			redirects++
+		}
+		if (redirects != sets) {
+			print "checkout: " redirects " redirects for " sets " tokens set"; bad++
+		}
+		while ((getline < ret) > 0) {
+			t = tokenOf($2)
+			if (($1 == 200) != (t in paid)) { print "return: " $1 " for token " t; bad++ }
+			if ($1 == 200) downloads++
+		}
+		FS = "\t"
+		while ((getline < ledger) > 0) {
+			if (/^#/)
+				continue
+			if (paid[$3] != $2) { print "ledger: transaction " $2 " for token " $3; bad++ }
+			recorded++
+		}
+		if (recorded != downloads) { print "ledger: " recorded " records for " downloads " downloads"; bad++ }
+		printf "%d checkouts, %d failed; %d downloads; %d mismatches\n", redirects, failedSets, downloads, bad
+		exit bad > 0
+	}' "$WORK/standin.log" || { cat "$WORK/error.log" >&2; exit 1; }
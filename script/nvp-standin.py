@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+#
+# Local stand-in for the PayPal NVP API, for load tests of mod_paypal_ec
+# without the sandbox. POST /nvp answers SetExpressCheckout,
+# GetExpressCheckoutDetails and DoExpressCheckoutPayment the way PayPal
+# does for the fields the module reads. GET /checkout?token= stands in for
+# the PayPal login page, and GET /stats shows the calls per method as
+# "Key: value" lines.
+#
+#   nvp-standin.py [options] <port>
+#
+# A token is fresh until DoExpressCheckoutPayment completes it; a second Do
+# then fails with 10415. Tokens that were never set are taken as fresh, so
+# a driver may make up its own. --mode stall reads each call and never
+# answers; --mode blackhole listens but never accepts, so once the backlog
+# is full even connecting times out. --fragment sends each response in
+# chunks of 1 to 7 bytes with every value byte percent-encoded, to exercise
+# a decoder on split escapes and split fields. --log appends one line per
+# call: method, token, ACK and the RETURNURL (Set) or transaction id (Do).
+
+import argparse
+import random
+import signal
+import socket
+import string
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qsl, quote, urlsplit
+
+METHODS = ("SetExpressCheckout", "GetExpressCheckoutDetails", "DoExpressCheckoutPayment")
+
+
+class State:
+    def __init__(self, args):
+        self.args = args
+        self.lock = threading.Lock()
+        self.paid = {}
+        self.calls = dict((m, 0) for m in METHODS)
+        self.failures = 0
+        self.serial = 0
+        self.random = random.Random(args.seed)
+        self.log = open(args.log, "a", buffering=1) if args.log else None
+
+    def next_id(self, prefix):
+        with self.lock:
+            self.serial += 1
+            tail = "".join(self.random.choice(string.ascii_uppercase + string.digits) for _ in range(9))
+            return "%s%08d%s" % (prefix, self.serial, tail)
+
+    def chance(self, p):
+        with self.lock:
+            return p > 0 and self.random.random() < p
+
+    def delay(self):
+        with self.lock:
+            jitter = self.random.uniform(0, self.args.jitter) if self.args.jitter > 0 else 0
+        return (self.args.latency + jitter) / 1000.0
+
+    def record(self, method, token, ack, detail):
+        with self.lock:
+            self.calls[method] += 1
+            if ack != "Success":
+                self.failures += 1
+            if self.log:
+                self.log.write("%s\t%s\t%s\t%s\n" % (method, token, ack, detail))
+
+    def answer(self, fields):
+        method = fields.get("METHOD", "")
+        token = fields.get("TOKEN", "")
+        if method not in METHODS:
+            return [("ACK", "Failure"), ("L_ERRORCODE0", "81002"), ("L_LONGMESSAGE0", "Method specified is not supported")]
+        if self.chance(self.args.error_rate):
+            self.record(method, token, "Failure", "")
+            return [("ACK", "Failure"), ("L_ERRORCODE0", "10001"), ("L_LONGMESSAGE0", "Internal Error")]
+        if method == "SetExpressCheckout":
+            token = self.next_id("EC-")
+            self.record(method, token, "Success", fields.get("RETURNURL", ""))
+            return [("ACK", "Success"), ("TOKEN", token)]
+        if method == "GetExpressCheckoutDetails":
+            with self.lock:
+                paid = token in self.paid
+            self.record(method, token, "Success", "")
+            return [("ACK", "Success"), ("TOKEN", token),
+                    ("CHECKOUTSTATUS", "PaymentActionCompleted" if paid else "PaymentActionNotInitiated"),
+                    ("PAYERID", fields.get("PAYERID", "STANDINPAYER")), ("EMAIL", "buyer@example.com")]
+        transaction = self.next_id("")
+        with self.lock:
+            paid = self.paid.setdefault(token, transaction) != transaction
+        if paid:
+            self.record(method, token, "Failure", "10415")
+            return [("ACK", "Failure"), ("L_ERRORCODE0", "10415"),
+                    ("L_LONGMESSAGE0", "A successful transaction has already been completed for this token.")]
+        self.record(method, token, "Success", transaction)
+        return [("ACK", "Success"), ("TOKEN", token), ("PAYMENTINFO_0_TRANSACTIONID", transaction),
+                ("PAYMENTINFO_0_PAYMENTSTATUS", "Completed"), ("PAYMENTINFO_0_AMT", fields.get("PAYMENTREQUEST_0_AMT", ""))]
+
+
+def encode(pairs, everything):
+    if not everything:
+        return "&".join("%s=%s" % (k, quote(v, safe="")) for k, v in pairs)
+    return "&".join("%s=%s" % (k, "".join("%%%02X" % b for b in v.encode())) for k, v in pairs)
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "nvp-standin"
+
+    def log_message(self, fmt, *args):
+        pass
+
+    def send_body(self, code, body, kind="text/plain"):
+        data = body.encode()
+        self.send_response(code)
+        self.send_header("Content-Type", kind)
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_GET(self):
+        path = urlsplit(self.path)
+        state = self.server.state
+        if path.path == "/stats":
+            with state.lock:
+                lines = ["%s: %d" % (m, n) for m, n in state.calls.items()]
+                lines.append("Calls: %d" % sum(state.calls.values()))
+                lines.append("Failures: %d" % state.failures)
+                lines.append("Paid: %d" % len(state.paid))
+            self.send_body(200, "\n".join(lines) + "\n")
+        elif path.path == "/checkout":
+            self.send_body(200, "<html><body>PayPal stand-in checkout for %s</body></html>\n"
+                           % dict(parse_qsl(path.query)).get("token", ""), "text/html")
+        else:
+            self.send_body(404, "not found\n")
+
+    def do_POST(self):
+        state = self.server.state
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0))).decode("utf-8", "replace")
+        if state.args.mode == "stall":
+            # Hold the connection open until the client gives up
+            while self.rfile.read(1):
+                pass
+            self.close_connection = True
+            return
+        if urlsplit(self.path).path != "/nvp":
+            self.send_body(404, "not found\n")
+            return
+        time.sleep(state.delay())
+        if state.chance(state.args.http_error_rate):
+            self.send_body(500, "<html><body>Internal Server Error</body></html>\n", "text/html")
+            return
+        reply = encode(state.answer(dict(parse_qsl(body, keep_blank_values=True))), state.args.fragment)
+        if not state.args.fragment:
+            self.send_body(200, reply)
+            return
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Transfer-Encoding", "chunked")
+        self.end_headers()
+        self.wfile.flush()
+        self.connection.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        data = reply.encode()
+        i = 0
+        while i < len(data):
+            n = min(len(data) - i, state.random.randint(1, 7))
+            self.wfile.write(b"%x\r\n%s\r\n" % (n, data[i:i + n]))
+            self.wfile.flush()
+            i += n
+            time.sleep(0.0005)
+        self.wfile.write(b"0\r\n\r\n")
+
+
+class Server(ThreadingHTTPServer):
+    daemon_threads = True
+    request_queue_size = 1024
+    allow_reuse_address = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local stand-in for the PayPal NVP API")
+    parser.add_argument("port", type=int)
+    parser.add_argument("--bind", default="127.0.0.1")
+    parser.add_argument("--latency", type=float, default=0, help="milliseconds before each answer")
+    parser.add_argument("--jitter", type=float, default=0, help="up to this many more milliseconds")
+    parser.add_argument("--error-rate", type=float, default=0, help="share of calls answered with ACK=Failure")
+    parser.add_argument("--http-error-rate", type=float, default=0, help="share of calls answered with HTTP 500")
+    parser.add_argument("--mode", choices=("answer", "stall", "blackhole"), default="answer")
+    parser.add_argument("--fragment", action="store_true", help="chunked, fully percent-encoded responses")
+    parser.add_argument("--log", help="file to append one line per call to")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    signal.signal(signal.SIGTERM, lambda *_: sys.exit(0))
+    if args.mode == "blackhole":
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.bind((args.bind, args.port))
+        sock.listen(0)
+        while True:
+            time.sleep(3600)
+    server = Server((args.bind, args.port), Handler)
+    server.state = State(args)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# Reads the PaymentLedger of mod_paypal_ec: the rotated files (<ledger>.<time>)
+# oldest first, then the current one. Prints the records that match every
+# filter given, with the header line first, or with -s a summary per
+# resource and currency: payments, total amount and median checkout time.
+#
+#   payment-ledger.sh [-t transaction] [-k token] [-p payer] [-n name]
+#                     [-f from] [-u until] [-s] <ledger>
+#
+# from and until compare with the time field, e.g. -f 2026-10-01 -u 2026-10-02.
+
+set -e
+
+usage() {
+	echo "usage: $0 [-t transaction] [-k token] [-p payer] [-n name] [-f from] [-u until] [-s] <ledger>" >&2
+	exit 2
+}
+
+txn= token= payer= name= from= until= summary=0
+while getopts t:k:p:n:f:u:s opt
+do
+	case $opt in
+	t) txn=$OPTARG ;;
+	k) token=$OPTARG ;;
+	p) payer=$OPTARG ;;
+	n) name=$OPTARG ;;
+	f) from=$OPTARG ;;
+	u) until=$OPTARG ;;
+	s) summary=1 ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 1 ] || usage
+
+ledger=$1
+# By the time after the last dot; the path may have dots of its own
+files=$(ls -1 "$ledger".* 2>/dev/null | grep -E '\.[0-9]+$' | awk -F. '{ print $NF "\t" $0 }' | sort -n | cut -f2- || true)
+[ -f "$ledger" ] && files="$files
+$ledger"
+if [ -z "$(echo "$files" | tr -d '[:space:]')" ]
+then
+	echo "$0: no ledger at $ledger" >&2
+	exit 1
+fi
+
+records() {
+	echo "$files" | grep -v '^$' | while read -r f
+	do
+		cat "$f"
+	done | awk -F'\t' -v txn="$txn" -v token="$token" -v payer="$payer" -v name="$name" \
+		-v from="$from" -v until="$until" -v header="$1" '
+		/^#/ {
+			if (header && !seen++)
+				print
+			next
+		}
+		(txn == "" || $2 == txn) && (token == "" || $3 == token) && (payer == "" || $4 == payer) \
+		&& (name == "" || $5 == name) && (from == "" || $1 >= from) && (until == "" || $1 < until)'
+}
+
+if [ $summary -eq 0 ]
+then
+	records 1
+	exit 0
+fi
+
+# Grouped by name and currency, each group ordered by checkout time
+records 0 | awk -F'\t' -v OFS='\t' '{ print $5, $7, $6, $8 }' | sort -t "$(printf '\t')" -k1,1 -k2,2 -k4,4n | awk -F'\t' '
+	function report() {
+		if (n > 0)
+			printf "%-40s %-8s %10d %14.2f %12dus\n", group[1], group[2], n, total, times[int((n + 1) / 2)]
+	}
+	BEGIN {
+		printf "%-40s %-8s %10s %14s %14s\n", "name", "currency", "payments", "total", "checkout_p50"
+	}
+	$1 "\t" $2 != key {
+		report()
+		key = $1 "\t" $2
+		split(key, group, "\t")
+		n = 0
+		total = 0
+	}
+	{
+		times[++n] = $4
+		total += $3
+	}
+	END {
+		report()
+	}'
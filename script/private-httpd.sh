@@ -0,0 +1,181 @@
+# Sourced by the workload scripts: starts a private httpd on PORT that
+# loads MODULE with ApiTransport fake, so the API calls are answered in
+# process, or with real calls to an NVP stand-in at ENDPOINT when set.
+# /paid is protected with a Pricelist of FILES files of FILE_SIZE bytes
+# (book.pdf, book1.pdf, ...), and /paypal-ec-status shows the status
+# page. PAYMENT_LEDGER, when set, writes the PaymentLedger to
+# WORK/payments.ledger. EXTRA_CONF is appended to the server
+# configuration. The server is stopped and WORK removed on exit.
+# STANDIN, the options of nvp-standin.py or "on", starts that stand-in on
+# STANDIN_PORT (PORT + 1) and makes it ENDPOINT; it logs its calls to
+# WORK/standin.log. MPM picks the MPM, the first of event, worker and
+# prefork by default. /server-status shows mod_status where the module
+# exists. PRICELIST replaces the generated Pricelist and must list the
+# FILES. DELIVERY sets DownloadDelivery for /paid to module, handler or
+# redirect; redirect sends paid requests to /paid-files, an Alias of the
+# same files that only the redirect may reach.
+
+APXS=${APXS:-$(command -v apxs2 || command -v apxs)}
+HTTPD=$($APXS -q SBINDIR)/$($APXS -q TARGET)
+MODULES=$($APXS -q LIBEXECDIR)
+WORK=$(mktemp -d)
+URL=http://127.0.0.1:$PORT
+TRANSPORT="ApiTransport fake 0"
+WEBURL=$URL/checkout?token=
+if [ -n "$STANDIN" ]
+then
+	STANDIN_PORT=${STANDIN_PORT:-$((PORT + 1))}
+	ENDPOINT=http://127.0.0.1:$STANDIN_PORT/nvp
+	WEBURL=http://127.0.0.1:$STANDIN_PORT/checkout?token=
+fi
+if [ -n "$ENDPOINT" ]
+then
+	TRANSPORT="ApiTransport curl"
+fi
+
+stop() {
+	if [ -f "$WORK/httpd.pid" ]
+	then
+		"$HTTPD" -f "$WORK/httpd.conf" -k stop
+		# Instrumented children write their profile on exit
+		i=0
+		while [ -f "$WORK/httpd.pid" ] && [ $i -lt 100 ]
+		do
+			sleep 0.1
+			i=$((i + 1))
+		done
+	fi
+	if [ -f "$WORK/standin.pid" ]
+	then
+		kill "$(cat "$WORK/standin.pid")" 2>/dev/null || true
+	fi
+	rm -rf "$WORK"
+}
+trap stop EXIT
+
+if [ -n "$STANDIN" ]
+then
+	args=$STANDIN
+	[ "$args" = on ] && args=
+	"$(dirname "$0")/nvp-standin.py" --log "$WORK/standin.log" $args "$STANDIN_PORT" &
+	echo $! > "$WORK/standin.pid"
+	i=0
+	# A blackhole never answers, so only give it time to listen
+	until case $args in *blackhole*) sleep 0.5 ;; *) curl -s -o /dev/null "http://127.0.0.1:$STANDIN_PORT/stats" ;; esac \
+		|| [ $i -ge 50 ]
+	do
+		sleep 0.1
+		i=$((i + 1))
+	done
+fi
+
+mkdir -p "$WORK/htdocs/paid"
+head -c "$FILE_SIZE" /dev/urandom > "$WORK/htdocs/paid/book.pdf"
+echo "book.pdf=9.99" > "$WORK/paid.pricelist"
+i=1
+while [ $i -lt "$FILES" ]
+do
+	head -c "$FILE_SIZE" /dev/urandom > "$WORK/htdocs/paid/book$i.pdf"
+	echo "book$i.pdf=9.99" >> "$WORK/paid.pricelist"
+	i=$((i + 1))
+done
+: > "$WORK/mime.types"
+
+DELIVERY_TARGET=
+DELIVERY_CONF=
+if [ "$DELIVERY" = redirect ]
+then
+	EXTRA_MODULES="$EXTRA_MODULES alias"
+	DELIVERY_TARGET=" /paid-files"
+	DELIVERY_CONF="Alias /paid-files \"$WORK/htdocs/paid\"
+<Location /paid-files>
+	Require env REDIRECT_PAYPAL_EC_PAID
+</Location>"
+fi
+
+loadModule() {
+	if [ -f "$MODULES/mod_$1.so" ] && ! "$HTTPD" -l | grep -q "mod_$1.c"
+	then
+		echo "LoadModule $1_module $MODULES/mod_$1.so"
+	fi
+}
+
+mpm=
+for m in ${MPM:-event worker prefork}
+do
+	if "$HTTPD" -l | grep -q "$m.c" || [ -f "$MODULES/mod_mpm_$m.so" ]
+	then
+		mpm=$m
+		break
+	fi
+done
+if [ -z "$mpm" ]
+then
+	echo "no MPM ${MPM:-event, worker or prefork} in $MODULES" >&2
+	exit 2
+fi
+
+{
+	if ! "$HTTPD" -l | grep -q "$mpm.c"
+	then
+		echo "LoadModule mpm_${mpm}_module $MODULES/mod_mpm_$mpm.so"
+	fi
+	for m in unixd authn_core authz_core authz_user mime status $EXTRA_MODULES
+	do
+		loadModule $m
+	done
+	cat <<EOF
+ServerRoot "$WORK"
+ServerName 127.0.0.1
+Listen 127.0.0.1:$PORT
+PidFile "$WORK/httpd.pid"
+ErrorLog "$WORK/error.log"
+LogLevel warn
+DocumentRoot "$WORK/htdocs"
+TypesConfig "$WORK/mime.types"
+<IfModule unixd_module>
+User #$(id -u)
+Group #$(id -g)
+</IfModule>
+
+LoadModule paypal_ec_module "$MODULE"
+$TRANSPORT
+ApiEndPoint ${ENDPOINT:-$URL/nvp}
+ApiUserName workload
+ApiPassword workload
+ApiSignature workload
+ApiVersion 84.0
+CurrencyCode USD
+ExpressCheckoutWebUrl $WEBURL
+ExpressCheckoutType Basic
+ApiMaxInFlight 1000
+${DOWNLOAD_CACHE:+DownloadCache $DOWNLOAD_CACHE}
+${PAYMENT_LEDGER:+PaymentLedger "$WORK/payments.ledger"}
+${EXTRA_CONF}
+
+<Location /paid>
+	Pricelist "${PRICELIST:-$WORK/paid.pricelist}"
+	AuthType ExpressCheckout
+	AuthName "PayPal ExpressCheckout"
+	Require valid-user
+	${DELIVERY:+DownloadDelivery $DELIVERY$DELIVERY_TARGET}
+</Location>
+$DELIVERY_CONF
+<Location /paypal-ec-status>
+	SetHandler paypal-ec-status
+</Location>
+<IfModule status_module>
+<Location /server-status>
+	SetHandler server-status
+</Location>
+</IfModule>
+EOF
+} > "$WORK/httpd.conf"
+
+"$HTTPD" -f "$WORK/httpd.conf" -k start
+i=0
+until curl -s -o /dev/null "$URL/" || [ $i -ge 100 ]
+do
+	sleep 0.1
+	i=$((i + 1))
+done
@@ -0,0 +1,158 @@
+#!/bin/sh
+#
+# Checks partial downloads of a paid file. The buyer pays once and then
+# sends range requests with the download grant cookie, as a download
+# manager resuming or splitting a download does:
+#
+#   single, suffix and open ranges get 206 with the right bytes,
+#   several ranges get one multipart/byteranges 206 with each part,
+#   a range past the end gets 416,
+#   If-Range with the current ETag gets the range, with another the file,
+#   If-None-Match with the current ETag gets 304,
+#   the grant in the query unlocks the file but not one of the same name
+#   and price in another directory.
+#
+# With both modes by default: plain serves the file from disk; cached turns
+# on DownloadCache with 1 MB per file and PipelinedCapture, pays for a file
+# of about 2 MB twice, the first time filling the cache while the capture
+# is in flight and the second time from it, and adds a range across the
+# end of the cached part.
+#
+#   range-check.sh <mod_paypal_ec.so> [plain|cached]
+#
+# Environment: APXS, PORT (8089).
+
+set -e
+
+if [ $# -lt 1 ] || [ ! -f "$1" ]
+then
+	echo "usage: $0 <mod_paypal_ec.so> [plain|cached]" >&2
+	exit 2
+fi
+if [ $# -lt 2 ]
+then
+	"$0" "$1" plain && "$0" "$1" cached
+	exit
+fi
+
+MODULE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+MODE=$2
+PORT=${PORT:-8089}
+FILE_SIZE=1
+FILES=1
+EXTRA_CONF="DownloadGrantKey check range-check-secret-0123"
+LINES=20000
+if [ "$MODE" = cached ]
+then
+	DOWNLOAD_CACHE="16 1"
+	EXTRA_CONF=$(printf '%s\nApiAsyncEngine On\nPipelinedCapture On 64' "$EXTRA_CONF")
+	LINES=300000
+fi
+. "$(dirname "$0")/private-httpd.sh"
+
+# Text content, so the parts can be told apart
+FILE=$WORK/htdocs/paid/book.pdf
+seq 1 $LINES > "$FILE"
+SIZE=$(wc -c < "$FILE")
+failures=0
+
+fail() {
+	echo "$MODE: $1" >&2
+	failures=$((failures + 1))
+}
+
+bytes() {
+	tail -c +$(($1 + 1)) "$FILE" | head -c $(($2 - $1 + 1))
+}
+
+# get <file> <curl options>: fetches book.pdf with the grant, prints the
+# status; headers go to <file>.h
+get() {
+	out=$1
+	shift
+	curl -s -b "$WORK/cookies" -D "$out.h" -o "$out" -w '%{http_code}' "$@" "$URL/paid/book.pdf"
+}
+
+header() {
+	awk -v name="$2" 'tolower($1) == tolower(name ":") { sub(/^[^:]*: */, ""); sub(/\r$/, ""); print }' "$1.h"
+}
+
+for token in EC-RANGE EC-RANGE2
+do
+	code=$(curl -s -c "$WORK/cookies" -o "$WORK/full" -w '%{http_code}' "$URL/paid/book.pdf?status=ok&token=$token&PayerID=CHECK")
+	if [ "$code" != 200 ] || ! cmp -s "$WORK/full" "$FILE" || ! grep -q PayPalECGrant "$WORK/cookies"
+	then
+		echo "$MODE: payment with $token: $code, no file or no grant" >&2
+		cat "$WORK/error.log" >&2
+		exit 1
+	fi
+	[ "$MODE" = cached ] || break
+done
+etag=$(curl -s -b "$WORK/cookies" -o /dev/null -D - "$URL/paid/book.pdf" | awk 'tolower($1) == "etag:" { sub(/\r$/, ""); print $2 }')
+
+# range <spec> <first> <last>
+range() {
+	code=$(get "$WORK/part" -H "Range: bytes=$1")
+	bytes "$2" "$3" > "$WORK/expected"
+	if [ "$code" != 206 ] || [ "$(header "$WORK/part" Content-Range)" != "bytes $2-$3/$SIZE" ] || ! cmp -s "$WORK/part" "$WORK/expected"
+	then
+		fail "Range $1: $code, $(header "$WORK/part" Content-Range)"
+	fi
+}
+range 0-99 0 99
+range 1000-1999 1000 1999
+range -100 $((SIZE - 100)) $((SIZE - 1))
+range $((SIZE - 10))- $((SIZE - 10)) $((SIZE - 1))
+range 0-$((SIZE * 2)) 0 $((SIZE - 1))
+if [ "$MODE" = cached ]
+then
+	range 1048476-1048675 1048476 1048675
+fi
+
+code=$(get "$WORK/multi" -H "Range: bytes=0-9,500-599,-50")
+bytes 0 9 > "$WORK/expected.0"
+bytes 500 599 > "$WORK/expected.1"
+bytes $((SIZE - 50)) $((SIZE - 1)) > "$WORK/expected.2"
+case $(header "$WORK/multi" Content-Type) in
+multipart/byteranges*boundary=*) ;;
+*) fail "multipart: $code, $(header "$WORK/multi" Content-Type)" ;;
+esac
+python3 - "$WORK/multi" "$(header "$WORK/multi" Content-Type)" "$WORK"/expected.0 "$WORK"/expected.1 "$WORK"/expected.2 <<'EOF' || fail "multipart: parts differ"
+import sys
+body, kind, expected = open(sys.argv[1], "rb").read(), sys.argv[2], sys.argv[3:]
+boundary = kind.split("boundary=", 1)[1].strip('"').encode()
+parts = [p for p in body.split(b"--" + boundary)[1:] if not p.startswith(b"--")]
+if len(parts) != len(expected):
+    sys.exit("%d parts" % len(parts))
+for part, name in zip(parts, expected):
+    head, data = part.split(b"\r\n\r\n", 1)
+    want = open(name, "rb").read()
+    if data[:-2] != want:
+        sys.exit("part %s" % head)
+EOF
+[ "$code" = 206 ] || fail "multipart: $code"
+
+code=$(get "$WORK/none" -H "Range: bytes=$((SIZE + 10))-")
+[ "$code" = 416 ] || fail "Range past the end: $code"
+
+code=$(get "$WORK/ifrange" -H "Range: bytes=0-99" -H "If-Range: $etag")
+[ "$code" = 206 ] || fail "If-Range with the current ETag: $code"
+code=$(get "$WORK/ifrange" -H "Range: bytes=0-99" -H 'If-Range: "stale"')
+if [ "$code" != 200 ] || ! cmp -s "$WORK/ifrange" "$FILE"
+then
+	fail "If-Range with another ETag: $code"
+fi
+code=$(get "$WORK/cached" -H "If-None-Match: $etag")
+[ "$code" = 304 ] || fail "If-None-Match with the current ETag: $code"
+
+# The grant is for this URI only, also when it is given in the query
+grant=$(awk '$6 == "PayPalECGrant" { print $7 }' "$WORK/cookies")
+mkdir -p "$WORK/htdocs/paid/other"
+cp "$FILE" "$WORK/htdocs/paid/other/book.pdf"
+code=$(curl -s -o /dev/null -w '%{http_code}' "$URL/paid/other/book.pdf?grant=$grant")
+[ "$code" != 200 ] || fail "grant for /paid/book.pdf unlocked /paid/other/book.pdf"
+code=$(curl -s -o /dev/null -w '%{http_code}' "$URL/paid/book.pdf?grant=$grant")
+[ "$code" = 200 ] || fail "grant in the query: $code"
+
+echo "$MODE: $failures failures"
+[ $failures -eq 0 ]
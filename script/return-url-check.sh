@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# Stress check of per-request state under the event MPM: many threads of
+# few children serve concurrent checkouts while the stand-in answers after
+# a jittered delay, so the calls of different requests interleave. Every
+# buyer clicks a URL of its own, then returns from PayPal. Afterwards
+#
+#   the RETURNURL the stand-in got with each token is the URL clicked by
+#   the buyer who was redirected with that token,
+#   no token was handed to two buyers,
+#   every buyer downloaded exactly the file of its own URL.
+#
+#   return-url-check.sh <mod_paypal_ec.so> [buyers]
+#
+# Environment: APXS, PORT (8089), CONCURRENCY (64), THREADS (32 per child,
+# two children), STANDIN ("--latency 2 --jitter 20").
+
+set -e
+
+if [ $# -lt 1 ] || [ ! -f "$1" ]
+then
+	echo "usage: $0 <mod_paypal_ec.so> [buyers]" >&2
+	exit 2
+fi
+
+MODULE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+BUYERS=${2:-2000}
+PORT=${PORT:-8089}
+CONCURRENCY=${CONCURRENCY:-64}
+THREADS=${THREADS:-32}
+FILE_SIZE=4096
+FILES=4
+MPM=event
+STANDIN=${STANDIN:---latency 2 --jitter 20}
+EXTRA_CONF=$(printf 'StartServers 2\nServerLimit 2\nThreadsPerChild %s\nMaxRequestWorkers %s\nMinSpareThreads 1\nMaxSpareThreads %s' \
+	"$THREADS" $((THREADS * 2)) $((THREADS * 2)))
+. "$(dirname "$0")/private-httpd.sh"
+
+awk -v n="$BUYERS" -v url="$URL" -v files="$FILES" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		f = i % files
+		printf "url = \"%s/paid/book%s.pdf?buyer=%d\"\noutput = \"/dev/null\"\n", url, f ? f : "", i
+	}
+}' > "$WORK/urls.checkout"
+curl -s --parallel --parallel-max "$CONCURRENCY" -K "$WORK/urls.checkout" \
+	-w '%{http_code} %{url_effective} %{redirect_url}\n' > "$WORK/checkout" 2>/dev/null
+mkdir "$WORK/got"
+awk -v got="$WORK/got" '$1 == 302 {
+	token = $3
+	sub(/.*token=/, "", token)
+	printf "url = \"%s&status=ok&token=%s&PayerID=STRESS%d\"\noutput = \"%s/%s\"\n", $2, token, NR, got, token
+}' "$WORK/checkout" > "$WORK/urls.return"
+curl -s --parallel --parallel-max "$CONCURRENCY" -K "$WORK/urls.return" \
+	-w '%{http_code} %{url_effective}\n' > "$WORK/return" 2>/dev/null
+
+failures=$(awk -v checkout="$WORK/checkout" -v ret="$WORK/return" '
+	BEGIN { FS = "\t" }
+	$1 == "SetExpressCheckout" && $3 == "Success" { returnUrl[$2] = $4 }
+	END {
+		FS = " "
+		while ((getline < checkout) > 0) {
+			if ($1 != 302) { print "checkout: " $1 " for " $2 > "/dev/stderr"; bad++; continue }
+			token = $3
+			sub(/.*token=/, "", token)
+			if (seen[token]++) { print "checkout: token " token " given twice" > "/dev/stderr"; bad++ }
+			if (returnUrl[token] != $2 "&status=ok") {
+				print "checkout: " $2 " got the token set for " returnUrl[token] > "/dev/stderr"; bad++
+			}
+		}
+		while ((getline < ret) > 0)
+			if ($1 != 200) { print "return: " $1 " for " $2 > "/dev/stderr"; bad++ }
+		print bad + 0
+	}' "$WORK/standin.log")
+
+# Each download against the file its URL names
+while read -r code url
+do
+	token=${url##*token=}
+	token=${token%%&*}
+	file=${url%%\?*}
+	file=$WORK/htdocs/paid/${file##*/}
+	if [ "$code" = 200 ] && ! cmp -s "$WORK/got/$token" "$file"
+	then
+		echo "return: $url got another file" >&2
+		failures=$((failures + 1))
+	fi
+done < "$WORK/return"
+
+echo "mpm $mpm, $BUYERS buyers, concurrency $CONCURRENCY: $(grep -c '^302 ' "$WORK/checkout") checkouts," \
+	"$(grep -c '^200 ' "$WORK/return") downloads, $failures failures"
+[ "$failures" -eq 0 ] || { cat "$WORK/error.log" >&2; exit 1; }
@@ -0,0 +1,149 @@
+#!/bin/sh
+#
+# Soak test for the memory footprint of mod_paypal_ec. A private httpd
+# (see private-httpd.sh) is driven for the given number of hours with a mix
+# of checkouts, paid returns, cancels, replays of paid tokens and invalid
+# URLs. Every SAMPLE seconds the RSS and peak RSS of each child and the
+# module's footprint counters are appended to OUT as CSV:
+#
+#   seconds,requests,pid,rss_kb,hwm_kb,curl_inits,param_tables,decoder_grows,pool_peak
+#
+# After WARMUP seconds the RSS of the children is the baseline. At the end
+# the growth over the baseline is checked against MAX_BYTES_PER_REQUEST and
+# MAX_KB_PER_HOUR, and the script fails when either is exceeded or when any
+# request got a 5xx answer.
+#
+#   soak.sh <mod_paypal_ec.so> [hours]
+#
+# Environment: APXS, PORT (8089), CONCURRENCY (8), BATCH (5000), SAMPLE (60),
+# WARMUP (300), MAX_BYTES_PER_REQUEST (64), MAX_KB_PER_HOUR (4096),
+# OUT (soak.csv), STANDIN (unset: ApiTransport fake; "on" or the options of
+# nvp-standin.py: real calls to that stand-in, see private-httpd.sh).
+
+set -e
+
+if [ $# -lt 1 ] || [ ! -f "$1" ]
+then
+	echo "usage: $0 <mod_paypal_ec.so> [hours]" >&2
+	exit 2
+fi
+
+MODULE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+HOURS=${2:-1}
+PORT=${PORT:-8089}
+CONCURRENCY=${CONCURRENCY:-8}
+BATCH=${BATCH:-5000}
+SAMPLE=${SAMPLE:-60}
+WARMUP=${WARMUP:-300}
+MAX_BYTES_PER_REQUEST=${MAX_BYTES_PER_REQUEST:-64}
+MAX_KB_PER_HOUR=${MAX_KB_PER_HOUR:-4096}
+OUT=${OUT:-soak.csv}
+FILE_SIZE=${FILE_SIZE:-16384}
+FILES=${FILES:-4}
+EXTRA_MODULES="socache_shmcb"
+# Children live for the whole run, and replays hit the token ledger
+EXTRA_CONF="MaxConnectionsPerChild 0
+CheckoutTokenLedger shmcb"
+. "$(dirname "$0")/private-httpd.sh"
+
+# One line per child: pid,rss_kb,hwm_kb
+children() {
+	for pid in $(ps -o pid= --ppid "$(cat "$WORK/httpd.pid")")
+	do
+		awk -v pid="$pid" '/^VmRSS:/ { rss = $2 } /^VmHWM:/ { hwm = $2 }
+			END { if (rss != "") print pid "," rss "," hwm }' "/proc/$pid/status" 2>/dev/null || true
+	done
+}
+
+counters() {
+	curl -s "$URL/paypal-ec-status?auto" | awk -F': ' '
+		{ v[$1] = $2 }
+		END { printf "%d,%d,%d,%d", v["CurlInits"], v["ParamTables"], v["DecoderGrows"], v["RequestPoolPeak"] }'
+}
+
+# Ten kinds of request in turn: three checkouts, three paid returns with
+# fresh tokens, a cancel, a replay of a paid token and two invalid URLs
+batch() {
+	awk -v n="$BATCH" -v base="$1" -v url="$URL" -v files="$FILES" 'BEGIN {
+		for (i = base; i < base + n; i++) {
+			f = i % files
+			file = sprintf("%s/paid/book%s.pdf", url, f ? f : "")
+			k = i % 10
+			if (k < 3)
+				printf "url = \"%s\"\n", file
+			else if (k < 6)
+				printf "url = \"%s?status=ok&token=EC-S%d&PayerID=SOAK\"\n", file, i
+			else if (k == 6)
+				printf "url = \"%s?status=cancel&token=EC-S%d\"\n", file, i
+			else if (k == 7)
+				printf "url = \"%s?status=ok&token=EC-S%d&PayerID=SOAK\"\n", file, i - 4
+			else if (k == 8)
+				printf "url = \"%s?token=EC-S%d\"\n", file, i
+			else
+				printf "url = \"%s/paid/missing.pdf\"\n", url
+			print "output = \"/dev/null\""
+		}
+	}' > "$WORK/urls"
+	curl -s --parallel --parallel-max "$CONCURRENCY" -w '%{http_code}\n' -K "$WORK/urls" >> "$WORK/codes" 2>/dev/null
+	# Nothing reads the stand-in's call log here; keep it from filling the disk
+	if [ -n "$STANDIN" ]
+	then
+		: > "$WORK/standin.log"
+	fi
+}
+
+echo "seconds,requests,pid,rss_kb,hwm_kb,curl_inits,param_tables,decoder_grows,pool_peak" > "$OUT"
+: > "$WORK/codes"
+start=$(date +%s)
+end=$((start + HOURS * 3600))
+sampled=0
+requests=0
+now=$start
+while [ "$now" -lt "$end" ]
+do
+	batch "$requests"
+	requests=$((requests + BATCH))
+	now=$(date +%s)
+	if [ $((now - sampled)) -ge "$SAMPLE" ] || [ "$now" -ge "$end" ]
+	then
+		sampled=$now
+		c=$(counters)
+		children | while read -r line
+		do
+			echo "$((now - start)),$requests,$line,$c"
+		done >> "$OUT"
+	fi
+done
+
+errors=$(grep -c '^5' "$WORK/codes" || true)
+awk -F, -v warmup="$WARMUP" -v perRequest="$MAX_BYTES_PER_REQUEST" -v perHour="$MAX_KB_PER_HOUR" -v errors="$errors" '
+	NR == 1 { next }
+	{
+		if ($1 >= warmup && !($3 in base)) {
+			base[$3] = $4
+			baseAt[$3] = $1
+			baseRequests[$3] = $2
+		}
+		last[$3] = $4
+		lastAt = $1
+		lastRequests = $2
+	}
+	END {
+		for (pid in base) {
+			growth += last[pid] - base[pid]
+			if (baseAt[pid] > from) {
+				from = baseAt[pid]
+				fromRequests = baseRequests[pid]
+			}
+		}
+		if (lastAt <= from || lastRequests <= fromRequests) {
+			print "soak too short: no samples after the warm-up"
+			exit 1
+		}
+		bytes = growth * 1024 / (lastRequests - fromRequests)
+		hourly = growth * 3600 / (lastAt - from)
+		printf "requests: %d, 5xx: %d\n", lastRequests, errors
+		printf "growth: %d KB, %.1f bytes/request (budget %d), %.0f KB/hour (budget %d)\n",
+			growth, bytes, perRequest, hourly, perHour
+		exit (errors > 0 || bytes > perRequest || hourly > perHour)
+	}' "$OUT"
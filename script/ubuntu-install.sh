@@ -34,7 +34,7 @@ fi
 echo "-----------------------------------------"
 echo "Compiling the module..."
 cd express-checkout-apache-plugin-master/src
-apxs2 -c mod_paypal_ec.c 
+make release APXS=apxs2
 
 APACHE_MODULES_DIR=/usr/lib/apache2/modules
 
@@ -45,7 +45,7 @@ do
 	read APACHE_MODULES_DIR
 done
 
-sudo cp .libs/mod_paypal_ec.so $APACHE_MODULES_DIR
+sudo cp build/release/mod_paypal_ec.so $APACHE_MODULES_DIR
 sudo chmod 644 $APACHE_MODULES_DIR/mod_paypal_ec.so
 
 echo "-----------------------------------------"
@@ -22,550 +22,4726 @@
 #include <mod_auth.h>
 #include <curl/curl.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_reslist.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_proc.h>
+#include <ap_mpm.h>
+#include <util_cookies.h>
+#include <apr_sha1.h>
+#include <apr_base64.h>
+#include <apr_atomic.h>
+#include <apr_shm.h>
+#include <apr_version.h>
+#include <apr_buckets.h>
+#include <apr_mmap.h>
+#include <http_protocol.h>
+#include <http_request.h>
+#include <apr_global_mutex.h>
+#include <ap_provider.h>
+#include <ap_socache.h>
+#include <util_mutex.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 #include "mod_paypal_ec.h"
+#include "nvp_parse.h"
+#include "nvp_build.h"
 
 static const command_rec ec_directives[] = {
-   AP_INIT_TAKE1("Pricelist", app_config_path_handler, NULL, OR_AUTHCFG, "Pricelist for books"),
-   AP_INIT_TAKE1("ApiEndPoint", api_endpoint_handler, NULL, RSRC_CONF, "PayPal endpoint for API call"),
-   AP_INIT_TAKE1("ApiUserName", api_username_handler, NULL, RSRC_CONF, "User name for API call"),
-   AP_INIT_TAKE1("ApiPassword", api_password_handler, NULL, RSRC_CONF, "API Password"),
-   AP_INIT_TAKE1("ApiSignature", api_signature_handler, NULL, RSRC_CONF, "API signature"),
-   AP_INIT_TAKE1("ApiVersion", api_version_handler, NULL, RSRC_CONF, "API version"),
-   AP_INIT_TAKE1("CurrencyCode", api_currency_code, NULL, RSRC_CONF, "Currency Code"),
-   AP_INIT_TAKE1("ExpressCheckoutWebUrl", web_url_handler, NULL, RSRC_CONF, "URL for EC call"),
-   AP_INIT_TAKE1("ExpressCheckoutInContextUrl", incontext_url_handler, NULL, RSRC_CONF, "Incontext URL"),
-   AP_INIT_TAKE1("ExpressCheckoutType", ec_type_handler, NULL, RSRC_CONF, "Type of EC"),
+   AP_INIT_TAKE1("Pricelist", app_config_path_handler, NULL, RSRC_CONF|ACCESS_CONF, "Pricelist for books"),
+   AP_INIT_TAKE1("PricelistCheckInterval", pricelist_interval_handler, NULL, RSRC_CONF, "Seconds between checks of the Pricelist for changes"),
+   AP_INIT_TAKE1("ApiEndPoint", api_endpoint_handler, NULL, RSRC_CONF|ACCESS_CONF, "PayPal endpoint for API call"),
+   AP_INIT_TAKE1("ApiUserName", api_username_handler, NULL, RSRC_CONF|ACCESS_CONF, "User name for API call"),
+   AP_INIT_TAKE1("ApiPassword", api_password_handler, NULL, RSRC_CONF|ACCESS_CONF, "API Password"),
+   AP_INIT_TAKE1("ApiSignature", api_signature_handler, NULL, RSRC_CONF|ACCESS_CONF, "API signature"),
+   AP_INIT_TAKE1("ApiVersion", api_version_handler, NULL, RSRC_CONF|ACCESS_CONF, "API version"),
+   AP_INIT_TAKE1("CurrencyCode", api_currency_code, NULL, RSRC_CONF|ACCESS_CONF, "Currency Code"),
+   AP_INIT_TAKE1("ExpressCheckoutWebUrl", web_url_handler, NULL, RSRC_CONF|ACCESS_CONF, "URL for EC call"),
+   AP_INIT_TAKE1("ExpressCheckoutInContextUrl", incontext_url_handler, NULL, RSRC_CONF|ACCESS_CONF, "Incontext URL"),
+   AP_INIT_TAKE1("ExpressCheckoutType", ec_type_handler, NULL, RSRC_CONF|ACCESS_CONF, "Type of EC"),
+   AP_INIT_TAKE1("ApiConnectionPoolSize", api_pool_size_handler, NULL, RSRC_CONF, "Number of pooled API connections per child"),
+   AP_INIT_TAKE1("ApiConnectionIdleTimeout", api_pool_idle_timeout_handler, NULL, RSRC_CONF, "Seconds an idle API connection is kept open"),
+   AP_INIT_TAKE1("ApiConnectTimeout", api_limit_handler, (void*)&config.connectTimeout, RSRC_CONF, "Milliseconds allowed to connect to the API endpoint"),
+   AP_INIT_TAKE1("ApiCallTimeout", api_limit_handler, (void*)&config.callTimeout, RSRC_CONF, "Milliseconds allowed for one API call"),
+   AP_INIT_TAKE1("CheckoutTimeBudget", api_limit_handler, (void*)&config.checkoutBudget, RSRC_CONF, "Milliseconds a checkout request may spend in API calls, from its arrival"),
+   AP_INIT_TAKE1("ApiMaxInFlight", api_limit_handler, (void*)&config.maxInFlight, RSRC_CONF, "Maximum concurrent API calls per child"),
+   AP_INIT_TAKE1("ApiBreakerThreshold", api_limit_handler, (void*)&config.breakerThreshold, RSRC_CONF, "Consecutive API failures that open the circuit breaker"),
+   AP_INIT_TAKE1("ApiBreakerCooldown", api_limit_handler, (void*)&config.breakerCooldown, RSRC_CONF, "Seconds the circuit breaker stays open before a probe call"),
+   AP_INIT_FLAG("ApiAsyncEngine", api_async_engine_handler, NULL, RSRC_CONF, "Multiplex API calls of a child on one I/O thread"),
+   AP_INIT_TAKE1("CheckoutTraceLevel", trace_level_handler, NULL, RSRC_CONF, "Detail of the per-request trace line: off, error, info or debug"),
+   AP_INIT_TAKE1("CheckoutTraceSampleRate", trace_sample_handler, NULL, RSRC_CONF, "Trace one in N checkout requests"),
+   AP_INIT_TAKE2("DownloadGrantKey", grant_key_handler, NULL, RSRC_CONF, "Key id and secret used to sign download grants"),
+   AP_INIT_TAKE1("DownloadGrantLifetime", grant_lifetime_handler, NULL, RSRC_CONF, "Seconds a download grant stays valid"),
+   AP_INIT_TAKE1("CheckoutTokenLedger", ledger_handler, NULL, RSRC_CONF, "socache provider and arguments for the consumed token ledger, e.g. shmcb"),
+   AP_INIT_TAKE1("CheckoutTokenLedgerTimeout", ledger_timeout_handler, NULL, RSRC_CONF, "Seconds a consumed token is remembered"),
+   AP_INIT_TAKE12("DownloadDelivery", delivery_handler, NULL, RSRC_CONF|ACCESS_CONF, "Who sends a paid file: module, handler, or redirect <path>"),
+   AP_INIT_TAKE1("PreMintTokens", premint_tokens_handler, NULL, RSRC_CONF, "SetExpressCheckout tokens kept ready for each hot item"),
+   AP_INIT_TAKE1("PreMintHotItems", premint_items_handler, NULL, RSRC_CONF, "Number of most requested items that get pre-minted tokens"),
+   AP_INIT_TAKE1("PreMintTokenLifetime", premint_lifetime_handler, NULL, RSRC_CONF, "Seconds after which an unused pre-minted token is discarded"),
+   AP_INIT_TAKE1("CheckoutCoalesceWindow", coalesce_window_handler, NULL, RSRC_CONF, "Seconds a client's SetExpressCheckout token is reused for the same URL"),
+   AP_INIT_TAKE23("CheckoutRateLimit", rate_limit_handler, NULL, RSRC_CONF, "client or resource, checkouts per minute and burst"),
+   AP_INIT_FLAG("DirectCompletion", direct_completion_handler, NULL, RSRC_CONF|ACCESS_CONF, "Complete a returning checkout with DoExpressCheckoutPayment only"),
+   AP_INIT_TAKE12("PaymentLedger", payment_ledger_handler, NULL, RSRC_CONF, "File completed payments are appended to, and MB at which it is rotated"),
+   AP_INIT_TAKE12("DownloadCache", download_cache_handler, NULL, RSRC_CONF, "MB of shared memory for hot paid files, and MB cached of any one file"),
+   AP_INIT_TAKE12("PipelinedCapture", pipelined_capture_handler, NULL, RSRC_CONF|ACCESS_CONF, "On or Off, and KB of the file to read ahead while the payment is captured"),
+   AP_INIT_TAKE123("ApiTransport", api_transport_handler, NULL, RSRC_CONF, "How API calls are made: curl, fake [latency-ms [jitter-ms]], record <file> or replay <file>"),
    {NULL}
 };
 
-static void loadConfigFile(apr_pool_t *pool, apr_hash_t *data) 
+/*
+ * Parses the price list at path into data. A malformed line is logged and
+ * skipped, as it always was, so a typo makes one item unavailable instead
+ * of keeping Apache from starting. Returns NULL unless the file can't be
+ * read.
+ */
+static const char* loadConfigFile(apr_pool_t *pool, const char* path, apr_hash_t *data, server_rec* s) 
 {
 	apr_file_t *fd;
 	apr_status_t rv;
 	char line[BUFSIZE]; 
 	char* key ;
 	char* value;
-	apr_hash_index_t *index;
 	char* last;
-	apr_ssize_t len ;
+	int lineNo = 0;
 	const char* delim = "=\n\r";
 	
-	rv = apr_file_open(&fd, config.path,APR_READ,APR_OS_DEFAULT, pool);
+	rv = apr_file_open(&fd, path,APR_READ,APR_OS_DEFAULT, pool);
 	if (rv != APR_SUCCESS) 
 	{
-		AP_LOG_POOL_ERR(0, pool,"can't open %s", config.path);
-		return;
+		return apr_psprintf(pool, "can't open %s", path);
 	}      
 		   
 	while ( apr_file_gets (line, BUFSIZE,fd) == APR_SUCCESS ) 
 	{
+		lineNo++;
 		key = apr_strtok(line, delim, &last);
-		if(key != NULL) 
+		if(key == NULL || key[0] == '#') 
+		{
+			continue;
+		}
+		value = apr_strtok(NULL,delim, &last);
+		if(value == NULL || !isValidAmount(value))
 		{
-			value = apr_strtok(NULL,delim, &last);
+			ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "%s:%d: expected <name>=<amount>, line skipped", path, lineNo);
+			continue;
 		}
 		apr_hash_set(data, apr_pstrdup(pool,key), APR_HASH_KEY_STRING, apr_pstrdup(pool,value));
 	}
 	apr_file_close(fd);
-	config.loaded = 1;
+	return NULL;
+}
+
+static int isValidAmount(const char* value)
+{
+	const char* dot = ap_strchr_c(value, '.');
+	apr_size_t digits = strspn(value, "0123456789");
+	if (digits == 0)
+	{
+		return 0;
+	}
+	if (dot == NULL)
+	{
+		return value[digits] == '\0';
+	}
+	return dot == value + digits && strspn(dot + 1, "0123456789") == strlen(dot + 1) && strlen(dot + 1) <= 2;
+}
+
+/*
+ * Maps a compiled price list (see pricelist_image.h) read-only. The pages
+ * come from the page cache and are shared by every process mapping the
+ * file, so even a very large catalog costs no per-child parsing or memory.
+ */
+static const char* mapCatalog(apr_pool_t *pool, apr_file_t *fd, pricelist_snapshot* snap)
+{
+	apr_finfo_t finfo;
+	apr_mmap_t* mm;
+	const catalog_header* header;
+	apr_uint64_t end;
+
+	if (apr_file_info_get(&finfo, APR_FINFO_SIZE, fd) != APR_SUCCESS || finfo.size < (apr_off_t)sizeof(catalog_header))
+	{
+		return "truncated catalog";
+	}
+	if (apr_mmap_create(&mm, fd, 0, (apr_size_t)finfo.size, APR_MMAP_READ, pool) != APR_SUCCESS)
+	{
+		return "can't map catalog";
+	}
+	header = mm->mm;
+	if (header->version != CATALOG_VERSION || header->byteOrder != CATALOG_BYTE_ORDER)
+	{
+		return "catalog was compiled for another version or byte order";
+	}
+	end = header->stringsOffset + header->stringsSize;
+	if (header->buckets == 0 || header->stringsSize == 0
+		|| header->displacementsOffset + (apr_uint64_t)header->buckets * sizeof(apr_uint32_t) > header->entriesOffset
+		|| header->entriesOffset + (apr_uint64_t)header->count * sizeof(catalog_entry) > header->stringsOffset
+		|| end < header->stringsOffset || end > (apr_uint64_t)finfo.size
+		|| ((const char*)header)[end - 1] != '\0')
+	{
+		return "corrupt catalog";
+	}
+	snap->catalog = header;
+	snap->catalogSize = (apr_size_t)finfo.size;
+	return NULL;
+}
+
+/*
+ * Loads the price list at path into snap, choosing the format from the
+ * first bytes of the file.
+ */
+static const char* loadPricelist(apr_pool_t *pool, const char* path, pricelist_snapshot* snap, server_rec* s)
+{
+	apr_file_t *fd;
+	char magic[sizeof(((catalog_header*)0)->magic)];
+	apr_size_t len = 0;
+	const char* err;
+
+	if (apr_file_open(&fd, path, APR_READ, APR_OS_DEFAULT, pool) != APR_SUCCESS)
+	{
+		return apr_psprintf(pool, "can't open %s", path);
+	}
+	apr_file_read_full(fd, magic, sizeof(magic), &len);
+	if (len == sizeof(magic) && memcmp(magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) == 0)
+	{
+		err = mapCatalog(pool, fd, snap);
+		apr_file_close(fd);
+		return err == NULL ? NULL : apr_psprintf(pool, "%s: %s", path, err);
+	}
+	apr_file_close(fd);
+	snap->items = apr_hash_make(pool);
+	return loadConfigFile(pool, path, snap->items, s);
+}
+
+/* Returns the amount for name, or NULL when it is not for sale */
+static const char* lookupPrice(const pricelist_snapshot* snap, const char* name)
+{
+	const catalog_header* header = snap->catalog;
+	const catalog_entry* entry;
+	const char* strings;
+	apr_uint64_t h;
+	apr_size_t len;
+
+	if (header == NULL)
+	{
+		return apr_hash_get(snap->items, name, APR_HASH_KEY_STRING);
+	}
+	if (header->count == 0)
+	{
+		return NULL;
+	}
+	len = strlen(name);
+	h = catalogHash(name, len, header->seed);
+	entry = (const catalog_entry*)((const char*)header + header->entriesOffset);
+	entry += catalogSlot(h, ((const apr_uint32_t*)((const char*)header + header->displacementsOffset))[catalogBucket(h, header->buckets)], header->count) % header->count;
+	strings = (const char*)header + header->stringsOffset;
+	if (entry->nameLen != len || (apr_uint64_t)entry->name + len >= header->stringsSize
+		|| entry->amount >= header->stringsSize || memcmp(strings + entry->name, name, len) != 0)
+	{
+		return NULL;
+	}
+	return strings + entry->amount;
 }
 
+static unsigned int pricelistCount(const pricelist_snapshot* snap)
+{
+	return snap->catalog != NULL ? snap->catalog->count : apr_hash_count(snap->items);
+}
+
+/*
+ * Each distinct price list file is loaded once and shared by every section
+ * naming it; the watcher thread reloads all of them.
+ */
 static const char *app_config_path_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    config.path = arg;
-    if (config.loaded != 1)
+    ec_dir_config* conf = cfg;
+    pricelist_snapshot* snap;
+    const char* err;
+    int i;
+    for (i = 0; config.pricelists != NULL && i < config.pricelists->nelts; i++)
+    {
+        if (strcmp(APR_ARRAY_IDX(config.pricelists, i, pricelist*)->path, arg) == 0)
+        {
+            conf->pricelist = APR_ARRAY_IDX(config.pricelists, i, pricelist*);
+            return NULL;
+        }
+    }
+    {
+        snap = apr_pcalloc(cmd->pool, sizeof(pricelist_snapshot));
+        snap->items = apr_hash_make(cmd->pool);
+        if (apr_stat(&snap->finfo, arg, APR_FINFO_MTIME|APR_FINFO_SIZE, cmd->temp_pool) != APR_SUCCESS)
+        {
+            AP_LOG_POOL_ERR(0, cmd->pool,"can't open %s", arg);
+        }
+        else if ((err = loadPricelist(cmd->pool, arg, snap, cmd->server)) != NULL)
+        {
+            return err;
+        }
+        conf->pricelist = apr_pcalloc(cmd->pool, sizeof(pricelist));
+        conf->pricelist->path = arg;
+        conf->pricelist->current = snap;
+        if (config.pricelists == NULL)
+        {
+            config.pricelists = apr_array_make(cmd->pool, 2, sizeof(pricelist*));
+        }
+        APR_ARRAY_PUSH(config.pricelists, pricelist*) = conf->pricelist;
+    }
+    return NULL;
+}
+
+static const char *pricelist_interval_handler(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    int interval = atoi(arg);
+    if (interval < 0)
     {
-        config.book_data = apr_hash_make(cmd->pool);
-        loadConfigFile(cmd->pool, config.book_data);
+        return "PricelistCheckInterval must be a number of seconds, 0 disables reloading";
     }
+    /* 0 in the configuration means off, 0 in the struct means unset */
+    config.pricelistCheckInterval = interval == 0 ? -1 : interval;
     return NULL;
 }
 
+static apr_status_t releasePricelist(void *data)
+{
+    pricelist_snapshot* snap = data;
+    apr_atomic_dec32(&snap->refs);
+    return APR_SUCCESS;
+}
+
+/*
+ * Returns the current price list snapshot pinned for the lifetime of the
+ * request. Lookups never take a lock: the watcher thread publishes a new
+ * snapshot with an atomic pointer swap and only frees a retired one once
+ * no request holds it any more.
+ */
+static pricelist_snapshot* acquirePricelist(request_rec *r, pricelist* list)
+{
+    pricelist_snapshot* snap;
+    if (list == NULL)
+    {
+        return NULL;
+    }
+    while (1)
+    {
+        snap = (pricelist_snapshot*)list->current;
+        apr_atomic_inc32(&snap->refs);
+        if (snap == list->current)
+        {
+            break;
+        }
+        apr_atomic_dec32(&snap->refs);
+    }
+    apr_pool_cleanup_register(r->pool, snap, releasePricelist, apr_pool_cleanup_null);
+    return snap;
+}
+
+#if APR_HAS_THREADS
+/*
+ * Re-parses the price list when its mtime or size changed. A file that
+ * can't be read or a corrupt catalog is reported once and the old snapshot
+ * stays live.
+ */
+static void reloadPricelist(pricelist* list, apr_pool_t* pool, apr_pool_t* scratch, server_rec* s)
+{
+    apr_finfo_t finfo;
+    apr_pool_t* snapPool;
+    pricelist_snapshot* snap;
+    pricelist_snapshot* old = (pricelist_snapshot*)list->current;
+    const char* err;
+
+    if (apr_stat(&finfo, list->path, APR_FINFO_MTIME|APR_FINFO_SIZE, scratch) != APR_SUCCESS)
+    {
+        return;
+    }
+    if ((finfo.mtime == old->finfo.mtime && finfo.size == old->finfo.size)
+        || (finfo.mtime == list->failed.mtime && finfo.size == list->failed.size))
+    {
+        return;
+    }
+    apr_pool_create(&snapPool, pool);
+    snap = apr_pcalloc(snapPool, sizeof(pricelist_snapshot));
+    snap->pool = snapPool;
+    snap->finfo = finfo;
+    err = loadPricelist(snapPool, list->path, snap, s);
+    if (err != NULL)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Pricelist not reloaded, keeping the previous one: %s", err);
+        list->failed = finfo;
+        apr_pool_destroy(snapPool);
+        return;
+    }
+    apr_atomic_xchgptr(&list->current, snap);
+    old->retired = apr_time_now();
+    old->nextRetired = list->retired;
+    list->retired = old;
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "Pricelist %s reloaded with %u items", list->path, pricelistCount(snap));
+}
+
+/*
+ * A retired snapshot is freed once no request holds it and it has been
+ * retired for a full check interval, which covers a reader that loaded
+ * the old pointer but has not pinned it yet.
+ */
+static void reclaimPricelists(pricelist* list, apr_interval_time_t grace)
+{
+    pricelist_snapshot** link = &list->retired;
+    apr_time_t now = apr_time_now();
+    while (*link != NULL)
+    {
+        pricelist_snapshot* snap = *link;
+        if (snap->pool != NULL && apr_atomic_read32(&snap->refs) == 0 && now - snap->retired > grace)
+        {
+            *link = snap->nextRetired;
+            apr_pool_destroy(snap->pool);
+        }
+        else
+        {
+            link = &snap->nextRetired;
+        }
+    }
+}
+
+static void* APR_THREAD_FUNC watchPricelist(apr_thread_t *thread, void *data)
+{
+    server_rec* s = data;
+    apr_interval_time_t interval = apr_time_from_sec(config.pricelistCheckInterval > 0 ? config.pricelistCheckInterval : DEFAULT_PRICELIST_CHECK_INTERVAL);
+    apr_pool_t* pool;
+    apr_pool_t* scratch;
+    int i;
+
+    apr_pool_create(&pool, pricelistWatcher.pool);
+    apr_pool_create(&scratch, pool);
+    apr_thread_mutex_lock(pricelistWatcher.lock);
+    while (!pricelistWatcher.stop)
+    {
+        apr_thread_cond_timedwait(pricelistWatcher.cond, pricelistWatcher.lock, interval);
+        if (pricelistWatcher.stop)
+        {
+            break;
+        }
+        apr_thread_mutex_unlock(pricelistWatcher.lock);
+        for (i = 0; i < config.pricelists->nelts; i++)
+        {
+            reloadPricelist(APR_ARRAY_IDX(config.pricelists, i, pricelist*), pool, scratch, s);
+            reclaimPricelists(APR_ARRAY_IDX(config.pricelists, i, pricelist*), interval);
+        }
+        apr_pool_clear(scratch);
+        apr_thread_mutex_lock(pricelistWatcher.lock);
+    }
+    apr_thread_mutex_unlock(pricelistWatcher.lock);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t stopPricelistWatcher(void *data)
+{
+    apr_status_t rv;
+    apr_thread_mutex_lock(pricelistWatcher.lock);
+    pricelistWatcher.stop = 1;
+    apr_thread_cond_signal(pricelistWatcher.cond);
+    apr_thread_mutex_unlock(pricelistWatcher.lock);
+    apr_thread_join(&rv, pricelistWatcher.thread);
+    return APR_SUCCESS;
+}
+
+static void startPricelistWatcher(apr_pool_t *p, server_rec *s)
+{
+    if (config.pricelists == NULL || config.pricelistCheckInterval < 0)
+    {
+        return;
+    }
+    apr_pool_create(&pricelistWatcher.pool, p);
+    apr_thread_mutex_create(&pricelistWatcher.lock, APR_THREAD_MUTEX_DEFAULT, p);
+    apr_thread_cond_create(&pricelistWatcher.cond, p);
+    if (apr_thread_create(&pricelistWatcher.thread, NULL, watchPricelist, s, p) != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Unable to start the Pricelist watcher thread");
+        return;
+    }
+    apr_pool_pre_cleanup_register(p, NULL, stopPricelistWatcher);
+}
+#endif
+
+/*
+ * The API account of a section: endpoint, credentials and currency. Every
+ * account is registered so post_config can complete it from the enclosing
+ * server and compile its request templates, and so a background thread can
+ * refer to it by index.
+ */
+static ec_account* dirAccount(cmd_parms *cmd, ec_dir_config* conf)
+{
+    if (conf->account == NULL)
+    {
+        conf->account = apr_pcalloc(cmd->pool, sizeof(ec_account));
+        conf->account->server = cmd->server;
+        conf->account->serverLevel = cmd->path == NULL;
+        if (config.accounts == NULL)
+        {
+            config.accounts = apr_array_make(cmd->pool, 4, sizeof(ec_account*));
+        }
+        conf->account->index = config.accounts->nelts;
+        APR_ARRAY_PUSH(config.accounts, ec_account*) = conf->account;
+    }
+    return conf->account;
+}
+
 static const char *api_endpoint_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    config.endPoint= arg;
+    dirAccount(cmd, cfg)->endPoint = arg;
     return NULL;
 }
 
 static const char *api_username_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    config.userName= arg;
+    dirAccount(cmd, cfg)->userName = arg;
     return NULL;
 }
 
 static const char *api_password_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    config.password= arg;
+    dirAccount(cmd, cfg)->password = arg;
     return NULL;
 }
 
 static const char *api_signature_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    config.signature= arg;
+    dirAccount(cmd, cfg)->signature = arg;
     return NULL;
 }
 
 static const char *api_version_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    config.version= arg;
+    dirAccount(cmd, cfg)->version = arg;
     return NULL;
 }
 
 static const char *api_currency_code(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    config.currency_code = arg;
+    dirAccount(cmd, cfg)->currencyCode = arg;
     return NULL;
 }
 
 static const char *web_url_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    config.ecWebUrl= arg;
+    ((ec_dir_config*)cfg)->ecWebUrl = arg;
     return NULL;
 }
 
 static const char *incontext_url_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    config.ecIncontextUrl= arg;
+    ((ec_dir_config*)cfg)->ecIncontextUrl = arg;
     return NULL;
 }
 
 static const char *ec_type_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    config.ecType = arg;
+    ((ec_dir_config*)cfg)->ecType = arg;
     return NULL;
 }
 
-
-static int authenticate_user(request_rec *r)
+static const char *api_pool_size_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    const char *authtype;
-    AP_LOG_REQUEST_ERR(0, r, "Begin Authenticate_user");
-    authtype = ap_auth_type(r);
-    if (!authtype || apr_strnatcasecmp(authtype, "ExpressCheckout")) 
+    config.poolSize = atoi(arg);
+    if (config.poolSize <= 0)
     {
-        return DECLINED;
+        return "ApiConnectionPoolSize must be a positive number";
     }
-    /* We need an authentication realm. */
-    if (!ap_auth_name(r)) 
+    return NULL;
+}
+
+/* Shared by the timeout and limit directives; cmd->info points at the field */
+static const char *api_limit_handler(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    int *field = cmd->info;
+    *field = atoi(arg);
+    if (*field <= 0)
     {
-	AP_LOG_REQUEST_ERR(0, r, "need AuthName: %s", r->uri);
-        return HTTP_INTERNAL_SERVER_ERROR;
+        return apr_psprintf(cmd->pool, "%s must be a positive number", cmd->cmd->name);
     }
-    r->ap_auth_type = "ExpressCheckout";
-    return ec_handler(r);
+    return NULL;
 }
 
-static int ec_handler(request_rec *r)
+static const char *api_async_engine_handler(cmd_parms *cmd, void *cfg, int flag)
 {
-    char *uri = r->unparsed_uri;
-    AP_LOG_REQUEST_ERR(0, r, "Begin ec_handler");
-    AP_LOG_REQUEST_ERR(0, r, "the_request=%s",r->the_request);
-    AP_LOG_REQUEST_ERR(0, r, "hostname=%s",r->hostname);
-    AP_LOG_REQUEST_ERR(0, r, "handler = %s",r->handler);
-    config.appContext = ap_construct_url(r->pool, r->unparsed_uri, r);
+#if !NVP_ENGINE_SUPPORTED
+    if (flag)
+    {
+        return "ApiAsyncEngine needs a threaded APR and libcurl 7.68.0 or later";
+    }
+#endif
+    config.asyncEngine = flag;
+    return NULL;
+}
 
-    if (r->method_number != M_GET)
+static const char *api_pool_idle_timeout_handler(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    config.poolIdleTimeout = atoi(arg);
+    if (config.poolIdleTimeout <= 0)
     {
-        return HTTP_METHOD_NOT_ALLOWED;
+        return "ApiConnectionIdleTimeout must be a positive number of seconds";
     }
-    apr_table_t*  data = apr_table_make(r->pool, 100000);
-    parseInput(uri, data, r->pool);
-    int status =0;
-    const char* resource_name = apr_table_get(data, "NAME");
-    char* amt = apr_hash_get(config.book_data, resource_name, APR_HASH_KEY_STRING);
-    if(amt == NULL)
+    return NULL;
+}
+
+static const char *trace_level_handler(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    if (strcasecmp(arg, "off") == 0)
     {
-        AP_LOG_REQUEST_ERR(0, r, "Requested resource is not available!");
-        const char* errorMsg = "Requested resource is not available!";
-        sendResponse(r, errorMsg);
-        return HTTP_UNAUTHORIZED;
+        config.traceLevel = TRACE_OFF;
     }
-    apr_table_addn(data, "AMOUNT", amt);
-    const char* token = apr_table_get(data, "token");
-    const char* statusStr = apr_table_get(data, "status");
-    const char* payerId = apr_table_get(data, "PayerID");
-    if(token == NULL && statusStr == NULL)
+    else if (strcasecmp(arg, "error") == 0)
     {
-        status = validate(r, data);
-        if(status > 0) 
-        {
-            AP_LOG_REQUEST_ERR(0, r, "Invalid URL!!!. Hence returning the Error Page with the status %d", status);
-            return HTTP_UNAUTHORIZED;
-	}
-	status = setExpressCheckout(r, data);
-	if(status > 0) 
-	{
-	    AP_LOG_REQUEST_ERR(0, r, "PayPal SetExpressCheckout API has been failed with the status %d", status);
-	    return HTTP_UNAUTHORIZED;
-	}
-	redirectToPayPal(r, data);
-	return HTTP_MOVED_TEMPORARILY;
-    } 
-    else if(statusStr != NULL && apr_strnatcasecmp(statusStr, "cancel") == 0) 
+        config.traceLevel = TRACE_ERROR;
+    }
+    else if (strcasecmp(arg, "info") == 0)
     {
-	AP_LOG_REQUEST_ERR(0, r, "Payment has been cancelled by the user.");
-	const char* errorMsg = "Payment has been cancelled by the user. Make the payment via PayPal to download.";
-	sendResponse(r, errorMsg);
-	return HTTP_UNAUTHORIZED;
-    } 
-    else if(token != NULL && strlen(token) > 0 && payerId != NULL && strlen(payerId) > 0 && statusStr != NULL && apr_strnatcasecmp(statusStr, "ok") == 0) 
+        config.traceLevel = TRACE_INFO;
+    }
+    else if (strcasecmp(arg, "debug") == 0)
     {
-	status = getExpressCheckout(r, data);
-	if(status > 0) 
-	{
-	    const char* errorMsg = "This token was already processed and it can not be used any more. Download can be succcess only when you make new payment via PayPal.";
-	    sendResponse(r, errorMsg);
-	    return HTTP_UNAUTHORIZED;
-	}
-	status = doExpressCheckout(r, data);
-	if(status > 0) 
-	{
-	    const char* errorMsg = "Payment has been failed. Download can be succcess only when you make the payment via PayPal.";
-	    sendResponse(r, errorMsg);
-	    return HTTP_UNAUTHORIZED;
-	}
-	status = sendFile(r, data);
-	if(status > 0) 
-	{
-	    return HTTP_INTERNAL_SERVER_ERROR;
-	}
-	return OK;
-    }  
-    else 
+        config.traceLevel = TRACE_DEBUG;
+    }
+    else
     {
-        AP_LOG_REQUEST_ERR(0, r, "Unable to process the request. Invalid URL .");
-	const char* errorMsg = "Unable to process the request. Invalid URL!!!";
-	sendResponse(r, errorMsg);
-	return HTTP_UNAUTHORIZED;
+        return "CheckoutTraceLevel must be one of off, error, info or debug";
     }
-} 
+    return NULL;
+}
 
-static int sendFile(request_rec *r, apr_table_t *data) {
-   int status = 0;
-   apr_file_t *fd;
-   apr_size_t sz;
-   apr_status_t rv;
-   if (r->filename == NULL) {
-      AP_LOG_REQUEST_ERR(0, r,"Incomplete request_rec!");
-      status = 1;
-      return status;
-   }
-   char* ext = ap_strrchr_c(r->filename, '.') ;
-   if(apr_strnatcasecmp(ext, ".pdf") ==0) {
-      AP_LOG_REQUEST_ERR(0, r, "Downloading pdf file");
-      ap_set_content_type(r, "application/pdf");
-   } else {
-      ap_set_content_type(r, "application/pdf");
-   }
-   ap_set_content_length(r, r->finfo.size);
-   if (r->finfo.mtime) {
-               char *datestring = apr_palloc(r->pool, APR_RFC822_DATE_LEN);
-               apr_rfc822_date(datestring, r->finfo.mtime);
-               apr_table_setn(r->headers_out, "Last-Modified", datestring);
-   }
-   rv = apr_file_open(&fd, r->filename,
-                        APR_READ|APR_SHARELOCK|APR_SENDFILE_ENABLED,
-                        APR_OS_DEFAULT, r->pool);
-   if (rv != APR_SUCCESS) {
-	AP_LOG_REQUEST_ERR(0, r,"can't open %s", r->filename);
-      return HTTP_NOT_FOUND ;
-   }
-   ap_send_fd(fd, r, 0, r->finfo.size, &sz);
-   apr_file_close(fd);
-   return status;
+static const char *trace_sample_handler(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    config.traceSampleRate = atoi(arg);
+    if (config.traceSampleRate <= 0)
+    {
+        return "CheckoutTraceSampleRate must be a positive number";
+    }
+    return NULL;
 }
 
+/*
+ * Every DownloadGrantKey is accepted when a grant is verified, the last
+ * one configured signs new grants. Rotating a key means adding the new
+ * key after the old one and dropping the old one once its grants expired.
+ */
+static const char *grant_key_handler(cmd_parms *cmd, void *cfg, const char *id, const char *secret)
+{
+    ec_server_config* srv = ap_get_module_config(cmd->server->module_config, &paypal_ec_module);
+    grant_key* key;
+    unsigned char block[GRANT_BLOCK_SIZE];
+    unsigned char pad[GRANT_BLOCK_SIZE];
+    apr_size_t len = strlen(secret);
+    int i;
+    if (strlen(id) == 0 || strspn(id, GRANT_KEY_ID_CHARS) != strlen(id))
+    {
+        return "DownloadGrantKey id may only contain letters, digits, '-' and '_'";
+    }
+    if (len < 16)
+    {
+        return "DownloadGrantKey secret must be at least 16 characters long";
+    }
+    if (srv->grantKeys == NULL)
+    {
+        srv->grantKeys = apr_array_make(cmd->pool, 2, sizeof(grant_key));
+    }
+    key = &APR_ARRAY_PUSH(srv->grantKeys, grant_key);
+    key->id = id;
 
-static int sendResponse(request_rec *r, const char* str) {
-   ap_set_content_type(r, "text/html");
-   ap_rputs("<HTML> <HEAD><TITLE>Error</TITLE></HEAD><BODY>", r);
-   ap_rputs("<strong align=\"center\">", r);
-   ap_rputs(str, r);
-   ap_rputs("</strong></BODY></HTML>", r);
-   return 0;
+    /* Precompute the HMAC inner and outer states once per key */
+    memset(block, 0, sizeof(block));
+    if (len > GRANT_BLOCK_SIZE)
+    {
+        apr_sha1_ctx_t ctx;
+        apr_sha1_init(&ctx);
+        apr_sha1_update_binary(&ctx, (const unsigned char*)secret, len);
+        apr_sha1_final(block, &ctx);
+    }
+    else
+    {
+        memcpy(block, secret, len);
+    }
+    for (i = 0; i < GRANT_BLOCK_SIZE; i++)
+    {
+        pad[i] = block[i] ^ 0x36;
+    }
+    apr_sha1_init(&key->inner);
+    apr_sha1_update_binary(&key->inner, pad, GRANT_BLOCK_SIZE);
+    for (i = 0; i < GRANT_BLOCK_SIZE; i++)
+    {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    apr_sha1_init(&key->outer);
+    apr_sha1_update_binary(&key->outer, pad, GRANT_BLOCK_SIZE);
+    return NULL;
 }
 
-
-static void redirectToPayPal(request_rec *r, apr_table_t* data) 
+static const char *grant_lifetime_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-   const char* token = apr_table_get(data, "TOKEN");
-   const char* weburl;
-   if(apr_strnatcasecmp(config.ecType, "Basic") ==0) 
-   {
-	weburl = apr_pstrcat(r->pool, config.ecWebUrl, token, NULL);
-   } 
-   else if(apr_strnatcasecmp(config.ecType, "InContext") == 0) 
-   {
-	weburl = apr_pstrcat(r->pool, config.ecIncontextUrl,token, NULL);
-   }
-   AP_LOG_REQUEST_ERR(0, r, "weburl = %s", weburl);
-   apr_table_setn(r->err_headers_out, "Location", weburl);
+    ec_server_config* srv = ap_get_module_config(cmd->server->module_config, &paypal_ec_module);
+    srv->grantLifetime = atoi(arg);
+    if (srv->grantLifetime <= 0)
+    {
+        return "DownloadGrantLifetime must be a positive number of seconds";
+    }
+    return NULL;
 }
 
-static int validate(request_rec *r, apr_table_t* data) 
+/*
+ * The argument is a socache provider name with optional provider arguments
+ * after a colon, the same syntax as SSLSessionCache: shmcb, shmcb:/path(size),
+ * memcache:host:port.
+ */
+static const char *ledger_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-  const char* amt = apr_table_get(data, "AMOUNT");
-  const char* name = apr_table_get(data, "NAME"); 
-  int status = 0;
-  if(amt == NULL  || strlen(amt) == 0) 
-  {
-     status = 1;
-  }
-  if(name == NULL || strlen(name) == 0) 
-  {
-     status = 2;
-  }
-  if(status > 0)
-  {
-     ap_set_content_type(r, "text/html");
-     ap_rputs("<HTML> <HEAD><TITLE>Error</TITLE></HEAD><BODY>", r);
-     ap_rputs("<strong align=\"center\">", r);
-     ap_rputs("Invalid Download URL either item name or amount is missing", r);
-     ap_rputs("</strong></BODY></HTML>", r);
-  }
-  return status;
+    const char *sep = ap_strchr_c(arg, ':');
+    const char *name = sep ? apr_pstrmemdup(cmd->temp_pool, arg, sep - arg) : arg;
+    const char *err;
+    config.ledgerProvider = NULL;
+    config.ledger = NULL;
+    if (strcasecmp(arg, "none") == 0)
+    {
+        return NULL;
+    }
+    config.ledgerProvider = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name, AP_SOCACHE_PROVIDER_VERSION);
+    if (config.ledgerProvider == NULL)
+    {
+        return apr_psprintf(cmd->pool, "CheckoutTokenLedger: unknown socache provider '%s', is mod_socache_%s loaded?", name, name);
+    }
+    err = config.ledgerProvider->create(&config.ledger, sep ? sep + 1 : NULL, cmd->temp_pool, cmd->pool);
+    if (err != NULL)
+    {
+        config.ledgerProvider = NULL;
+        return apr_psprintf(cmd->pool, "CheckoutTokenLedger: %s", err);
+    }
+    return NULL;
 }
 
-static void parseInput(char* token, apr_table_t* data, apr_pool_t* pool) 
+static const char *ledger_timeout_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-   int i = 0;
-   int start = 0;
-   char* name;
-   char* key;
-   char* value;
-   int nameFound = 1;
-   while(token[i] != '\0') 
-   {
-     i++;
-     if(token[i] == '/') {
-       start = i +1;
-       continue;
-     }
-     if(token[i] == '?') {
-       apr_table_setn(data, "NAME",apr_pstrmemdup(pool,token+start, (i - start)));
-       nameFound = 0;
-       start = i+1;
-       continue;
-     }
-     if(token[i] == '=') {
-       key = apr_pstrmemdup(pool,token+start, (i - start));
-       start = i+1;
-       continue;
-     }
-     if(token[i] == '&') {
-       value = apr_pstrmemdup(pool,token+start, (i - start));
-       start = i+1;
-       apr_table_setn(data, key, value);
-     }
-   }
-   if(nameFound != 0) {
-      key = "NAME";
-   } 
-   if(key != NULL && strcmp(key, "AMOUNT") != 0) {
-      value = apr_pstrmemdup(pool,token+start, (i - start));
-      apr_table_setn(data, key, value);
-   }
-} 
+    config.ledgerTimeout = atoi(arg);
+    if (config.ledgerTimeout <= 0)
+    {
+        return "CheckoutTokenLedgerTimeout must be a positive number of seconds";
+    }
+    return NULL;
+}
+
+static const char *premint_tokens_handler(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    config.preMintTokens = atoi(arg);
+    if (config.preMintTokens < 0 || config.preMintTokens > MINT_MAX_DEPTH)
+    {
+        return apr_psprintf(cmd->pool, "PreMintTokens must be between 0 and %d", MINT_MAX_DEPTH);
+    }
+    return NULL;
+}
+
+static const char *premint_items_handler(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    config.preMintHotItems = atoi(arg);
+    if (config.preMintHotItems <= 0 || config.preMintHotItems > MINT_SLOTS)
+    {
+        return apr_psprintf(cmd->pool, "PreMintHotItems must be between 1 and %d", MINT_SLOTS);
+    }
+    return NULL;
+}
+
+static const char *premint_lifetime_handler(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    config.preMintLifetime = atoi(arg);
+    if (config.preMintLifetime <= 0 || config.preMintLifetime >= 10800)
+    {
+        return "PreMintTokenLifetime must be a positive number of seconds below the 3 hour token lifetime";
+    }
+    return NULL;
+}
 
-static size_t writefunc(void *ptr, size_t size, size_t nmemb, string *s)
+static const char *coalesce_window_handler(cmd_parms *cmd, void *cfg, const char *arg)
 {
-  s->ptr = apr_pstrmemdup(s->pool, ptr, size*nmemb);
-  return size*nmemb;
+    config.coalesceWindow = atoi(arg);
+    if (config.coalesceWindow < 0 || config.coalesceWindow >= 10800)
+    {
+        return "CheckoutCoalesceWindow must be a number of seconds below the 3 hour token lifetime";
+    }
+    return NULL;
 }
 
-static char* populateApiCredential(apr_pool_t* pool) {
-   return apr_pstrcat(pool, config.endPoint, "?USER=", config.userName,"&PWD=",config.password, "&SIGNATURE=", config.signature, "&VERSION=", config.version,NULL);
+static const char *rate_limit_handler(cmd_parms *cmd, void *cfg, const char *scope, const char *rate, const char *burst)
+{
+    int perMinute = atoi(rate);
+    int size = burst != NULL ? atoi(burst) : DEFAULT_RATE_BURST;
+    if (perMinute <= 0 || perMinute > 60000)
+    {
+        return "CheckoutRateLimit rate must be between 1 and 60000 checkouts per minute";
+    }
+    if (size <= 0 || size > 1000)
+    {
+        return "CheckoutRateLimit burst must be between 1 and 1000";
+    }
+    if (strcasecmp(scope, "client") == 0)
+    {
+        config.clientRate = perMinute;
+        config.clientBurst = size;
+    }
+    else if (strcasecmp(scope, "resource") == 0)
+    {
+        config.resourceRate = perMinute;
+        config.resourceBurst = size;
+    }
+    else
+    {
+        return "CheckoutRateLimit applies to client or resource";
+    }
+    return NULL;
 }
 
-static void  populateSetExpressCheckoutURL(char** ptr, apr_table_t* data,apr_pool_t* pool) {
-   const char* amt = apr_table_get(data, "AMOUNT");
-   const char* name = apr_table_get(data, "NAME");
+static const char *direct_completion_handler(cmd_parms *cmd, void *cfg, int flag)
+{
+    ((ec_dir_config*)cfg)->directCompletion = flag;
+    return NULL;
+}
 
-   *ptr = apr_pstrcat(pool, populateApiCredential(pool),"&METHOD=SetExpressCheckout&","RETURNURL=", config.appContext, "?status=ok", "&CANCELURL=", config.appContext,"?status=cancel", "&PAYMENTREQUEST_0_AMT=", amt,"&PAYMENTREQUEST_0_CURRENCYCODE=",config.currency_code ,"&PAYMENTREQUEST_0_ITEMAMT=", amt,"&PAYMENTREQUEST_0_PAYMENTACTION=Sale&L_PAYMENTREQUEST_0_NAME0=", name, "&L_PAYMENTREQUEST_0_AMT0=", amt, "&L_PAYMENTREQUEST_0_ITEMCATEGORY0=Digital","&REQCONFIRMSHIPPING=0","&NOSHIPPING=1","&L_PAYMENTREQUEST_0_QTY0=1",NULL); 
+static const char *delivery_handler(cmd_parms *cmd, void *cfg, const char *mode, const char *path)
+{
+    ec_dir_config* conf = cfg;
+    conf->deliveryPath = NULL;
+    if (strcasecmp(mode, "module") == 0 && path == NULL)
+    {
+        conf->deliveryMode = DELIVERY_MODULE;
+    }
+    else if (strcasecmp(mode, "handler") == 0 && path == NULL)
+    {
+        conf->deliveryMode = DELIVERY_HANDLER;
+    }
+    else if (strcasecmp(mode, "redirect") == 0 && path != NULL && path[0] == '/')
+    {
+        conf->deliveryMode = DELIVERY_REDIRECT;
+        conf->deliveryPath = path;
+        conf->deliveryBase = cmd->path;
+    }
+    else
+    {
+        return "DownloadDelivery must be module, handler, or redirect followed by a path starting with /";
+    }
+    return NULL;
 }
 
-static void  populateDoExpressCheckoutURL(char** ptr, apr_table_t* data,apr_pool_t* pool) {
-   const char* amt = apr_table_get(data, "AMOUNT");
-   const char* name = apr_table_get(data, "NAME");
-   const char* token = apr_table_get(data, "token");
-   const char* payerId = apr_table_get(data, "PayerID");
-   *ptr = apr_pstrcat(pool, populateApiCredential(pool),"&METHOD=DoExpressCheckoutPayment&", "TOKEN=", token, "&PAYERID=", payerId, "&PAYMENTREQUEST_0_AMT=",amt, "&PAYMENTREQUEST_0_ITEMAMT=", amt, "&PAYMENTREQUEST_0_PAYMENTACTION=Sale&L_PAYMENTREQUEST_0_NAME0=", name, "&L_PAYMENTREQUEST_0_AMT0=", amt, "&L_PAYMENTREQUEST_0_ITEMCATEGORY0=Digital","&L_PAYMENTREQUEST_0_QTY0=1",NULL); 
+static const char *payment_ledger_handler(cmd_parms *cmd, void *cfg, const char *path, const char *rotate)
+{
+    config.paymentLedger = ap_server_root_relative(cmd->pool, path);
+    config.paymentRotate = rotate != NULL ? atoi(rotate) : DEFAULT_PAYMENT_ROTATE_MB;
+    if (config.paymentLedger == NULL)
+    {
+        return apr_psprintf(cmd->pool, "PaymentLedger: invalid path %s", path);
+    }
+    if (config.paymentRotate < 0 || config.paymentRotate > 65536)
+    {
+        return "PaymentLedger rotation size must be between 0 (never) and 65536 MB";
+    }
+    return NULL;
 }
 
-static void  populateGetExpressCheckoutURL(char** ptr, apr_table_t* data,apr_pool_t* pool) {
-   const char* token = apr_table_get(data, "token");
-   *ptr = apr_pstrcat(pool, populateApiCredential(pool),"&METHOD=GetExpressCheckoutDetails&", "TOKEN=", token,NULL);
+static const char *download_cache_handler(cmd_parms *cmd, void *cfg, const char *size, const char *fileLimit)
+{
+    config.cacheSize = atoi(size);
+    config.cacheFileLimit = fileLimit != NULL ? atoi(fileLimit) : DEFAULT_CACHE_FILE_MB;
+    if (config.cacheSize < 0 || config.cacheSize > 65536)
+    {
+        return "DownloadCache size must be between 0 and 65536 MB";
+    }
+    if (config.cacheFileLimit <= 0 || config.cacheFileLimit > 4096)
+    {
+        return "DownloadCache file limit must be between 1 and 4096 MB";
+    }
+    return NULL;
 }
 
-static int doExpressCheckout(request_rec *r, apr_table_t* data) {
- int status = 0;
-    CURL *curl;
-    CURLcode res;
-    AP_LOG_REQUEST_ERR(0, r, "Begin DoExpressCheckout.");
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
-    if(curl)
-    {
-        string s;
-        char* ptr;
-        populateDoExpressCheckoutURL(&ptr, data,r->pool);
-        AP_LOG_REQUEST_ERR(0, r, "Do EC request = %s",ptr);
-	s.pool = r->pool;
-        curl_easy_setopt(curl, CURLOPT_URL, ptr);
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 0L);
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST,1L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &s);
-        res = curl_easy_perform(curl);
-        if(res != CURLE_OK) 
-        {
-	    AP_LOG_REQUEST_ERR(0, r, "DoExpressCheckout curl_easy_perform() failed: %s, %d\n",curl_easy_strerror(res), res);
-            status = 1;
-        } 
-        else 
-	{
-           AP_LOG_REQUEST_ERR(0, r, "response = %s",s.ptr);
-           char* line = curl_unescape(s.ptr, strlen(s.ptr));
-           parseInput(line, data,r->pool);
-	   AP_LOG_REQUEST_ERR(0, r, "DoExpressCheckout APU response is %s", s.ptr);
-           const char* ack = apr_table_get(data, "ACK");
-	   AP_LOG_REQUEST_ERR(0, r, "DoExpressCheckout ACK status %s", ack);
-           if(apr_strnatcasecmp(ack, "Success") == 0) 
-           {
-	       AP_LOG_REQUEST_ERR(0, r, "DoExpressCheckout ACK status %s", ack);
-               const char* transactionId = apr_table_get(data, "PAYMENTINFO_0_TRANSACTIONID");
-           } 
-           else 
-           {
-               AP_LOG_REQUEST_ERR(0, r, "DoExpressCheckout API has been failed: %s", s.ptr);
-               status = 3;
-           }
-        }
-        curl_easy_cleanup(curl);
-    } 
+static const char *pipelined_capture_handler(cmd_parms *cmd, void *cfg, const char *flag, const char *prefix)
+{
+    ec_dir_config* conf = cfg;
+    if (strcasecmp(flag, "on") == 0)
+    {
+        conf->pipelinedCapture = 1;
+    }
+    else if (strcasecmp(flag, "off") == 0)
+    {
+        conf->pipelinedCapture = 0;
+    }
     else
     {
-	AP_LOG_REQUEST_ERR(0, r, "DoExpressCheckout CURL is false.");
-        status = 2;
+        return "PipelinedCapture must be On or Off";
     }
-    curl_global_cleanup();
-    AP_LOG_REQUEST_ERR(0, r, "DoExpressCheckout API has been completed.");
-    return status;
+    conf->capturePrefix = prefix != NULL ? atoi(prefix) : 0;
+    if (conf->capturePrefix < 0 || conf->capturePrefix > CAPTURE_MAX_PREFIX_KB)
+    {
+        return apr_psprintf(cmd->pool, "PipelinedCapture read ahead must be between 0 and %d KB", CAPTURE_MAX_PREFIX_KB);
+    }
+    return NULL;
 }
 
-static int getExpressCheckout(request_rec *r, apr_table_t* data) {
- int status = 0;
-    CURL *curl;
-    CURLcode res;
-	AP_LOG_REQUEST_ERR(0, r, "GetExpressCheckout API has been started.");
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
-    if(curl) {
-        string s;
-        char* ptr;
-        populateGetExpressCheckoutURL(&ptr, data,r->pool);
-        AP_LOG_REQUEST_ERR(0, r, "Get EC request = %s",ptr);
-	s.pool = r->pool;
-        curl_easy_setopt(curl, CURLOPT_URL, ptr);
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 0L);
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST,1L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &s);
-        res = curl_easy_perform(curl);
-        if(res != CURLE_OK) {
-		AP_LOG_REQUEST_ERR(0, r, "GetExpressCheckout curl_easy_perform() failed: %s, %d\n",curl_easy_strerror(res), res);
-            status = 1;
-        } else {
-	   AP_LOG_REQUEST_ERR(0, r, "REsponse = %s",s.ptr);
-           char* line = curl_unescape(s.ptr, strlen(s.ptr));
-           parseInput(line, data,r->pool);
-           const char* ack = apr_table_get(data, "ACK");
-           if(apr_strnatcasecmp(ack, "Success") == 0) {
-              const char* checkoutStatus = apr_table_get(data, "CHECKOUTSTATUS");
-		AP_LOG_REQUEST_ERR(0, r, "GetExpressCheckout API checkout status %s, %s", checkoutStatus, s.ptr);
-              if(apr_strnatcasecmp(checkoutStatus, "PaymentCompleted") == 0 || apr_strnatcasecmp(checkoutStatus, "PaymentActionCompleted") == 0) { 
-                  status = 3;
-		AP_LOG_REQUEST_ERR(0, r, "This token was already used, can't make DoExpressCheckout call again");
-              } else if(apr_strnatcasecmp(checkoutStatus, "PaymentActionNotInitiated") == 0){
-                  status = 0;
-              } 
-           } else {
-		AP_LOG_REQUEST_ERR(0, r, "GetExpressCheckout API has been failed: %s", s.ptr);
-              status = 0;
-           }
+/*
+ * fake and replay never reach PayPal and record writes every exchange to a
+ * file, so all three are meant for load and profiling setups only.
+ */
+static const char *api_transport_handler(cmd_parms *cmd, void *cfg, const char *mode, const char *arg1, const char *arg2)
+{
+    const char* err;
+    if (strcasecmp(mode, "curl") == 0 && arg1 == NULL)
+    {
+        config.transport = &curlTransport;
+    }
+    else if (strcasecmp(mode, "fake") == 0)
+    {
+        config.fakeLatency = arg1 != NULL ? atoi(arg1) : 0;
+        config.fakeJitter = arg2 != NULL ? atoi(arg2) : 0;
+        if (config.fakeLatency < 0 || config.fakeJitter < 0)
+        {
+            return "ApiTransport fake takes a latency and a jitter in milliseconds";
         }
-        curl_easy_cleanup(curl);
-    } else {
-	AP_LOG_REQUEST_ERR(0, r, "GetExpressCheckout CURL is false.");
-        status = 2;
+        config.transport = &fakeTransport;
     }
-    curl_global_cleanup();
-	AP_LOG_REQUEST_ERR(0, r, "GetExpressCheckout API has been completed.");
-    return status;
+    else if (strcasecmp(mode, "record") == 0 && arg1 != NULL && arg2 == NULL)
+    {
+        config.transportFile = ap_server_root_relative(cmd->pool, arg1);
+        config.transport = &recordTransport;
+    }
+    else if (strcasecmp(mode, "replay") == 0 && arg1 != NULL && arg2 == NULL)
+    {
+        config.transportFile = ap_server_root_relative(cmd->pool, arg1);
+        if ((err = loadReplay(cmd->pool, config.transportFile)) != NULL)
+        {
+            return apr_psprintf(cmd->pool, "ApiTransport replay: %s", err);
+        }
+        config.transport = &replayTransport;
+    }
+    else
+    {
+        return "ApiTransport must be curl, fake [latency-ms [jitter-ms]], record <file> or replay <file>";
+    }
+    return NULL;
 }
 
-static int setExpressCheckout(request_rec *r, apr_table_t* data) {
-    int status = 0;
-    CURL *curl;
-    CURLcode res;
-    AP_LOG_REQUEST_ERR(0, r, "Begin SetExpressCheckout.");
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
-    if(curl) {
-        string s; 
-        char* ptr;
-        populateSetExpressCheckoutURL(&ptr, data,r->pool);
-        AP_LOG_REQUEST_ERR(0, r, "set ec request= %s",ptr);
-	s.pool = r->pool;
-        curl_easy_setopt(curl, CURLOPT_URL, ptr);
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 0L);
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST,1L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &s);
-        res = curl_easy_perform(curl);
-        if(res != CURLE_OK) {
-		AP_LOG_REQUEST_ERR(0, r, "SetExpressCheckout curl_easy_perform() failed: %s, %d\n",curl_easy_strerror(res), res);
-            status = 1;
-        } else {
-	   AP_LOG_REQUEST_ERR(0, r, "response = %s",s.ptr);
-           char* line = curl_unescape(s.ptr, strlen(s.ptr));
-           parseInput(line, data,r->pool);
-           const char* ack = apr_table_get(data, "ACK");
-           if(apr_strnatcasecmp(ack, "Success") == 0) {
-              const char* token = apr_table_get(data, "TOKEN");
-           } else {
-		AP_LOG_REQUEST_ERR(0, r, "SetExpressCheckout API has been failed: %s", s.ptr);
-              status = 3;
-	   }
+static int authenticate_user(request_rec *r)
+{
+    const char *authtype;
+    authtype = ap_auth_type(r);
+    if (!authtype || apr_strnatcasecmp(authtype, "ExpressCheckout")) 
+    {
+        return DECLINED;
+    }
+    /* We need an authentication realm. */
+    if (!ap_auth_name(r)) 
+    {
+	AP_LOG_REQUEST_ERR(0, r, "need AuthName: %s", r->uri);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    r->ap_auth_type = "ExpressCheckout";
+    startTrace(r);
+    return ec_handler(r);
+}
+
+static int ec_handler(request_rec *r)
+{
+    char *uri = r->unparsed_uri;
+
+    if (r->method_number != M_GET)
+    {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    recordCounter(stats ? &stats->requests : NULL);
+    ec_params*  data = apr_pcalloc(r->pool, sizeof(ec_params));
+    data->dir = ap_get_module_config(r->per_dir_config, &paypal_ec_module);
+    data->account = data->dir->account;
+    if (data->account == NULL || data->account->endPoint == NULL)
+    {
+        EC_ERROR(r, "No ApiEndPoint configured for %s", r->uri);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    parseRequestUri(uri, data, r->pool);
+    data->appContext = ap_construct_url(r->pool, r->unparsed_uri, r);
+    int status =0;
+    const char* resource_name = data->name;
+    pricelist_snapshot* prices = acquirePricelist(r, data->dir->pricelist);
+    const char* cart = getParam(data, CART_PARAM);
+    const char* amt = NULL;
+    if(cart != NULL)
+    {
+        if(priceCart(r, data, prices, cart) == 0)
+        {
+            amt = data->amount;
         }
-        curl_easy_cleanup(curl);
-    } else {
-	AP_LOG_REQUEST_ERR(0, r, "SetExpressCheckout CURL is false.");
-        status = 2;
     }
-    curl_global_cleanup();
-	AP_LOG_REQUEST_ERR(0, r, "SetExpressCheckout API has been completed.");
-    return status;
+    else if(prices != NULL && resource_name != NULL)
+    {
+        amt = lookupPrice(prices, resource_name);
+    }
+    if(amt == NULL)
+    {
+        EC_TRACE(r, TRACE_INFO, "resource %s is not in the Pricelist", cart != NULL ? cart : resource_name);
+        const char* errorMsg = "Requested resource is not available!";
+        sendResponse(r, errorMsg);
+        return HTTP_UNAUTHORIZED;
+    }
+    data->amount = amt;
+    if (data->items != NULL)
+    {
+        const ec_server_config* srv = ap_get_module_config(r->server->module_config, &paypal_ec_module);
+        if (srv->grantKeys == NULL || srv->grantKeys->nelts == 0)
+        {
+            EC_ERROR(r, "Cart checkout at %s needs a DownloadGrantKey", r->uri);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+    else if (verifyGrant(r, data) == 0)
+    {
+        return deliverFile(r, data);
+    }
+    const char* token = data->token;
+    const char* statusStr = data->status;
+    const char* payerId = data->payerId;
+    if(token == NULL && statusStr == NULL)
+    {
+        const char* key;
+        checkout_flight* flight;
+        status = validate(r, data);
+        if(status > 0) 
+        {
+            EC_TRACE(r, TRACE_INFO, "Invalid URL, returning the error page with the status %d", status);
+            return HTTP_UNAUTHORIZED;
+	}
+	key = checkoutKey(r, data);
+	data->respToken = joinCheckout(r, key);
+	if(data->respToken != NULL)
+	{
+	    EC_TRACE(r, TRACE_INFO, "Reusing token %s of the same checkout", data->respToken);
+	    redirectToPayPal(r, data);
+	    return HTTP_MOVED_TEMPORARILY;
+	}
+	status = limitCheckout(r);
+	if(status != OK)
+	{
+	    return status;
+	}
+	flight = leadCheckout(key);
+	data->respToken = takeMintedToken(r, data);
+	if(data->respToken != NULL)
+	{
+	    EC_TRACE(r, TRACE_INFO, "Using pre-minted token %s", data->respToken);
+	}
+	else
+	{
+	    status = setExpressCheckout(r, data);
+	}
+	landCheckout(flight, status == 0 ? data->respToken : NULL);
+	if(status == EC_UNAVAILABLE)
+	{
+	    return HTTP_SERVICE_UNAVAILABLE;
+	}
+	if(status > 0) 
+	{
+	    EC_TRACE(r, TRACE_ERROR, "SetExpressCheckout failed with the status %d", status);
+	    return HTTP_UNAUTHORIZED;
+	}
+	redirectToPayPal(r, data);
+	return HTTP_MOVED_TEMPORARILY;
+    } 
+    else if(statusStr != NULL && apr_strnatcasecmp(statusStr, "cancel") == 0) 
+    {
+	EC_TRACE(r, TRACE_INFO, "Payment has been cancelled by the user.");
+	const char* errorMsg = "Payment has been cancelled by the user. Make the payment via PayPal to download.";
+	sendResponse(r, errorMsg);
+	return HTTP_UNAUTHORIZED;
+    } 
+    else if(token != NULL && strlen(token) > 0 && payerId != NULL && strlen(payerId) > 0 && statusStr != NULL && apr_strnatcasecmp(statusStr, "ok") == 0) 
+    {
+	const char* processedMsg = "This token was already processed and it can not be used any more. Download can be succcess only when you make new payment via PayPal.";
+	/* Only a single file sent by the module can be prepared during the capture */
+	int pipelined = data->dir->pipelinedCapture == 1 && data->items == NULL && data->dir->deliveryMode <= DELIVERY_MODULE;
+	prepared_file file;
+	apr_time_t captureStart;
+	if(isTokenConsumed(r, token))
+	{
+	    EC_TRACE(r, TRACE_INFO, "Token %s is in the ledger, no API call made", token);
+	    sendResponse(r, processedMsg);
+	    return HTTP_UNAUTHORIZED;
+	}
+	if(data->dir->directCompletion != 1)
+	{
+	    status = getExpressCheckout(r, data);
+	    if(status == EC_UNAVAILABLE)
+	    {
+	        return HTTP_SERVICE_UNAVAILABLE;
+	    }
+	    if(status == EC_ALREADY_PROCESSED)
+	    {
+	        recordConsumedToken(r, token, NULL);
+	        sendResponse(r, processedMsg);
+	        return HTTP_UNAUTHORIZED;
+	    }
+	    /* The token is still good, so the buyer may simply reload */
+	    if(status > 0) 
+	    {
+	        const char* retryMsg = "The payment could not be checked with PayPal. Reload this page in a moment to try again.";
+	        sendResponse(r, retryMsg);
+	        return HTTP_UNAUTHORIZED;
+	    }
+	}
+	captureStart = apr_time_now();
+	if(pipelined)
+	{
+	    status = pipelinedCapture(r, data, &file);
+	}
+	else
+	{
+	    status = doExpressCheckout(r, data);
+	}
+	if(status == EC_UNAVAILABLE)
+	{
+	    return HTTP_SERVICE_UNAVAILABLE;
+	}
+	if(status == EC_ALREADY_PROCESSED)
+	{
+	    recordConsumedToken(r, token, NULL);
+	    sendResponse(r, processedMsg);
+	    return HTTP_UNAUTHORIZED;
+	}
+	if(status > 0) 
+	{
+	    const char* errorMsg = "Payment has been failed. Download can be succcess only when you make the payment via PayPal.";
+	    sendResponse(r, errorMsg);
+	    return HTTP_UNAUTHORIZED;
+	}
+	recordConsumedToken(r, token, data->transactionId);
+	recordPayment(r, data, apr_time_now() - captureStart);
+	forgetCheckoutToken(token);
+	issueGrant(r, data);
+	if(data->items != NULL)
+	{
+	    return sendCartPage(r, data);
+	}
+	if(pipelined)
+	{
+	    return sendPreparedFile(r, &file);
+	}
+	return deliverFile(r, data);
+    }  
+    else 
+    {
+        EC_TRACE(r, TRACE_INFO, "Unable to process the request. Invalid URL.");
+	const char* errorMsg = "Unable to process the request. Invalid URL!!!";
+	sendResponse(r, errorMsg);
+	return HTTP_UNAUTHORIZED;
+    }
+} 
+
+/*
+ * Prices a cart given as a comma separated list of names from the request's
+ * price list. A name listed twice is bought once. Returns 0 when every item
+ * is for sale, with name set to the list and amount to the total.
+ */
+static int priceCart(request_rec *r, ec_params *data, const pricelist_snapshot* prices, const char* list)
+{
+    apr_int64_t total = 0;
+    char* last;
+    char* name;
+    int i;
+
+    data->items = apr_pcalloc(r->pool, CART_MAX_ITEMS * sizeof(cart_item));
+    for (name = apr_strtok(apr_pstrdup(r->pool, list), ",", &last); name != NULL; name = apr_strtok(NULL, ",", &last))
+    {
+        const char* amt = NULL;
+        const char* dot;
+        for (i = 0; i < data->itemCount && strcmp(data->items[i].name, name) != 0; i++)
+            ;
+        if (i < data->itemCount)
+        {
+            continue;
+        }
+        if (prices != NULL && ap_strchr_c(name, '/') == NULL)
+        {
+            amt = lookupPrice(prices, name);
+        }
+        if (amt == NULL || strspn(amt, "0123456789") > 12)
+        {
+            EC_TRACE(r, TRACE_INFO, "cart item %s is not in the Pricelist", name);
+            return 1;
+        }
+        if (data->itemCount == CART_MAX_ITEMS)
+        {
+            EC_TRACE(r, TRACE_INFO, "cart has more than %d items", CART_MAX_ITEMS);
+            return 1;
+        }
+        data->items[data->itemCount].name = name;
+        data->items[data->itemCount].amount = amt;
+        data->itemCount++;
+        /* Amounts have at most two decimals, so the total is kept in cents */
+        total += apr_atoi64(amt) * 100;
+        dot = ap_strchr_c(amt, '.');
+        if (dot != NULL && dot[1] != '\0')
+        {
+            total += (dot[1] - '0') * 10 + (dot[2] != '\0' ? dot[2] - '0' : 0);
+        }
+    }
+    if (data->itemCount == 0)
+    {
+        return 1;
+    }
+    data->name = list;
+    data->amount = formatCents(r->pool, total);
+    return 0;
+}
+
+static const char* formatCents(apr_pool_t* pool, apr_int64_t cents)
+{
+    return apr_psprintf(pool, "%" APR_INT64_T_FMT ".%02d", cents / 100, (int)(cents % 100));
+}
+
+/*
+ * Answers a paid cart with a page linking every item. Each link carries
+ * the item's grant, so the files download even where cookies are refused.
+ */
+static int sendCartPage(request_rec *r, ec_params* data)
+{
+    int i;
+    recordCounter(stats ? &stats->cartCheckouts : NULL);
+    if (stats != NULL)
+    {
+        apr_atomic_add32(&stats->cartItems, data->itemCount);
+    }
+    ap_set_content_type(r, "text/html");
+    ap_rputs("<HTML> <HEAD><TITLE>Downloads</TITLE></HEAD><BODY><ul>", r);
+    for (i = 0; i < data->itemCount; i++)
+    {
+        const cart_item* item = &data->items[i];
+        const char* href = ap_escape_path_segment(r->pool, item->name);
+        if (item->grant != NULL)
+        {
+            href = apr_pstrcat(r->pool, href, "?grant=", item->grant, NULL);
+        }
+        ap_rprintf(r, "<li><a href=\"%s\">%s</a></li>", ap_escape_html(r->pool, href), ap_escape_html(r->pool, item->name));
+    }
+    ap_rputs("</ul></BODY></HTML>", r);
+    EC_TRACE(r, TRACE_DEBUG, "Cart of %d items paid", data->itemCount);
+    return DONE;
+}
+
+/*
+ * In module mode the file is written from the authentication hook. In the
+ * other modes the request is only marked as paid and the handler phase
+ * serves it: the core handler for handler mode, or an internal redirect to
+ * a location that only accepts redirected paid requests.
+ */
+static int deliverFile(request_rec *r, ec_params *data)
+{
+    if (data->dir->deliveryMode <= DELIVERY_MODULE)
+    {
+        return sendFile(r, data);
+    }
+    r->user = apr_pstrdup(r->pool, data->payerId != NULL ? data->payerId : "grant");
+    apr_table_setn(r->notes, DELIVERY_NOTE, data->name);
+    apr_table_setn(r->subprocess_env, "PAYPAL_EC_PAID", data->name);
+    if (data->transactionId != NULL)
+    {
+        apr_table_setn(r->subprocess_env, "PAYPAL_EC_TRANSACTION", data->transactionId);
+    }
+    recordCounter(stats ? &stats->downloads : NULL);
+    EC_TRACE(r, TRACE_DEBUG, "Authorized %s for the handler phase", data->name);
+    return OK;
+}
+
+/*
+ * The redirect target keeps the path below the section that set
+ * DownloadDelivery, so /paid/2026/book.pdf under <Location /paid> goes to
+ * <path>/2026/book.pdf. A <Directory> section is matched against the file
+ * name. Outside any known prefix, e.g. under <LocationMatch>, only the
+ * file name is kept.
+ */
+static const char* deliveryTarget(request_rec *r, const ec_dir_config* dir, const char* name)
+{
+    const char* base = dir->deliveryBase;
+    const char* relative = NULL;
+    apr_size_t len = base != NULL ? strlen(base) : 0;
+    while (len > 0 && base[len - 1] == '/')
+    {
+        len--;
+    }
+    if (base != NULL && strncmp(r->uri, base, len) == 0 && r->uri[len] == '/')
+    {
+        relative = r->uri + len + 1;
+    }
+    else if (base != NULL && r->filename != NULL && strncmp(r->filename, base, len) == 0 && r->filename[len] == '/')
+    {
+        relative = r->filename + len + 1;
+    }
+    if (relative == NULL || relative[0] == '\0')
+    {
+        relative = name;
+    }
+    return apr_pstrcat(r->pool, dir->deliveryPath, "/", ap_escape_uri(r->pool, relative), NULL);
+}
+
+static int redirect_handler(request_rec *r)
+{
+    const ec_dir_config* dir = ap_get_module_config(r->per_dir_config, &paypal_ec_module);
+    const char* name;
+    if (dir->deliveryMode != DELIVERY_REDIRECT || !ap_is_initial_req(r))
+    {
+        return DECLINED;
+    }
+    name = apr_table_get(r->notes, DELIVERY_NOTE);
+    if (name == NULL)
+    {
+        return DECLINED;
+    }
+    ap_internal_redirect(deliveryTarget(r, dir, name), r);
+    return OK;
+}
+
+/*
+ * Delivers the entitled file the way the core default handler does: the
+ * validators are set first so a conditional request can be answered with
+ * 304, then the file goes down the filter chain as one brigade ending in EOS
+ * so the byterange filter can serve Range and If-Range requests, including
+ * multipart/byteranges, from the same file bucket.
+ */
+static int sendFile(request_rec *r, ec_params *data) {
+   prepared_file file;
+   prepareFile(r, &file, 0);
+   return sendPreparedFile(r, &file);
+}
+
+/*
+ * Opens and types the file without sending anything, and reads up to
+ * prefix bytes of it ahead. With DownloadCache the file is taken from the
+ * shared cache instead, or read into it, and is only opened when the cache
+ * holds less than all of it. A failure is kept in the status for
+ * sendPreparedFile to return.
+ */
+static void prepareFile(request_rec *r, prepared_file* file, apr_size_t prefix) {
+   apr_status_t rv;
+   memset(file, 0, sizeof(prepared_file));
+   file->start = apr_time_now();
+   file->status = OK;
+   if (r->filename == NULL) {
+      EC_ERROR(r, "Incomplete request_rec!");
+      file->status = HTTP_INTERNAL_SERVER_ERROR;
+      return;
+   }
+   if (r->finfo.filetype != APR_REG) {
+      EC_ERROR(r, "%s is not a regular file", r->filename);
+      file->status = HTTP_NOT_FOUND;
+      return;
+   }
+   /* The type checker runs after authentication, so ask for the type now */
+   if (r->content_type == NULL) {
+      ap_run_type_checker(r);
+   }
+   if (fileCache != NULL) {
+      file->cached = lookupCachedFile(r);
+      if (file->cached != NULL && (apr_off_t)file->cached->length == r->finfo.size) {
+         return;
+      }
+   }
+   rv = apr_file_open(&file->fd, r->filename,
+                        APR_READ|APR_BINARY|APR_SENDFILE_ENABLED,
+                        APR_OS_DEFAULT, r->pool);
+   if (rv != APR_SUCCESS) {
+	EC_ERROR(r, "can't open %s", r->filename);
+      file->status = HTTP_NOT_FOUND;
+      return;
+   }
+   if (fileCache != NULL && file->cached == NULL) {
+      fillCachedFile(r, file);
+   }
+   if (file->cached != NULL) {
+      return;
+   }
+   if (fileCache != NULL) {
+      /* A failed fill has moved the file offset; the prefix is offset 0 */
+      apr_off_t zero = 0;
+      apr_file_seek(file->fd, APR_SET, &zero);
+   }
+   if (prefix > (apr_size_t)r->finfo.size) {
+      prefix = (apr_size_t)r->finfo.size;
+   }
+   if (prefix > 0) {
+      file->prefix = apr_palloc(r->pool, prefix);
+      apr_file_read_full(file->fd, file->prefix, prefix, &file->prefixLen);
+   }
+}
+
+static int sendPreparedFile(request_rec *r, prepared_file* file) {
+   int status;
+   apr_bucket_brigade *bb;
+   apr_status_t rv;
+   if (file->status != OK) {
+      return file->status;
+   }
+   if (r->content_type == NULL) {
+      ap_set_content_type(r, "application/octet-stream");
+   }
+   ap_update_mtime(r, r->finfo.mtime);
+   ap_set_last_modified(r);
+   ap_set_etag(r);
+   ap_set_content_length(r, r->finfo.size);
+   status = ap_meets_conditions(r);
+   if (status != OK) {
+      EC_TRACE(r, TRACE_INFO, "Conditional request answered with %d", status);
+      return status;
+   }
+   EC_TRACE(r, TRACE_DEBUG, "Sending %s as %s, Range %s", r->filename, r->content_type,
+            apr_table_get(r->headers_in, "Range"));
+   bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+   /* The cached bytes stay pinned until the request pool is gone */
+   if (file->cached != NULL) {
+      file->prefix = cacheArena + file->cached->offset;
+      file->prefixLen = file->cached->length;
+      APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create(file->prefix, file->prefixLen, r->connection->bucket_alloc));
+   }
+   /* A prefix read ahead during the capture goes first, the rest from the file */
+   else if (file->prefixLen > 0) {
+      APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_pool_create(file->prefix, file->prefixLen, r->pool, r->connection->bucket_alloc));
+   }
+   if ((apr_off_t)file->prefixLen < r->finfo.size) {
+      apr_brigade_insert_file(bb, file->fd, file->prefixLen, r->finfo.size - file->prefixLen, r->pool);
+   }
+   APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(r->connection->bucket_alloc));
+   rv = ap_pass_brigade(r->output_filters, bb);
+   recordCounter(stats ? &stats->downloads : NULL);
+   recordBytes(r->bytes_sent);
+   if (file->cached != NULL) {
+      recordCacheBytes((apr_size_t)cachedBytesSent(r, file->prefixLen));
+   }
+   recordLatency(STAT_SEND, apr_time_now() - file->start);
+   if (rv != APR_SUCCESS) {
+      EC_TRACE(r, TRACE_INFO, "Delivery of %s stopped: %d", r->filename, rv);
+      return AP_FILTER_ERROR;
+   }
+   return OK;
+}
+
+/*
+ * What of r->bytes_sent came from the first cached bytes of the file: all
+ * of it when the whole file is cached, else for a 206 the part of each
+ * requested range below cached. Part headers of a multipart answer count
+ * as cached bytes.
+ */
+static apr_off_t cachedBytesSent(request_rec *r, apr_size_t cached) {
+   const char* range = apr_table_get(r->headers_in, "Range");
+   apr_off_t size = r->finfo.size;
+   apr_off_t sent = 0;
+   if ((apr_off_t)cached >= size || r->bytes_sent == 0) {
+      return r->bytes_sent;
+   }
+   if (r->status != HTTP_PARTIAL_CONTENT || range == NULL || strncasecmp(range, "bytes=", 6) != 0) {
+      return r->bytes_sent < (apr_off_t)cached ? r->bytes_sent : (apr_off_t)cached;
+   }
+   range += 6;
+   while (*range != '\0') {
+      apr_off_t first;
+      apr_off_t last = size - 1;
+      char* end;
+      while (*range == ' ' || *range == ',') {
+         range++;
+      }
+      if (*range == '-') {
+         first = size - apr_strtoi64(range + 1, &end, 10);
+         first = first < 0 ? 0 : first;
+      }
+      else {
+         first = apr_strtoi64(range, &end, 10);
+         if (*end == '-' && end[1] >= '0' && end[1] <= '9') {
+            last = apr_strtoi64(end + 1, &end, 10);
+         }
+         else if (*end == '-') {
+            end++;
+         }
+      }
+      if (end == range) {
+         break;
+      }
+      range = end;
+      last = last < (apr_off_t)cached - 1 ? last : (apr_off_t)cached - 1;
+      if (last >= first) {
+         sent += last - first + 1;
+      }
+   }
+   return sent < r->bytes_sent ? sent : r->bytes_sent;
+}
+
+/*
+ * Shared cache of paid files for DownloadCache. One anonymous shared
+ * memory segment holds the entry table and the arena the files are read
+ * into, and a global mutex guards the table. A lookup walks one hash
+ * bucket; a hit is checked against the size and mtime of r->finfo and sent
+ * from the arena without a copy. Entries are kept in recency and in arena
+ * order as they change, so nothing is sorted or scanned in full under the
+ * mutex. Arena space is taken first fit; when there is none, the least
+ * recently used entries nobody is sending from are evicted. A file larger
+ * than the per-file limit keeps its first bytes in the cache and the rest
+ * on disk. An entry pinned by a child that died stays until the next
+ * restart.
+ */
+static cache_entry* lookupCachedFile(request_rec *r)
+{
+    apr_uint32_t hash = mintHash(r->filename);
+    cache_entry* found;
+    if (apr_global_mutex_lock(cacheMutex) != APR_SUCCESS)
+    {
+        return NULL;
+    }
+    found = findCachedEntry(r->filename, hash, CACHE_READY);
+    if (found != NULL && (found->fileSize != r->finfo.size || found->mtime != r->finfo.mtime))
+    {
+        /* Changed on disk; freed once nobody sends from it */
+        found->state = CACHE_STALE;
+        if (found->refs == 0)
+        {
+            dropCachedEntry(found);
+        }
+        found = NULL;
+    }
+    if (found != NULL)
+    {
+        found->refs++;
+        touchCachedEntry(found);
+    }
+    apr_global_mutex_unlock(cacheMutex);
+    if (found != NULL)
+    {
+        apr_pool_cleanup_register(r->pool, found, releaseCachedFile, apr_pool_cleanup_null);
+        recordCounter(stats ? &stats->cacheHits : NULL);
+    }
+    else
+    {
+        recordCounter(stats ? &stats->cacheMisses : NULL);
+    }
+    return found;
+}
+
+/* The helpers below are called with cacheMutex held */
+static cache_entry* findCachedEntry(const char* path, apr_uint32_t hash, int state)
+{
+    int i;
+    for (i = fileCache->buckets[hash % CACHE_BUCKETS]; i != CACHE_NONE; i = fileCache->entries[i].hashNext)
+    {
+        cache_entry* e = &fileCache->entries[i];
+        if (e->state == state && e->hash == hash && strcmp(e->path, path) == 0)
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Moves an entry to the front of the recency list, linking it if new */
+static void touchCachedEntry(cache_entry* e)
+{
+    int i = (int)(e - fileCache->entries);
+    if (fileCache->lruHead == i)
+    {
+        return;
+    }
+    if (e->lruPrev != CACHE_NONE)
+    {
+        fileCache->entries[e->lruPrev].lruNext = e->lruNext;
+        if (e->lruNext != CACHE_NONE)
+        {
+            fileCache->entries[e->lruNext].lruPrev = e->lruPrev;
+        }
+        else
+        {
+            fileCache->lruTail = e->lruPrev;
+        }
+    }
+    e->lruPrev = CACHE_NONE;
+    e->lruNext = fileCache->lruHead;
+    if (fileCache->lruHead != CACHE_NONE)
+    {
+        fileCache->entries[fileCache->lruHead].lruPrev = i;
+    }
+    else
+    {
+        fileCache->lruTail = i;
+    }
+    fileCache->lruHead = i;
+}
+
+/* Unlinks an entry from its bucket and both orders and frees its slot */
+static void dropCachedEntry(cache_entry* e)
+{
+    int i = (int)(e - fileCache->entries);
+    int* link = &fileCache->buckets[e->hash % CACHE_BUCKETS];
+    while (*link != i)
+    {
+        link = &fileCache->entries[*link].hashNext;
+    }
+    *link = e->hashNext;
+    if (e->lruPrev != CACHE_NONE)
+    {
+        fileCache->entries[e->lruPrev].lruNext = e->lruNext;
+    }
+    else
+    {
+        fileCache->lruHead = e->lruNext;
+    }
+    if (e->lruNext != CACHE_NONE)
+    {
+        fileCache->entries[e->lruNext].lruPrev = e->lruPrev;
+    }
+    else
+    {
+        fileCache->lruTail = e->lruPrev;
+    }
+    if (e->arenaPrev != CACHE_NONE)
+    {
+        fileCache->entries[e->arenaPrev].arenaNext = e->arenaNext;
+    }
+    else
+    {
+        fileCache->arenaHead = e->arenaNext;
+    }
+    if (e->arenaNext != CACHE_NONE)
+    {
+        fileCache->entries[e->arenaNext].arenaPrev = e->arenaPrev;
+    }
+    e->state = CACHE_EMPTY;
+    e->hashNext = fileCache->freeHead;
+    fileCache->freeHead = i;
+}
+
+/*
+ * First fit in arena order; returns the offset, or arenaSize when full,
+ * and in after the entry the space follows (CACHE_NONE for the start).
+ */
+static apr_size_t findCacheSpace(apr_size_t capacity, int* after)
+{
+    apr_size_t at = 0;
+    int i;
+    *after = CACHE_NONE;
+    for (i = fileCache->arenaHead; i != CACHE_NONE; i = fileCache->entries[i].arenaNext)
+    {
+        cache_entry* e = &fileCache->entries[i];
+        if (e->offset - at >= capacity)
+        {
+            return at;
+        }
+        at = e->offset + e->capacity;
+        *after = i;
+    }
+    return fileCache->arenaSize - at >= capacity ? at : fileCache->arenaSize;
+}
+
+static cache_entry* reserveCachedFile(request_rec *r, apr_size_t length)
+{
+    apr_size_t capacity = (length + CACHE_ALIGN - 1) & ~(apr_size_t)(CACHE_ALIGN - 1);
+    apr_uint32_t hash = mintHash(r->filename);
+    cache_entry* slot;
+    apr_size_t offset;
+    int after;
+    int i;
+    if (strlen(r->filename) >= CACHE_PATH_MAX || capacity > fileCache->arenaSize
+        || apr_global_mutex_lock(cacheMutex) != APR_SUCCESS)
+    {
+        return NULL;
+    }
+    if (findCachedEntry(r->filename, hash, CACHE_FILLING) != NULL)
+    {
+        /* Another request is reading it in already */
+        apr_global_mutex_unlock(cacheMutex);
+        return NULL;
+    }
+    offset = findCacheSpace(capacity, &after);
+    while (fileCache->freeHead == CACHE_NONE || offset == fileCache->arenaSize)
+    {
+        cache_entry* victim = NULL;
+        for (i = fileCache->lruTail; i != CACHE_NONE; i = fileCache->entries[i].lruPrev)
+        {
+            cache_entry* e = &fileCache->entries[i];
+            if (e->state == CACHE_READY && e->refs == 0)
+            {
+                victim = e;
+                break;
+            }
+        }
+        if (victim == NULL)
+        {
+            apr_global_mutex_unlock(cacheMutex);
+            return NULL;
+        }
+        dropCachedEntry(victim);
+        offset = findCacheSpace(capacity, &after);
+    }
+    i = fileCache->freeHead;
+    slot = &fileCache->entries[i];
+    fileCache->freeHead = slot->hashNext;
+    slot->state = CACHE_FILLING;
+    slot->hash = hash;
+    slot->refs = 1;
+    slot->fileSize = r->finfo.size;
+    slot->mtime = r->finfo.mtime;
+    slot->offset = offset;
+    slot->length = length;
+    slot->capacity = capacity;
+    memcpy(slot->path, r->filename, strlen(r->filename) + 1);
+    slot->hashNext = fileCache->buckets[hash % CACHE_BUCKETS];
+    fileCache->buckets[hash % CACHE_BUCKETS] = i;
+    slot->lruPrev = CACHE_NONE;
+    slot->lruNext = CACHE_NONE;
+    touchCachedEntry(slot);
+    slot->arenaPrev = after;
+    slot->arenaNext = after != CACHE_NONE ? fileCache->entries[after].arenaNext : fileCache->arenaHead;
+    if (slot->arenaNext != CACHE_NONE)
+    {
+        fileCache->entries[slot->arenaNext].arenaPrev = i;
+    }
+    if (after != CACHE_NONE)
+    {
+        fileCache->entries[after].arenaNext = i;
+    }
+    else
+    {
+        fileCache->arenaHead = i;
+    }
+    apr_global_mutex_unlock(cacheMutex);
+    apr_pool_cleanup_register(r->pool, slot, releaseCachedFile, apr_pool_cleanup_null);
+    return slot;
+}
+
+/* Reads the file, up to the per-file limit, into a new entry after a miss */
+static void fillCachedFile(request_rec *r, prepared_file* file)
+{
+    apr_size_t limit = (apr_size_t)(config.cacheFileLimit > 0 ? config.cacheFileLimit : DEFAULT_CACHE_FILE_MB) << 20;
+    apr_size_t length = r->finfo.size < (apr_off_t)limit ? (apr_size_t)r->finfo.size : limit;
+    apr_size_t got = 0;
+    cache_entry* entry;
+    apr_status_t rv;
+    int ready;
+    if (length == 0)
+    {
+        return;
+    }
+    entry = reserveCachedFile(r, length);
+    if (entry == NULL)
+    {
+        return;
+    }
+    rv = apr_file_read_full(file->fd, cacheArena + entry->offset, length, &got);
+    ready = rv == APR_SUCCESS && got == length;
+    apr_global_mutex_lock(cacheMutex);
+    entry->state = ready ? CACHE_READY : CACHE_STALE;
+    apr_global_mutex_unlock(cacheMutex);
+    /* Pinned by this request, so usable even if marked stale since */
+    if (ready)
+    {
+        file->cached = entry;
+        EC_TRACE(r, TRACE_DEBUG, "Cached %" APR_SIZE_T_FMT " bytes of %s", length, r->filename);
+    }
+}
+
+static apr_status_t releaseCachedFile(void *data)
+{
+    cache_entry* entry = data;
+    apr_global_mutex_lock(cacheMutex);
+    if (--entry->refs == 0 && entry->state == CACHE_STALE)
+    {
+        dropCachedEntry(entry);
+    }
+    apr_global_mutex_unlock(cacheMutex);
+    return APR_SUCCESS;
+}
+
+static int createFileCache(apr_pool_t *pconf, server_rec *s)
+{
+    apr_size_t arenaOffset = (sizeof(file_cache) + CACHE_ALIGN - 1) & ~(apr_size_t)(CACHE_ALIGN - 1);
+    apr_size_t size;
+    apr_status_t rv;
+    int i;
+    fileCache = NULL;
+    cacheMutex = NULL;
+    if (config.cacheSize <= 0)
+    {
+        return OK;
+    }
+    size = arenaOffset + ((apr_size_t)config.cacheSize << 20);
+    rv = ap_global_mutex_create(&cacheMutex, NULL, CACHE_MUTEX_TYPE, NULL, s, pconf, 0);
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Unable to create the download cache mutex");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    rv = apr_shm_create(&cacheShm, size, NULL, pconf);
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Unable to create %" APR_SIZE_T_FMT " bytes of shared memory for the download cache", size);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    fileCache = apr_shm_baseaddr_get(cacheShm);
+    memset(fileCache, 0, sizeof(file_cache));
+    fileCache->arenaSize = size - arenaOffset;
+    fileCache->lruHead = fileCache->lruTail = fileCache->arenaHead = CACHE_NONE;
+    for (i = 0; i < CACHE_BUCKETS; i++)
+    {
+        fileCache->buckets[i] = CACHE_NONE;
+    }
+    for (i = 0; i < CACHE_ENTRIES; i++)
+    {
+        fileCache->entries[i].hashNext = i + 1 < CACHE_ENTRIES ? i + 1 : CACHE_NONE;
+    }
+    cacheArena = (char*)fileCache + arenaOffset;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    /* Fewer TLB misses when sending from a large arena, where shmem THP is enabled */
+    madvise(cacheArena, fileCache->arenaSize, MADV_HUGEPAGE);
+#endif
+    return OK;
+}
+
+/*
+ * PaymentLedger: one line per completed payment, appended to a local file
+ * off the request path. Each child has a bounded ring; request threads
+ * claim a slot with compare-and-swap on tail and publish it through its
+ * seq, and one writer thread drains it every PAYMENT_FLUSH_INTERVAL ms, or
+ * sooner when it is half full. A batch is one write and one fdatasync
+ * under paymentMutex, which also serializes rotation between children.
+ * When the ring is full the record goes to the error log instead.
+ */
+static void recordPayment(request_rec *r, ec_params* data, apr_interval_time_t captureTime)
+{
+    apr_time_t start;
+    apr_uint32_t pos;
+    payment_record* rec;
+    if (paymentWriter.ring == NULL)
+    {
+        return;
+    }
+    start = apr_time_now();
+    for (;;)
+    {
+        apr_int32_t lag;
+        pos = apr_atomic_read32(&paymentWriter.tail);
+        rec = &paymentWriter.ring[pos & (PAYMENT_RING_SIZE - 1)];
+        lag = (apr_int32_t)(apr_atomic_read32(&rec->seq) - pos);
+        if (lag == 0 && apr_atomic_cas32(&paymentWriter.tail, pos + 1, pos) == pos)
+        {
+            break;
+        }
+        if (lag < 0)
+        {
+            recordCounter(stats ? &stats->paymentDropped : NULL);
+            EC_ERROR(r, "PaymentLedger full, payment not recorded: transaction %s token %s payer %s name %s amount %s",
+                     data->transactionId, data->token, data->payerId, data->name, data->amount);
+            return;
+        }
+    }
+    rec->paidAt = start;
+    rec->checkoutTime = start - r->request_time;
+    rec->captureTime = captureTime;
+    apr_cpystrn(rec->transactionId, data->transactionId != NULL ? data->transactionId : "", PAYMENT_FIELD_MAX);
+    apr_cpystrn(rec->token, data->token, PAYMENT_FIELD_MAX);
+    apr_cpystrn(rec->payerId, data->payerId, PAYMENT_FIELD_MAX);
+    apr_cpystrn(rec->amount, data->amount, PAYMENT_FIELD_MAX);
+    apr_cpystrn(rec->currency, data->account->currencyCode != NULL ? data->account->currencyCode : "", sizeof(rec->currency));
+    apr_cpystrn(rec->name, data->name, PAYMENT_NAME_MAX);
+    apr_atomic_set32(&rec->seq, pos + 1);
+#if APR_HAS_THREADS
+    if (pos - apr_atomic_read32(&paymentWriter.head) == PAYMENT_RING_SIZE / 2)
+    {
+        apr_thread_cond_signal(paymentWriter.cond);
+    }
+#else
+    flushPayments(r->pool, r->server);
+#endif
+    recordLatency(STAT_PAYMENT_ENQUEUE, apr_time_now() - start);
+}
+
+/* Tabs and line breaks would split a record */
+static void cleanPaymentField(char* field)
+{
+    for (; *field != '\0'; field++)
+    {
+        if (*field == '\t' || *field == '\n' || *field == '\r')
+        {
+            *field = ' ';
+        }
+    }
+}
+
+static apr_size_t formatPayment(char* buf, apr_size_t size, payment_record* rec)
+{
+    apr_time_exp_t t;
+    cleanPaymentField(rec->transactionId);
+    cleanPaymentField(rec->token);
+    cleanPaymentField(rec->payerId);
+    cleanPaymentField(rec->amount);
+    cleanPaymentField(rec->currency);
+    cleanPaymentField(rec->name);
+    apr_time_exp_gmt(&t, rec->paidAt);
+    return apr_snprintf(buf, size, "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ\t%s\t%s\t%s\t%s\t%s\t%s\t%" APR_TIME_T_FMT "\t%" APR_TIME_T_FMT "\n",
+                        t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, t.tm_usec,
+                        rec->transactionId, rec->token, rec->payerId, rec->name, rec->amount, rec->currency,
+                        rec->checkoutTime, rec->captureTime);
+}
+
+/*
+ * Called with paymentMutex held. Reopens the ledger when another child
+ * rotated it, and rotates it when it reached PaymentLedger's size. A new
+ * file starts with a header line naming the fields.
+ */
+static void openPaymentLedger(server_rec* s)
+{
+    static const char header[] = "# time\ttransaction\ttoken\tpayer\tname\tamount\tcurrency\tcheckout_us\tcapture_us\n";
+    apr_finfo_t disk;
+    apr_finfo_t opened;
+    apr_status_t rv;
+    if (paymentWriter.file != NULL)
+    {
+        if (apr_stat(&disk, config.paymentLedger, APR_FINFO_IDENT|APR_FINFO_SIZE, paymentWriter.filePool) == APR_SUCCESS
+            && apr_file_info_get(&opened, APR_FINFO_IDENT, paymentWriter.file) == APR_SUCCESS
+            && disk.inode == opened.inode && disk.device == opened.device)
+        {
+            if (config.paymentRotate == 0 || disk.size < (apr_off_t)config.paymentRotate << 20)
+            {
+                return;
+            }
+            rv = apr_file_rename(config.paymentLedger,
+                                 apr_psprintf(paymentWriter.filePool, "%s.%" APR_TIME_T_FMT, config.paymentLedger, apr_time_now()),
+                                 paymentWriter.filePool);
+            if (rv != APR_SUCCESS)
+            {
+                ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "PaymentLedger: can't rotate %s", config.paymentLedger);
+                return;
+            }
+        }
+        apr_file_close(paymentWriter.file);
+        paymentWriter.file = NULL;
+        apr_pool_clear(paymentWriter.filePool);
+    }
+    rv = apr_file_open(&paymentWriter.file, config.paymentLedger, APR_WRITE|APR_CREATE|APR_APPEND|APR_BINARY,
+                       APR_OS_DEFAULT, paymentWriter.filePool);
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "PaymentLedger: can't open %s", config.paymentLedger);
+        paymentWriter.file = NULL;
+        return;
+    }
+    if (apr_file_info_get(&opened, APR_FINFO_SIZE, paymentWriter.file) == APR_SUCCESS && opened.size == 0)
+    {
+        apr_file_write_full(paymentWriter.file, header, sizeof(header) - 1, NULL);
+    }
+}
+
+/* Writes every published record as one batch; only the writer calls this */
+static void flushPayments(apr_pool_t* scratch, server_rec* s)
+{
+    apr_uint32_t head = apr_atomic_read32(&paymentWriter.head);
+    apr_uint32_t count = 0;
+    apr_uint32_t i;
+    apr_size_t cap;
+    apr_size_t len = 0;
+    char* buf;
+    apr_time_t start;
+    apr_status_t rv;
+    while (count < PAYMENT_RING_SIZE
+           && apr_atomic_read32(&paymentWriter.ring[(head + count) & (PAYMENT_RING_SIZE - 1)].seq) == head + count + 1)
+    {
+        count++;
+    }
+    if (count == 0)
+    {
+        return;
+    }
+    cap = count * (sizeof(payment_record) + 64);
+    buf = apr_palloc(scratch, cap);
+    for (i = 0; i < count; i++, head++)
+    {
+        payment_record* rec = &paymentWriter.ring[head & (PAYMENT_RING_SIZE - 1)];
+        len += formatPayment(buf + len, cap - len, rec);
+        apr_atomic_set32(&rec->seq, head + PAYMENT_RING_SIZE);
+    }
+    apr_atomic_set32(&paymentWriter.head, head);
+    start = apr_time_now();
+    if (apr_global_mutex_lock(paymentMutex) != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "PaymentLedger: can't lock, %u payments only in this log:\n%.*s", count, (int)len, buf);
+        return;
+    }
+    openPaymentLedger(s);
+    rv = paymentWriter.file != NULL ? apr_file_write_full(paymentWriter.file, buf, len, NULL) : APR_EGENERAL;
+    if (rv == APR_SUCCESS)
+    {
+        rv = apr_file_datasync(paymentWriter.file);
+    }
+    apr_global_mutex_unlock(paymentMutex);
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "PaymentLedger: write failed, %u payments only in this log:\n%.*s", count, (int)len, buf);
+        return;
+    }
+    if (stats != NULL)
+    {
+        apr_atomic_add32(&stats->paymentRecords, count);
+    }
+    recordLatency(STAT_PAYMENT_FLUSH, apr_time_now() - start);
+}
+
+#if APR_HAS_THREADS
+static void* APR_THREAD_FUNC runPaymentWriter(apr_thread_t *thread, void *data)
+{
+    server_rec* s = data;
+    apr_pool_t* scratch;
+    int stop = 0;
+
+    apr_pool_create(&scratch, paymentWriter.pool);
+    while (!stop)
+    {
+        apr_thread_mutex_lock(paymentWriter.lock);
+        if (!paymentWriter.stop)
+        {
+            apr_thread_cond_timedwait(paymentWriter.cond, paymentWriter.lock, apr_time_from_msec(PAYMENT_FLUSH_INTERVAL));
+        }
+        stop = paymentWriter.stop;
+        apr_thread_mutex_unlock(paymentWriter.lock);
+        /* The last round drains what the request threads left */
+        flushPayments(scratch, s);
+        apr_pool_clear(scratch);
+    }
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+static apr_status_t stopPaymentWriter(void *data)
+{
+    apr_status_t rv;
+    apr_thread_mutex_lock(paymentWriter.lock);
+    paymentWriter.stop = 1;
+    apr_thread_cond_signal(paymentWriter.cond);
+    apr_thread_mutex_unlock(paymentWriter.lock);
+    apr_thread_join(&rv, paymentWriter.thread);
+    return APR_SUCCESS;
+}
+static void startPaymentWriter(apr_pool_t *p, server_rec *s)
+{
+    apr_pool_create(&paymentWriter.pool, p);
+    apr_thread_mutex_create(&paymentWriter.lock, APR_THREAD_MUTEX_DEFAULT, p);
+    apr_thread_cond_create(&paymentWriter.cond, p);
+    if (apr_thread_create(&paymentWriter.thread, NULL, runPaymentWriter, s, p) != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Unable to start the payment ledger writer; payments go to the error log");
+        paymentWriter.ring = NULL;
+        return;
+    }
+    apr_pool_pre_cleanup_register(p, NULL, stopPaymentWriter);
+}
+#endif
+
+static void initPaymentWriter(apr_pool_t *p, server_rec *s)
+{
+    apr_uint32_t i;
+    memset(&paymentWriter, 0, sizeof(paymentWriter));
+    if (config.paymentLedger == NULL || paymentMutex == NULL)
+    {
+        return;
+    }
+    apr_global_mutex_child_init(&paymentMutex, apr_global_mutex_lockfile(paymentMutex), p);
+    apr_pool_create(&paymentWriter.filePool, p);
+    paymentWriter.ring = apr_palloc(p, PAYMENT_RING_SIZE * sizeof(payment_record));
+    for (i = 0; i < PAYMENT_RING_SIZE; i++)
+    {
+        paymentWriter.ring[i].seq = i;
+    }
+#if APR_HAS_THREADS
+    startPaymentWriter(p, s);
+#endif
+}
+
+/* Checks at startup that the ledger can be written, so a typo fails early */
+static int createPaymentLedger(apr_pool_t *pconf, server_rec *s)
+{
+    apr_file_t* file;
+    apr_status_t rv;
+    paymentMutex = NULL;
+    if (config.paymentLedger == NULL)
+    {
+        return OK;
+    }
+    rv = apr_file_open(&file, config.paymentLedger, APR_WRITE|APR_CREATE|APR_APPEND, APR_OS_DEFAULT, pconf);
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "PaymentLedger: can't open %s", config.paymentLedger);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    apr_file_close(file);
+    rv = ap_global_mutex_create(&paymentMutex, NULL, PAYMENT_MUTEX_TYPE, NULL, s, pconf, 0);
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Unable to create the payment ledger mutex");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    return OK;
+}
+
+
+/*
+ * HMAC-SHA1 of the grant payload bound to the decoded URI of the resource
+ * and its amount, base64url encoded without padding. The whole URI is
+ * signed, as a grant in the query is not held to the cookie's Path.
+ */
+static void signGrant(const grant_key* key, const char* payload, const char* uri, const char* amt, char* mac)
+{
+    apr_sha1_ctx_t ctx;
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    char encoded[GRANT_MAC_LEN + 4];
+    int i;
+
+    ctx = key->inner;
+    apr_sha1_update(&ctx, payload, strlen(payload));
+    apr_sha1_update(&ctx, "\n", 1);
+    apr_sha1_update(&ctx, uri, strlen(uri));
+    apr_sha1_update(&ctx, "\n", 1);
+    apr_sha1_update(&ctx, amt, strlen(amt));
+    apr_sha1_final(digest, &ctx);
+    ctx = key->outer;
+    apr_sha1_update_binary(&ctx, digest, APR_SHA1_DIGESTSIZE);
+    apr_sha1_final(digest, &ctx);
+
+    apr_base64_encode_binary(encoded, digest, APR_SHA1_DIGESTSIZE);
+    for (i = 0; i < GRANT_MAC_LEN; i++)
+    {
+        mac[i] = encoded[i] == '+' ? '-' : encoded[i] == '/' ? '_' : encoded[i];
+    }
+    mac[GRANT_MAC_LEN] = '\0';
+}
+
+/*
+ * A grant is "<expiry>.<key id>.<transaction id>.<mac>". It is handed out
+ * as a cookie scoped to the URI of the paid resource so that retries and
+ * resumed downloads are served without another PayPal round trip. A cart
+ * gets one grant per item, scoped to the item's URI next to the cart's.
+ */
+static void issueGrant(request_rec *r, ec_params* data)
+{
+    const grant_key* key;
+    const char* txnId = data->transactionId;
+    const char* amt = data->amount;
+    const ec_server_config* srv = ap_get_module_config(r->server->module_config, &paypal_ec_module);
+    int lifetime = srv->grantLifetime > 0 ? srv->grantLifetime : DEFAULT_GRANT_LIFETIME;
+    const char* secure = apr_strnatcasecmp(ap_http_scheme(r), "https") == 0 ? ";Secure" : "";
+    char mac[GRANT_MAC_LEN + 1];
+    char* payload;
+    char* grant;
+    int i;
+
+    if (srv->grantKeys == NULL || srv->grantKeys->nelts == 0 || txnId == NULL
+        || strspn(txnId, GRANT_KEY_ID_CHARS) != strlen(txnId))
+    {
+        if (data->items != NULL)
+        {
+            EC_ERROR(r, "No grants issued for the cart paid with %s", txnId);
+        }
+        return;
+    }
+    key = &APR_ARRAY_IDX(srv->grantKeys, srv->grantKeys->nelts - 1, grant_key);
+    payload = apr_psprintf(r->pool, "%" APR_TIME_T_FMT ".%s.%s",
+                           apr_time_sec(r->request_time) + lifetime, key->id, txnId);
+    if (data->items != NULL)
+    {
+        const char* slash = ap_strrchr_c(r->uri, '/');
+        char* dir = apr_pstrmemdup(r->pool, r->uri, slash != NULL ? slash - r->uri + 1 : 0);
+        for (i = 0; i < data->itemCount; i++)
+        {
+            cart_item* item = &data->items[i];
+            signGrant(key, payload, apr_pstrcat(r->pool, dir, item->name, NULL), item->amount, mac);
+            item->grant = apr_pstrcat(r->pool, payload, ".", mac, NULL);
+            ap_cookie_write(r, GRANT_COOKIE_NAME, item->grant,
+                            apr_psprintf(r->pool, "Path=%s%s;HttpOnly%s", dir, ap_escape_path_segment(r->pool, item->name), secure),
+                            lifetime, r->err_headers_out, NULL);
+        }
+        return;
+    }
+    signGrant(key, payload, r->uri, amt, mac);
+    grant = apr_pstrcat(r->pool, payload, ".", mac, NULL);
+    data->grantIssued = grant;
+    ap_cookie_write(r, GRANT_COOKIE_NAME, grant,
+                    apr_psprintf(r->pool, "Path=%s;HttpOnly%s", r->uri, secure),
+                    lifetime, r->err_headers_out, NULL);
+}
+
+/*
+ * Checks the grant cookie or "grant" query parameter of the request.
+ * Returns 0 when the request carries a valid, unexpired grant for the
+ * requested URI and its current price.
+ */
+static int verifyGrant(request_rec *r, ec_params* data)
+{
+    const char* grant = data->grant;
+    const char* amt = data->amount;
+    const grant_key* key = NULL;
+    const char* keyId;
+    const char* mac;
+    char* payload;
+    char* last;
+    char expected[GRANT_MAC_LEN + 1];
+    apr_time_t expiry;
+    int diff = 0;
+    int i;
+    const ec_server_config* srv = ap_get_module_config(r->server->module_config, &paypal_ec_module);
+
+    if (srv->grantKeys == NULL || srv->grantKeys->nelts == 0)
+    {
+        return 1;
+    }
+    if (grant == NULL && ap_cookie_read(r, GRANT_COOKIE_NAME, &grant, 0) != APR_SUCCESS)
+    {
+        return 1;
+    }
+    if (grant == NULL || (mac = ap_strrchr_c(grant, '.')) == NULL || strlen(mac + 1) != GRANT_MAC_LEN)
+    {
+        return 1;
+    }
+    payload = apr_pstrmemdup(r->pool, grant, mac - grant);
+    mac++;
+
+    expiry = apr_atoi64(payload);
+    if (expiry <= apr_time_sec(r->request_time))
+    {
+        return 2;
+    }
+    keyId = ap_strchr_c(payload, '.');
+    if (keyId == NULL)
+    {
+        return 1;
+    }
+    keyId = apr_strtok(apr_pstrdup(r->pool, keyId + 1), ".", &last);
+    for (i = 0; keyId != NULL && i < srv->grantKeys->nelts; i++)
+    {
+        if (strcmp(APR_ARRAY_IDX(srv->grantKeys, i, grant_key).id, keyId) == 0)
+        {
+            key = &APR_ARRAY_IDX(srv->grantKeys, i, grant_key);
+            break;
+        }
+    }
+    if (key == NULL)
+    {
+        return 1;
+    }
+    signGrant(key, payload, r->uri, amt, expected);
+    for (i = 0; i < GRANT_MAC_LEN; i++)
+    {
+        diff |= expected[i] ^ mac[i];
+    }
+    return diff == 0 ? 0 : 1;
+}
+
+static int sendResponse(request_rec *r, const char* str) {
+   ap_set_content_type(r, "text/html");
+   ap_rputs("<HTML> <HEAD><TITLE>Error</TITLE></HEAD><BODY>", r);
+   ap_rputs("<strong align=\"center\">", r);
+   ap_rputs(str, r);
+   ap_rputs("</strong></BODY></HTML>", r);
+   return 0;
+}
+
+
+static void redirectToPayPal(request_rec *r, ec_params* data) 
+{
+   const char* token = data->respToken;
+   const char* weburl;
+   if(apr_strnatcasecmp(data->dir->ecType, "Basic") ==0) 
+   {
+	weburl = apr_pstrcat(r->pool, data->dir->ecWebUrl, token, NULL);
+   } 
+   else if(apr_strnatcasecmp(data->dir->ecType, "InContext") == 0) 
+   {
+	weburl = apr_pstrcat(r->pool, data->dir->ecIncontextUrl,token, NULL);
+   }
+   EC_TRACE(r, TRACE_DEBUG, "redirect to %s", weburl);
+   apr_table_setn(r->err_headers_out, "Location", weburl);
+}
+
+static int validate(request_rec *r, ec_params* data) 
+{
+  const char* amt = data->amount;
+  const char* name = data->name; 
+  int status = 0;
+  if(amt == NULL  || strlen(amt) == 0) 
+  {
+     status = 1;
+  }
+  if(name == NULL || strlen(name) == 0) 
+  {
+     status = 2;
+  }
+  if(status > 0)
+  {
+     ap_set_content_type(r, "text/html");
+     ap_rputs("<HTML> <HEAD><TITLE>Error</TITLE></HEAD><BODY>", r);
+     ap_rputs("<strong align=\"center\">", r);
+     ap_rputs("Invalid Download URL either item name or amount is missing", r);
+     ap_rputs("</strong></BODY></HTML>", r);
+  }
+  return status;
+}
+
+static size_t writefunc(void *ptr, size_t size, size_t nmemb, nvp_decoder *d)
+{
+  size_t len = size*nmemb;
+  d->total += len;
+  if (d->total > NVP_MAX_RESPONSE) {
+     return 0;
+  }
+  /* ApiTransport record keeps the raw body as well */
+  if (d->raw != NULL) {
+     if (d->rawLen + len > d->rawCap) {
+        char* grown;
+        d->rawCap = d->rawLen + len > d->rawCap * 2 ? d->rawLen + len : d->rawCap * 2;
+        grown = apr_palloc(d->pool, d->rawCap);
+        recordCounter(stats ? &stats->decoderGrows : NULL);
+        memcpy(grown, d->raw, d->rawLen);
+        d->raw = grown;
+     }
+     memcpy(d->raw + d->rawLen, ptr, len);
+     d->rawLen += len;
+  }
+  decodeNvpChunk(d, ptr, len);
+  return len;
+}
+
+/*
+ * Compiles the part of each NVP request that only depends on the server
+ * configuration (credentials, version, currency and fixed item options)
+ * once, so a request only encodes its own fields. Without a CurrencyCode
+ * the field is left out and PayPal uses its default, USD.
+ */
+static void compileNvpTemplates(ec_account* account, apr_pool_t* pool)
+{
+   nvp_template* nvpTemplates = account->templates;
+   static const char* const credentialNames[] = { "USER", "PWD", "SIGNATURE", "VERSION" };
+   static const char* const currencyNames[] = { "PAYMENTREQUEST_0_CURRENCYCODE" };
+   const char* credentials[4];
+   apr_size_t len;
+   char* base;
+   char* currency;
+
+   credentials[0] = account->userName;
+   credentials[1] = account->password;
+   credentials[2] = account->signature;
+   credentials[3] = account->version;
+   base = buildNvpRequest(pool, &emptyTemplate, credentialNames, credentials, 4, &len);
+   /* drop the leading '&' of the first field */
+   base++;
+   currency = buildNvpRequest(pool, &emptyTemplate, currencyNames, &account->currencyCode,
+                              account->currencyCode != NULL ? 1 : 0, &len);
+   if (account->currencyCode == NULL)
+   {
+      ap_log_error(APLOG_MARK, APLOG_WARNING, 0, account->server, "No CurrencyCode set, PayPal will charge in USD");
+   }
+
+   nvpTemplates[NVP_SET].prefix = apr_pstrcat(pool, base, "&METHOD=SetExpressCheckout", currency,
+        "&PAYMENTREQUEST_0_PAYMENTACTION=Sale&L_PAYMENTREQUEST_0_ITEMCATEGORY0=Digital",
+        "&REQCONFIRMSHIPPING=0&NOSHIPPING=1&L_PAYMENTREQUEST_0_QTY0=1", NULL);
+   nvpTemplates[NVP_GET].prefix = apr_pstrcat(pool, base, "&METHOD=GetExpressCheckoutDetails", NULL);
+   nvpTemplates[NVP_DO].prefix = apr_pstrcat(pool, base, "&METHOD=DoExpressCheckoutPayment", currency,
+        "&PAYMENTREQUEST_0_PAYMENTACTION=Sale&L_PAYMENTREQUEST_0_ITEMCATEGORY0=Digital",
+        "&L_PAYMENTREQUEST_0_QTY0=1", NULL);
+   nvpTemplates[NVP_SET].len = strlen(nvpTemplates[NVP_SET].prefix);
+   nvpTemplates[NVP_GET].len = strlen(nvpTemplates[NVP_GET].prefix);
+   nvpTemplates[NVP_DO].len = strlen(nvpTemplates[NVP_DO].prefix);
+}
+
+/*
+ * Set and Do for a cart: the leading fields of the caller and one L_ line
+ * per item. The quantity and category of line 0 come from the compiled
+ * template, the other lines carry their own.
+ */
+static char* buildCartRequest(apr_size_t* len, ec_params* data, int method, const char* const* names, const char* const* values, apr_pool_t* pool)
+{
+   int n = 2 + data->itemCount * 4;
+   const char** cartNames = apr_palloc(pool, n * sizeof(char*));
+   const char** cartValues = apr_palloc(pool, n * sizeof(char*));
+   int k = 4;
+   int i;
+   memcpy(cartNames, names, 4 * sizeof(char*));
+   memcpy(cartValues, values, 4 * sizeof(char*));
+   for (i = 0; i < data->itemCount; i++) {
+      cartNames[k] = apr_psprintf(pool, "L_PAYMENTREQUEST_0_NAME%d", i);
+      cartValues[k++] = data->items[i].name;
+      cartNames[k] = apr_psprintf(pool, "L_PAYMENTREQUEST_0_AMT%d", i);
+      cartValues[k++] = data->items[i].amount;
+      if (i > 0) {
+         cartNames[k] = apr_psprintf(pool, "L_PAYMENTREQUEST_0_QTY%d", i);
+         cartValues[k++] = "1";
+         cartNames[k] = apr_psprintf(pool, "L_PAYMENTREQUEST_0_ITEMCATEGORY%d", i);
+         cartValues[k++] = "Digital";
+      }
+   }
+   return buildNvpRequest(pool, &data->account->templates[method], cartNames, cartValues, n, len);
+}
+
+static char* populateSetExpressCheckoutRequest(apr_size_t* len, ec_params* data, apr_pool_t* pool) {
+   static const char* const names[] = { "RETURNURL", "CANCELURL", "PAYMENTREQUEST_0_AMT", "PAYMENTREQUEST_0_ITEMAMT", "L_PAYMENTREQUEST_0_NAME0", "L_PAYMENTREQUEST_0_AMT0" };
+   const char* values[6];
+   /* A cart URL already has a query string */
+   const char* sep = ap_strchr_c(data->appContext, '?') != NULL ? "&" : "?";
+   values[0] = apr_pstrcat(pool, data->appContext, sep, "status=ok", NULL);
+   values[1] = apr_pstrcat(pool, data->appContext, sep, "status=cancel", NULL);
+   values[2] = data->amount;
+   values[3] = data->amount;
+   values[4] = data->name;
+   values[5] = data->amount;
+   if (data->items != NULL) {
+      return buildCartRequest(len, data, NVP_SET, names, values, pool);
+   }
+   return buildNvpRequest(pool, &data->account->templates[NVP_SET], names, values, 6, len);
+}
+
+static char* populateDoExpressCheckoutRequest(apr_size_t* len, ec_params* data, apr_pool_t* pool) {
+   static const char* const names[] = { "TOKEN", "PAYERID", "PAYMENTREQUEST_0_AMT", "PAYMENTREQUEST_0_ITEMAMT", "L_PAYMENTREQUEST_0_NAME0", "L_PAYMENTREQUEST_0_AMT0" };
+   const char* values[6];
+   values[0] = data->token;
+   values[1] = data->payerId;
+   values[2] = data->amount;
+   values[3] = data->amount;
+   values[4] = data->name;
+   values[5] = data->amount;
+   if (data->items != NULL) {
+      return buildCartRequest(len, data, NVP_DO, names, values, pool);
+   }
+   return buildNvpRequest(pool, &data->account->templates[NVP_DO], names, values, 6, len);
+}
+
+static char* populateGetExpressCheckoutRequest(apr_size_t* len, ec_params* data, apr_pool_t* pool) {
+   static const char* const names[] = { "TOKEN" };
+   const char* values[1];
+   values[0] = data->token;
+   return buildNvpRequest(pool, &data->account->templates[NVP_GET], names, values, 1, len);
+}
+
+/*
+ * Admission for one API call: the checkout must have time left in its
+ * budget, the child must be under ApiMaxInFlight and the circuit breaker
+ * must let the call through. A refused call sets Retry-After where a retry
+ * can help and yields EC_UNAVAILABLE, which the handler turns into 503.
+ */
+static int admitNvpCall(request_rec *r, int method, long* timeoutMs)
+{
+    int budget = config.checkoutBudget > 0 ? config.checkoutBudget : DEFAULT_CHECKOUT_BUDGET;
+    apr_interval_time_t remaining = r->request_time + (apr_interval_time_t)budget * 1000 - apr_time_now();
+    apr_uint32_t retryAfter;
+    *timeoutMs = config.callTimeout > 0 ? config.callTimeout : DEFAULT_CALL_TIMEOUT;
+    if (remaining / 1000 < *timeoutMs)
+    {
+        *timeoutMs = (long)(remaining / 1000);
+    }
+    if (*timeoutMs <= 0)
+    {
+        EC_ERROR(r, "%s not attempted, the checkout time budget is spent", nvpMethodNames[method]);
+        return EC_UNAVAILABLE;
+    }
+    if (curlPool.maxInFlight > 0 && apr_atomic_inc32(&curlPool.inFlight) >= curlPool.maxInFlight)
+    {
+        apr_atomic_dec32(&curlPool.inFlight);
+        recordCounter(stats ? &stats->admissionRejects : NULL);
+        EC_ERROR(r, "%s refused, %u API calls already in flight", nvpMethodNames[method], curlPool.maxInFlight);
+        apr_table_setn(r->err_headers_out, "Retry-After", "1");
+        return EC_UNAVAILABLE;
+    }
+    retryAfter = breakerAllows();
+    if (retryAfter > 0)
+    {
+        releaseNvpSlot();
+        recordCounter(stats ? &stats->breakerRejects : NULL);
+        EC_TRACE(r, TRACE_INFO, "%s refused, circuit breaker open", nvpMethodNames[method]);
+        apr_table_setn(r->err_headers_out, "Retry-After", apr_psprintf(r->pool, "%u", retryAfter));
+        return EC_UNAVAILABLE;
+    }
+    return 0;
+}
+static void releaseNvpSlot(void)
+{
+    if (curlPool.maxInFlight > 0)
+    {
+        apr_atomic_dec32(&curlPool.inFlight);
+    }
+}
+/*
+ * Starts one admitted NVP call on the configured ApiTransport; the caller
+ * collects it with finishNvpCall. The response is decoded into pool, which
+ * the I/O thread may use while the caller goes on with other work.
+ */
+static nvp_call* startNvpCall(request_rec *r, apr_pool_t* pool, int method, const char* body, apr_size_t len, ec_params* data, int* status)
+{
+    nvp_call* call;
+    long timeoutMs;
+    *status = admitNvpCall(r, method, &timeoutMs);
+    if (*status != 0)
+    {
+        return NULL;
+    }
+    call = createNvpCall(pool, method, body, len, data);
+    if (config.transport->start(call, data->account->endPoint, timeoutMs) != 0)
+    {
+        EC_ERROR(r, "%s not started: %s", nvpMethodNames[method], call->error);
+        breakerRecord(r->server, 1);
+        releaseNvpSlot();
+        *status = 2;
+        return NULL;
+    }
+    return call;
+}
+
+/*
+ * Only a 200 carrying an ACK is an answer. Anything else, such as the
+ * error page of a proxy, counts as a transport error and leaves no
+ * response field set.
+ */
+static int finishNvpCall(request_rec *r, nvp_call* call)
+{
+    int failed = config.transport->finish(call);
+    releaseNvpSlot();
+    if (!failed)
+    {
+        finishNvpDecoder(&call->decoder);
+        if (call->httpCode != 200)
+        {
+            call->error = apr_psprintf(r->pool, "HTTP status %ld", call->httpCode);
+            failed = 1;
+        }
+        else if (call->decoder.data->ack == NULL)
+        {
+            call->error = "no ACK in the response";
+            failed = 1;
+        }
+    }
+    if (failed)
+    {
+        EC_ERROR(r, "%s failed: %s", nvpMethodNames[call->method], call->error);
+        recordCounter(stats ? &stats->transportErrors[call->method] : NULL);
+        breakerRecord(r->server, 1);
+        clearNvpResponse(call->decoder.data);
+        return 1;
+    }
+    breakerRecord(r->server, 0);
+    EC_TRACE(r, TRACE_DEBUG, "%s response of %" APR_SIZE_T_FMT " bytes", nvpMethodNames[call->method], call->decoder.total);
+    return 0;
+}
+
+static int callNvpApi(request_rec *r, int method, const char* body, apr_size_t len, ec_params* data)
+{
+    int status;
+    nvp_call* call = startNvpCall(r, r->pool, method, body, len, data, &status);
+    if (call == NULL)
+    {
+        return status;
+    }
+    return finishNvpCall(r, call);
+}
+
+/*
+ * Forgets the answer of the previous call on data, so a Do can never be
+ * judged by the ACK or error code its Get left behind.
+ */
+static void clearNvpResponse(ec_params* data)
+{
+    data->ack = NULL;
+    data->respToken = NULL;
+    data->checkoutStatus = NULL;
+    data->transactionId = NULL;
+    data->errorCode = NULL;
+    if (data->other != NULL)
+    {
+        apr_table_unset(data->other, "L_LONGMESSAGE0");
+    }
+}
+
+static nvp_call* createNvpCall(apr_pool_t* pool, int method, const char* body, apr_size_t len, ec_params* data)
+{
+    nvp_call* call = apr_pcalloc(pool, sizeof(nvp_call));
+    clearNvpResponse(data);
+    call->decoder.pool = pool;
+    call->decoder.data = data;
+    call->method = method;
+    call->body = body;
+    call->len = len;
+    /* The per-request fields, after the credentials of the template */
+    call->fields = body + data->account->templates[method].len;
+    call->result = CURLE_OK;
+    return call;
+}
+
+/*
+ * The libcurl transport runs a call on a pooled handle. The handle keeps
+ * its connection alive and shares the DNS, TLS session and connection
+ * caches of the child, so only the first call of a child pays for the
+ * handshake. When ApiAsyncEngine is on, the call is handed to the I/O
+ * thread of the child straight away.
+ */
+static int curlStart(nvp_call* call, const char* endPoint, long timeoutMs)
+{
+    CURL *curl = acquireCurlHandle();
+    if (curl == NULL)
+    {
+        call->error = "no API connection available";
+        return 1;
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, endPoint);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeoutMs);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)call->len);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, call->body);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &call->decoder);
+    call->curl = curl;
+    if (submitNvpCall(call, call->decoder.pool) != APR_SUCCESS)
+    {
+        call->synchronous = 1;
+    }
+    return 0;
+}
+
+static int curlFinish(nvp_call* call)
+{
+    if (call->synchronous)
+    {
+        call->result = curl_easy_perform(call->curl);
+    }
+    else
+    {
+        waitNvpCall(call);
+    }
+    if (call->result != CURLE_OK)
+    {
+        call->error = apr_psprintf(call->decoder.pool, "curl_easy_perform() failed: %s, %d", curl_easy_strerror(call->result), call->result);
+        releaseCurlHandle(call->curl, 1);
+        return 1;
+    }
+    curl_easy_getinfo(call->curl, CURLINFO_RESPONSE_CODE, &call->httpCode);
+    recordCurlTimings(call->curl);
+    releaseCurlHandle(call->curl, 0);
+    return 0;
+}
+
+/*
+ * ApiTransport record makes real calls and appends one line per completed
+ * call to the file: method, latency in microseconds, the request fields
+ * and the response, separated by tabs. Credentials are part of the
+ * compiled template and never reach the file.
+ */
+static int recordStart(nvp_call* call, const char* endPoint, long timeoutMs)
+{
+    call->decoder.rawCap = BUFSIZE;
+    call->decoder.raw = apr_palloc(call->decoder.pool, BUFSIZE);
+    call->started = apr_time_now();
+    return curlStart(call, endPoint, timeoutMs);
+}
+
+/* True for a response key that holds buyer details: name, mail, phone, address or note */
+static int isPrivateNvpKey(const char* key, apr_size_t len)
+{
+    static const char* const parts[] = { "EMAIL", "FIRSTNAME", "MIDDLENAME", "LASTNAME", "SALUTATION", "SUFFIX",
+                                         "PHONENUM", "BUSINESS", "SHIPTO", "BILLTO", "BILLINGNAME", "STREET", "NOTE" };
+    char name[64];
+    int i;
+    if (len >= sizeof(name))
+    {
+        return 1;
+    }
+    memcpy(name, key, len);
+    name[len] = '\0';
+    for (i = 0; i < (int)(sizeof(parts) / sizeof(parts[0])); i++)
+    {
+        if (strstr(name, parts[i]) != NULL)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copies an encoded response for the record file with the values of
+ * buyer details replaced by REDACTED. Tabs and line breaks become spaces
+ * so the exchange stays on one line.
+ */
+static char* redactNvpResponse(apr_pool_t* pool, const char* raw, apr_size_t len, apr_size_t* outLen)
+{
+    static const char mark[] = "REDACTED";
+    const char* end = raw + len;
+    const char* amp;
+    const char* eq;
+    apr_size_t pairs = 1;
+    apr_size_t i;
+    char* out;
+    char* o;
+    for (i = 0; i < len; i++)
+    {
+        pairs += raw[i] == '&';
+    }
+    o = out = apr_palloc(pool, len + pairs * (sizeof(mark) - 1) + 1);
+    while (raw < end)
+    {
+        amp = memchr(raw, '&', end - raw);
+        amp = amp != NULL ? amp : end;
+        eq = memchr(raw, '=', amp - raw);
+        if (eq != NULL && isPrivateNvpKey(raw, eq - raw))
+        {
+            memcpy(o, raw, eq + 1 - raw);
+            o += eq + 1 - raw;
+            memcpy(o, mark, sizeof(mark) - 1);
+            o += sizeof(mark) - 1;
+        }
+        else
+        {
+            memcpy(o, raw, amp - raw);
+            o += amp - raw;
+        }
+        if (amp < end)
+        {
+            *o++ = '&';
+        }
+        raw = amp + 1;
+    }
+    *outLen = o - out;
+    for (i = 0; i < *outLen; i++)
+    {
+        if (out[i] == '\t' || out[i] == '\n' || out[i] == '\r')
+        {
+            out[i] = ' ';
+        }
+    }
+    return out;
+}
+
+static int recordFinish(nvp_call* call)
+{
+    nvp_decoder* d = &call->decoder;
+    char* line;
+    char* response;
+    apr_size_t len;
+    if (curlFinish(call) != 0)
+    {
+        return 1;
+    }
+    response = redactNvpResponse(d->pool, d->raw, d->rawLen, &len);
+    line = apr_psprintf(d->pool, "%s\t%" APR_TIME_T_FMT "\t%s\t%.*s\n", nvpMethodNames[call->method],
+                        apr_time_now() - call->started, call->fields[0] == '&' ? call->fields + 1 : call->fields,
+                        (int)len, response);
+    /* One write per line on an O_APPEND file keeps concurrent lines whole */
+    if (config.recordFile != NULL)
+    {
+        apr_file_write_full(config.recordFile, line, strlen(line), NULL);
+    }
+    return 0;
+}
+
+static int fakeStart(nvp_call* call, const char* endPoint, long timeoutMs)
+{
+    call->started = apr_time_now();
+    return 0;
+}
+
+/* Holds a call until latency has passed since it started */
+static void waitLatency(nvp_call* call, apr_interval_time_t latency)
+{
+    apr_interval_time_t left = latency - (apr_time_now() - call->started);
+    if (left > 0)
+    {
+        apr_sleep(left);
+    }
+}
+
+static void feedNvpResponse(nvp_call* call, const char* response)
+{
+    apr_size_t len = strlen(response);
+    call->decoder.total = len;
+    decodeNvpChunk(&call->decoder, response, len);
+    call->httpCode = 200;
+}
+
+/*
+ * ApiTransport fake answers every call in process with a successful
+ * response after the configured latency plus a uniform jitter. The jitter
+ * comes from a counter, so a run is repeatable for a given call order.
+ */
+static int fakeFinish(nvp_call* call)
+{
+    apr_uint32_t n = apr_atomic_inc32(&fakeCounter);
+    apr_uint64_t mix = catalogMix(n);
+    apr_interval_time_t latency = (apr_interval_time_t)config.fakeLatency * 1000;
+    const ec_params* data = call->decoder.data;
+    const char* response;
+    if (config.fakeJitter > 0)
+    {
+        latency += (apr_interval_time_t)(mix % ((apr_uint64_t)config.fakeJitter * 1000 + 1));
+    }
+    waitLatency(call, latency);
+    switch (call->method)
+    {
+    case NVP_SET:
+        response = apr_psprintf(call->decoder.pool, "ACK=Success&TOKEN=EC-FAKE%dX%u", (int)getpid(), n);
+        break;
+    case NVP_GET:
+        response = apr_psprintf(call->decoder.pool, "ACK=Success&TOKEN=%s&CHECKOUTSTATUS=PaymentActionNotInitiated",
+                                data->token != NULL ? data->token : "");
+        break;
+    default:
+        response = apr_psprintf(call->decoder.pool, "ACK=Success&TOKEN=%s&PAYMENTINFO_0_TRANSACTIONID=FAKE%dX%u"
+                                "&PAYMENTINFO_0_PAYMENTSTATUS=Completed", data->token != NULL ? data->token : "", (int)getpid(), n);
+        break;
+    }
+    feedNvpResponse(call, response);
+    return 0;
+}
+
+/*
+ * ApiTransport replay answers a call with the recorded response to the
+ * same method and request fields, after the recorded latency. A request
+ * that was never recorded gets the recorded responses of its method in
+ * turn, so captured traffic can drive a differently shaped load.
+ */
+static int replayFinish(nvp_call* call)
+{
+    nvp_replay* replay = config.replay;
+    const nvp_exchange* exchange;
+    apr_array_header_t* list = replay->byMethod[call->method];
+    const char* fields = call->fields[0] == '&' ? call->fields + 1 : call->fields;
+    exchange = apr_hash_get(replay->byRequest,
+                            apr_pstrcat(call->decoder.pool, nvpMethodNames[call->method], "\t", fields, NULL),
+                            APR_HASH_KEY_STRING);
+    if (exchange == NULL && list != NULL && list->nelts > 0)
+    {
+        apr_uint32_t n = apr_atomic_inc32(&replay->next[call->method]);
+        exchange = APR_ARRAY_IDX(list, n % list->nelts, const nvp_exchange*);
+    }
+    if (exchange == NULL)
+    {
+        call->error = "nothing recorded for this method";
+        return 1;
+    }
+    waitLatency(call, exchange->latency);
+    feedNvpResponse(call, exchange->response);
+    return 0;
+}
+
+/* Reads a file written by ApiTransport record */
+static const char* loadReplay(apr_pool_t* pool, const char* path)
+{
+    nvp_replay* replay = apr_pcalloc(pool, sizeof(nvp_replay));
+    apr_file_t* fd;
+    apr_finfo_t finfo;
+    apr_size_t len;
+    char* buf;
+    char* line;
+    char* next;
+    int lineNo = 0;
+    int i;
+
+    if (apr_file_open(&fd, path, APR_READ, APR_OS_DEFAULT, pool) != APR_SUCCESS
+        || apr_file_info_get(&finfo, APR_FINFO_SIZE, fd) != APR_SUCCESS)
+    {
+        return apr_psprintf(pool, "can't open %s", path);
+    }
+    len = (apr_size_t)finfo.size;
+    buf = apr_palloc(pool, len + 1);
+    if (apr_file_read_full(fd, buf, len, NULL) != APR_SUCCESS)
+    {
+        apr_file_close(fd);
+        return apr_psprintf(pool, "can't read %s", path);
+    }
+    apr_file_close(fd);
+    buf[len] = '\0';
+    replay->byRequest = apr_hash_make(pool);
+    for (line = buf; *line != '\0'; line = next)
+    {
+        char* method;
+        char* latency;
+        char* request;
+        char* last;
+        nvp_exchange* exchange;
+        lineNo++;
+        next = line + strcspn(line, "\n");
+        if (*next == '\n')
+        {
+            *next++ = '\0';
+        }
+        if (*line == '\0')
+        {
+            continue;
+        }
+        exchange = apr_pcalloc(pool, sizeof(nvp_exchange));
+        method = apr_strtok(line, "\t", &last);
+        latency = apr_strtok(NULL, "\t", &last);
+        request = apr_strtok(NULL, "\t", &last);
+        exchange->response = apr_strtok(NULL, "\t", &last);
+        for (i = 0; method != NULL && i < NVP_METHOD_COUNT && strcmp(method, nvpMethodNames[i]) != 0; i++)
+            ;
+        if (method == NULL || i == NVP_METHOD_COUNT || latency == NULL || request == NULL || exchange->response == NULL)
+        {
+            return apr_psprintf(pool, "%s:%d: expected <method> <latency> <request> <response>", path, lineNo);
+        }
+        exchange->method = i;
+        exchange->latency = apr_atoi64(latency);
+        if (replay->byMethod[i] == NULL)
+        {
+            replay->byMethod[i] = apr_array_make(pool, 16, sizeof(nvp_exchange*));
+        }
+        APR_ARRAY_PUSH(replay->byMethod[i], nvp_exchange*) = exchange;
+        /* The first recording of a request is the one replayed */
+        request = apr_pstrcat(pool, method, "\t", request, NULL);
+        if (apr_hash_get(replay->byRequest, request, APR_HASH_KEY_STRING) == NULL)
+        {
+            apr_hash_set(replay->byRequest, request, APR_HASH_KEY_STRING, exchange);
+        }
+    }
+    config.replay = replay;
+    return NULL;
+}
+
+/* Opened before the children start so they share it and its permissions */
+static int openRecordFile(apr_pool_t *pconf, server_rec *s)
+{
+    apr_status_t rv;
+    if (!config.transport->network)
+    {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "ApiTransport %s: API calls do not reach PayPal, for testing only", config.transport->name);
+    }
+    if (config.transport != &recordTransport)
+    {
+        return OK;
+    }
+    /* Only the owner may read the exchanges, and payer ids are still in them */
+    rv = apr_file_open(&config.recordFile, config.transportFile, APR_WRITE|APR_CREATE|APR_APPEND, APR_FPROT_UREAD|APR_FPROT_UWRITE, pconf);
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "ApiTransport record: can't open %s", config.transportFile);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "ApiTransport record: writing every API exchange to %s", config.transportFile);
+    return OK;
+}
+
+static int doExpressCheckout(request_rec *r, ec_params* data) {
+    int status = 0;
+    char* body;
+    apr_size_t len;
+    apr_time_t start = apr_time_now();
+    EC_TRACE(r, TRACE_DEBUG, "DoExpressCheckout started");
+    body = populateDoExpressCheckoutRequest(&len, data, r->pool);
+    EC_TRACE(r, TRACE_DEBUG, "Do EC request = %s", body + data->account->templates[NVP_DO].len);
+    status = callNvpApi(r, NVP_DO, body, len, data);
+    if(status == 0)
+    {
+        status = checkDoResponse(r, data);
+    }
+    EC_TRACE(r, TRACE_DEBUG, "DoExpressCheckout completed with status %d", status);
+    recordLatency(STAT_DO, apr_time_now() - start);
+    return status;
+}
+
+/*
+ * Pipelined return leg: DoExpressCheckoutPayment goes out first and the
+ * file is opened, typed and read ahead while it is in flight. Nothing is
+ * sent before the capture succeeded. The response is decoded by the I/O
+ * thread into a copy of the parameters on a pool with its own allocator,
+ * since the worker keeps allocating from the request pool meanwhile.
+ */
+static int pipelinedCapture(request_rec *r, ec_params* data, prepared_file* file)
+{
+    int status = 0;
+    int prefixKb = data->dir->capturePrefix > 0 ? data->dir->capturePrefix : 0;
+    char* body;
+    apr_size_t len;
+    apr_allocator_t* allocator;
+    apr_pool_t* callPool;
+    ec_params* reply;
+    nvp_call* call;
+    apr_time_t start = apr_time_now();
+
+    EC_TRACE(r, TRACE_DEBUG, "DoExpressCheckout started, pipelined with delivery");
+    body = populateDoExpressCheckoutRequest(&len, data, r->pool);
+    EC_TRACE(r, TRACE_DEBUG, "Do EC request = %s", body + data->account->templates[NVP_DO].len);
+    if (apr_allocator_create(&allocator) != APR_SUCCESS)
+    {
+        prepareFile(r, file, 0);
+        return doExpressCheckout(r, data);
+    }
+    apr_pool_create_ex(&callPool, r->pool, NULL, allocator);
+    apr_allocator_owner_set(allocator, callPool);
+    /* Only the request side is copied, so no stale answer can be read back */
+    reply = apr_pcalloc(r->pool, sizeof(ec_params));
+    reply->name = data->name;
+    reply->amount = data->amount;
+    reply->token = data->token;
+    reply->payerId = data->payerId;
+    reply->appContext = data->appContext;
+    reply->dir = data->dir;
+    reply->account = data->account;
+    reply->items = data->items;
+    reply->itemCount = data->itemCount;
+    call = startNvpCall(r, callPool, NVP_DO, body, len, reply, &status);
+    if (call == NULL)
+    {
+        return status;
+    }
+    prepareFile(r, file, (apr_size_t)prefixKb << 10);
+    status = finishNvpCall(r, call);
+    if(status == 0)
+    {
+        status = checkDoResponse(r, reply);
+    }
+    data->ack = reply->ack;
+    data->errorCode = reply->errorCode;
+    data->transactionId = reply->transactionId;
+    EC_TRACE(r, TRACE_DEBUG, "DoExpressCheckout completed with status %d, %" APR_SIZE_T_FMT " bytes read ahead", status, file->prefixLen);
+    recordLatency(STAT_DO, apr_time_now() - start);
+    return status;
+}
+
+/* Maps the ACK of DoExpressCheckoutPayment to the status of the checkout */
+static int checkDoResponse(request_rec *r, ec_params* data)
+{
+    const char* ack = data->ack;
+    recordAck(NVP_DO, ack);
+    EC_TRACE(r, TRACE_INFO, "DoExpressCheckout ACK status %s", ack);
+    if(ack != NULL && apr_strnatcasecmp(ack, "Success") == 0) 
+    {
+        EC_TRACE(r, TRACE_INFO, "DoExpressCheckout transaction id %s", data->transactionId);
+        return 0;
+    } 
+    if (data->errorCode != NULL && (strcmp(data->errorCode, "10415") == 0 || strcmp(data->errorCode, "11607") == 0))
+    {
+        /* Transaction already completed for this token, or a duplicate of one in progress */
+        EC_TRACE(r, TRACE_INFO, "DoExpressCheckout reports token already processed: %s", data->errorCode);
+        return EC_ALREADY_PROCESSED;
+    }
+    EC_ERROR(r, "DoExpressCheckout API has been failed: %s %s", data->errorCode, getParam(data, "L_LONGMESSAGE0"));
+    return 3;
+}
+
+static int getExpressCheckout(request_rec *r, ec_params* data) {
+    int status = 0;
+    char* body;
+    apr_size_t len;
+    apr_time_t start = apr_time_now();
+    EC_TRACE(r, TRACE_DEBUG, "GetExpressCheckout started");
+    body = populateGetExpressCheckoutRequest(&len, data, r->pool);
+    EC_TRACE(r, TRACE_DEBUG, "Get EC request = %s", body + data->account->templates[NVP_GET].len);
+    status = callNvpApi(r, NVP_GET, body, len, data);
+    if(status == 0) {
+        const char* ack = data->ack;
+        recordAck(NVP_GET, ack);
+        if(ack != NULL && apr_strnatcasecmp(ack, "Success") == 0) {
+            const char* checkoutStatus = data->checkoutStatus;
+            EC_TRACE(r, TRACE_INFO, "GetExpressCheckout checkout status %s", checkoutStatus);
+            if(checkoutStatus == NULL) {
+                status = 0;
+            } else if(apr_strnatcasecmp(checkoutStatus, "PaymentCompleted") == 0 || apr_strnatcasecmp(checkoutStatus, "PaymentActionCompleted") == 0) { 
+                status = EC_ALREADY_PROCESSED;
+                EC_TRACE(r, TRACE_INFO, "This token was already used, can't make DoExpressCheckout call again");
+            } else if(apr_strnatcasecmp(checkoutStatus, "PaymentActionNotInitiated") == 0){
+                status = 0;
+            } 
+        } else {
+            EC_ERROR(r, "GetExpressCheckout API has been failed: %s %s", data->errorCode, getParam(data, "L_LONGMESSAGE0"));
+            status = 0;
+        }
+    }
+    EC_TRACE(r, TRACE_DEBUG, "GetExpressCheckout completed with status %d", status);
+    recordLatency(STAT_GET, apr_time_now() - start);
+    return status;
+}
+
+static int setExpressCheckout(request_rec *r, ec_params* data) {
+    int status = 0;
+    char* body;
+    apr_size_t len;
+    apr_time_t start = apr_time_now();
+    EC_TRACE(r, TRACE_DEBUG, "SetExpressCheckout started");
+    body = populateSetExpressCheckoutRequest(&len, data, r->pool);
+    EC_TRACE(r, TRACE_DEBUG, "Set EC request = %s", body + data->account->templates[NVP_SET].len);
+    status = callNvpApi(r, NVP_SET, body, len, data);
+    if(status == 0) {
+        const char* ack = data->ack;
+        recordAck(NVP_SET, ack);
+        if(ack == NULL || apr_strnatcasecmp(ack, "Success") != 0 || data->respToken == NULL) {
+            EC_ERROR(r, "SetExpressCheckout API has been failed: %s %s", data->errorCode, getParam(data, "L_LONGMESSAGE0"));
+            status = 3;
+        }
+    }
+    EC_TRACE(r, TRACE_DEBUG, "SetExpressCheckout completed with status %d", status);
+    recordLatency(STAT_SET, apr_time_now() - start);
+    return status;
+}
+
+static void lockCurlShare(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(curlPool.locks[data]);
+#endif
+}
+
+static void unlockCurlShare(CURL *handle, curl_lock_data data, void *userptr)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(curlPool.locks[data]);
+#endif
+}
+
+static CURL* createCurlHandle(void)
+{
+    CURL *curl = curl_easy_init();
+    if (curl == NULL)
+    {
+        return NULL;
+    }
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, 0L);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                     (long)(config.connectTimeout > 0 ? config.connectTimeout : DEFAULT_CONNECT_TIMEOUT));
+#if LIBCURL_VERSION_NUM >= 0x074100
+    curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, (long)curlPool.idleTimeout);
+#endif
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
+    curl_easy_setopt(curl, CURLOPT_SHARE, curlPool.share);
+    return curl;
+}
+
+#if APR_HAS_THREADS
+static apr_status_t curlHandleConstructor(void **resource, void *params, apr_pool_t *pool)
+{
+    *resource = createCurlHandle();
+    return *resource == NULL ? APR_EGENERAL : APR_SUCCESS;
+}
+
+static apr_status_t curlHandleDestructor(void *resource, void *params, apr_pool_t *pool)
+{
+    curl_easy_cleanup((CURL*)resource);
+    return APR_SUCCESS;
+}
+#endif
+
+static CURL* acquireCurlHandle(void)
+{
+#if APR_HAS_THREADS
+    void *resource = NULL;
+    if (curlPool.handles == NULL || apr_reslist_acquire(curlPool.handles, &resource) != APR_SUCCESS)
+    {
+        return NULL;
+    }
+    return (CURL*)resource;
+#else
+    if (curlPool.handle == NULL)
+    {
+        curlPool.handle = createCurlHandle();
+    }
+    return curlPool.handle;
+#endif
+}
+
+/*
+ * A handle whose last transfer failed is dropped rather than returned,
+ * so a broken connection is never handed to the next request.
+ */
+static void releaseCurlHandle(CURL *curl, int failed)
+{
+#if APR_HAS_THREADS
+    if (failed)
+    {
+        apr_reslist_invalidate(curlPool.handles, curl);
+    }
+    else
+    {
+        apr_reslist_release(curlPool.handles, curl);
+    }
+#else
+    if (failed)
+    {
+        curl_easy_cleanup(curl);
+        curlPool.handle = NULL;
+    }
+#endif
+}
+
+/*
+ * Opens the first connection to ApiEndPoint at child start so the DNS
+ * entry, TLS session and kept-alive connection are already cached when
+ * the first payment request arrives.
+ */
+static void warmCurlPool(server_rec *s, const char* endPoint)
+{
+    CURL *curl;
+    CURLcode res;
+    curl = acquireCurlHandle();
+    if (curl == NULL)
+    {
+        return;
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, endPoint);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
+    res = curl_easy_perform(curl);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 0L);
+    if (res != CURLE_OK)
+    {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Unable to warm up connection to %s: %s", endPoint, curl_easy_strerror(res));
+    }
+    releaseCurlHandle(curl, res != CURLE_OK);
+}
+
+#if NVP_ENGINE_SUPPORTED
+/*
+ * The I/O thread of the child. It owns the multi handle and drives every
+ * submitted NVP transfer in one poll loop. The submitting worker is not
+ * freed: the payment is decided in check_user_id, which cannot suspend
+ * the request, so the worker blocks on the call's condition instead of
+ * in curl_easy_perform. What it gains is that the worker may do other
+ * work between submitting and waiting, as pipelinedCapture does.
+ */
+static void* APR_THREAD_FUNC runNvpEngine(apr_thread_t *thread, void *data)
+{
+    nvp_call* call;
+    nvp_call* next;
+    CURLMsg* msg;
+    int running = 0;
+    int left;
+    while (1)
+    {
+        apr_thread_mutex_lock(nvpEngine.lock);
+        if (nvpEngine.stop)
+        {
+            apr_thread_mutex_unlock(nvpEngine.lock);
+            break;
+        }
+        call = nvpEngine.pending;
+        nvpEngine.pending = NULL;
+        apr_thread_mutex_unlock(nvpEngine.lock);
+
+        for (; call != NULL; call = next)
+        {
+            next = call->next;
+            curl_easy_setopt(call->curl, CURLOPT_PRIVATE, call);
+            if (curl_multi_add_handle(nvpEngine.multi, call->curl) != CURLM_OK)
+            {
+                completeNvpCall(call, CURLE_FAILED_INIT);
+                continue;
+            }
+            call->prev = NULL;
+            call->next = nvpEngine.active;
+            if (nvpEngine.active != NULL)
+            {
+                nvpEngine.active->prev = call;
+            }
+            nvpEngine.active = call;
+        }
+
+        curl_multi_perform(nvpEngine.multi, &running);
+        while ((msg = curl_multi_info_read(nvpEngine.multi, &left)) != NULL)
+        {
+            if (msg->msg != CURLMSG_DONE)
+            {
+                continue;
+            }
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&call);
+            curl_multi_remove_handle(nvpEngine.multi, msg->easy_handle);
+            if (call->prev != NULL)
+            {
+                call->prev->next = call->next;
+            }
+            else
+            {
+                nvpEngine.active = call->next;
+            }
+            if (call->next != NULL)
+            {
+                call->next->prev = call->prev;
+            }
+            completeNvpCall(call, msg->data.result);
+        }
+        curl_multi_poll(nvpEngine.multi, NULL, 0, 1000, NULL);
+    }
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static void completeNvpCall(nvp_call* call, CURLcode result)
+{
+    apr_thread_mutex_lock(nvpEngine.lock);
+    call->result = result;
+    call->done = 1;
+    apr_thread_cond_signal(call->cond);
+    apr_thread_mutex_unlock(nvpEngine.lock);
+}
+#endif
+
+static apr_status_t submitNvpCall(nvp_call* call, apr_pool_t* pool)
+{
+#if NVP_ENGINE_SUPPORTED
+    if (nvpEngine.multi == NULL)
+    {
+        return APR_ENOTIMPL;
+    }
+    if (apr_thread_cond_create(&call->cond, pool) != APR_SUCCESS)
+    {
+        return APR_EGENERAL;
+    }
+    apr_thread_mutex_lock(nvpEngine.lock);
+    if (nvpEngine.stop)
+    {
+        apr_thread_mutex_unlock(nvpEngine.lock);
+        return APR_EGENERAL;
+    }
+    call->next = nvpEngine.pending;
+    nvpEngine.pending = call;
+    apr_thread_mutex_unlock(nvpEngine.lock);
+    curl_multi_wakeup(nvpEngine.multi);
+    return APR_SUCCESS;
+#else
+    return APR_ENOTIMPL;
+#endif
+}
+
+static void waitNvpCall(nvp_call* call)
+{
+#if NVP_ENGINE_SUPPORTED
+    apr_thread_mutex_lock(nvpEngine.lock);
+    while (!call->done)
+    {
+        apr_thread_cond_wait(call->cond, nvpEngine.lock);
+    }
+    apr_thread_mutex_unlock(nvpEngine.lock);
+#endif
+}
+
+#if NVP_ENGINE_SUPPORTED
+/*
+ * Stops the I/O thread before the handle pool goes away. Transfers that
+ * are still queued or running are failed so no worker waits forever.
+ */
+static apr_status_t stopNvpEngine(void *data)
+{
+    apr_status_t rv;
+    nvp_call* call;
+    nvp_call* next;
+    apr_thread_mutex_lock(nvpEngine.lock);
+    nvpEngine.stop = 1;
+    apr_thread_mutex_unlock(nvpEngine.lock);
+    curl_multi_wakeup(nvpEngine.multi);
+    apr_thread_join(&rv, nvpEngine.thread);
+
+    for (call = nvpEngine.pending; call != NULL; call = next)
+    {
+        next = call->next;
+        completeNvpCall(call, CURLE_ABORTED_BY_CALLBACK);
+    }
+    nvpEngine.pending = NULL;
+    for (call = nvpEngine.active; call != NULL; call = next)
+    {
+        next = call->next;
+        curl_multi_remove_handle(nvpEngine.multi, call->curl);
+        completeNvpCall(call, CURLE_ABORTED_BY_CALLBACK);
+    }
+    nvpEngine.active = NULL;
+    curl_multi_cleanup(nvpEngine.multi);
+    nvpEngine.multi = NULL;
+    return APR_SUCCESS;
+}
+
+static void startNvpEngine(apr_pool_t *p, server_rec *s)
+{
+    nvpEngine.multi = curl_multi_init();
+    if (nvpEngine.multi == NULL)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Unable to create the NVP call engine");
+        return;
+    }
+    curl_multi_setopt(nvpEngine.multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)curlPool.size);
+    apr_thread_mutex_create(&nvpEngine.lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (apr_thread_create(&nvpEngine.thread, NULL, runNvpEngine, NULL, p) != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Unable to start the NVP call engine thread");
+        curl_multi_cleanup(nvpEngine.multi);
+        nvpEngine.multi = NULL;
+        return;
+    }
+    apr_pool_pre_cleanup_register(p, NULL, stopNvpEngine);
+}
+#endif
+
+static apr_status_t cleanupCurl(void *data)
+{
+    if (curlPool.share != NULL)
+    {
+        curl_share_cleanup(curlPool.share);
+        curlPool.share = NULL;
+    }
+    curl_global_cleanup();
+    return APR_SUCCESS;
+}
+
+static void child_init(apr_pool_t *p, server_rec *s)
+{
+    int i;
+    int threads = 1;
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    recordCounter(stats ? &stats->curlInits : NULL);
+    apr_pool_cleanup_register(p, NULL, cleanupCurl, apr_pool_cleanup_null);
+    if (ledgerMutex != NULL)
+    {
+        apr_global_mutex_child_init(&ledgerMutex, apr_global_mutex_lockfile(ledgerMutex), p);
+    }
+    if (cacheMutex != NULL)
+    {
+        apr_global_mutex_child_init(&cacheMutex, apr_global_mutex_lockfile(cacheMutex), p);
+    }
+    initPaymentWriter(p, s);
+
+    curlPool.idleTimeout = config.poolIdleTimeout > 0 ? config.poolIdleTimeout : DEFAULT_POOL_IDLE_TIMEOUT;
+    curlPool.share = curl_share_init();
+#if APR_HAS_THREADS
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    {
+        apr_thread_mutex_create(&curlPool.locks[i], APR_THREAD_MUTEX_DEFAULT, p);
+    }
+#endif
+    curl_share_setopt(curlPool.share, CURLSHOPT_LOCKFUNC, lockCurlShare);
+    curl_share_setopt(curlPool.share, CURLSHOPT_UNLOCKFUNC, unlockCurlShare);
+    curl_share_setopt(curlPool.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curlPool.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(curlPool.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+#if APR_HAS_THREADS
+    /* One handle per worker thread unless ApiConnectionPoolSize says otherwise */
+    if (config.poolSize > 0)
+    {
+        threads = config.poolSize;
+    }
+    else if (ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads) != APR_SUCCESS || threads < 1)
+    {
+        threads = 1;
+    }
+    curlPool.size = threads;
+    /* Leave at least half of the workers free for requests that do not pay */
+    curlPool.maxInFlight = config.maxInFlight > 0 ? config.maxInFlight : (threads + 1) / 2;
+    if (apr_reslist_create(&curlPool.handles, 0, threads, threads,
+                           apr_time_from_sec(curlPool.idleTimeout),
+                           curlHandleConstructor, curlHandleDestructor, NULL, p) != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Unable to create the API connection pool");
+        return;
+    }
+#endif
+    /* One connection to each distinct endpoint; the share makes it reusable */
+    for (i = 0; config.accounts != NULL && i < config.accounts->nelts; i++)
+    {
+        const char* endPoint = APR_ARRAY_IDX(config.accounts, i, ec_account*)->endPoint;
+        int j;
+        for (j = 0; endPoint != NULL && j < i; j++)
+        {
+            const char* seen = APR_ARRAY_IDX(config.accounts, j, ec_account*)->endPoint;
+            if (seen != NULL && strcmp(seen, endPoint) == 0)
+            {
+                break;
+            }
+        }
+        if (endPoint != NULL && j == i && config.transport->network)
+        {
+            warmCurlPool(s, endPoint);
+        }
+    }
+#if NVP_ENGINE_SUPPORTED
+    if (config.asyncEngine)
+    {
+        startNvpEngine(p, s);
+    }
+#endif
+#if APR_HAS_THREADS
+    startPricelistWatcher(p, s);
+    startTokenMinter(p, s);
+#endif
+}
+
+/*
+ * Log-linear histogram bucket of a latency in microseconds: exact below
+ * 16us, then 8 sub-buckets per power of two (at most 12.5% error).
+ */
+static int statBucket(apr_interval_time_t us)
+{
+    apr_uint64_t v = us < 0 ? 0 : (apr_uint64_t)us;
+    int e = 0;
+    int idx;
+    if (v < 16)
+    {
+        return (int)v;
+    }
+    while ((v >> e) > 1)
+    {
+        e++;
+    }
+    idx = 16 + (e - 4) * 8 + (int)((v >> (e - 3)) & 7);
+    return idx < STAT_BUCKETS ? idx : STAT_BUCKETS - 1;
+}
+
+static apr_uint64_t statBucketValue(int idx)
+{
+    int e;
+    if (idx < 16)
+    {
+        return idx;
+    }
+    e = (idx - 16) / 8 + 4;
+    return (apr_uint64_t)(8 + (idx - 16) % 8) << (e - 3);
+}
+
+/* Recording is two atomic increments on the shared segment, no lock */
+static void recordLatency(int which, apr_interval_time_t us)
+{
+    ec_histogram* h;
+    if (stats == NULL)
+    {
+        return;
+    }
+    h = &stats->histograms[which];
+    apr_atomic_inc32(&h->buckets[statBucket(us)]);
+    apr_atomic_inc32(&h->count);
+}
+
+static void recordCounter(volatile apr_uint32_t* counter)
+{
+    if (counter != NULL)
+    {
+        apr_atomic_inc32(counter);
+    }
+}
+
+static void recordBytes(apr_size_t bytes)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+#if APR_VERSION_AT_LEAST(1,7,0)
+    apr_atomic_add64(&stats->bytesServed, bytes);
+#else
+    apr_atomic_add32(&stats->kbytesServed, (apr_uint32_t)(bytes >> 10));
+#endif
+}
+
+static void recordCacheBytes(apr_size_t bytes)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+#if APR_VERSION_AT_LEAST(1,7,0)
+    apr_atomic_add64(&stats->cacheBytes, bytes);
+#else
+    apr_atomic_add32(&stats->cacheKbytes, (apr_uint32_t)(bytes >> 10));
+#endif
+}
+
+static void recordAck(int method, const char* ack)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+    if (ack != NULL && apr_strnatcasecmp(ack, "Success") == 0)
+    {
+        apr_atomic_inc32(&stats->ackSuccess[method]);
+    }
+    else
+    {
+        apr_atomic_inc32(&stats->ackFailure[method]);
+    }
+}
+
+/*
+ * Microseconds from the start of the transfer to the end of phase, one of
+ * name lookup, connect, TLS handshake and first byte, or -1 if unknown.
+ */
+static apr_interval_time_t curlElapsed(CURL* curl, int phase)
+{
+#if LIBCURL_VERSION_NUM >= 0x073d00
+    static const CURLINFO infos[] = { CURLINFO_NAMELOOKUP_TIME_T, CURLINFO_CONNECT_TIME_T, CURLINFO_APPCONNECT_TIME_T, CURLINFO_STARTTRANSFER_TIME_T };
+    curl_off_t t;
+    return curl_easy_getinfo(curl, infos[phase], &t) == CURLE_OK ? (apr_interval_time_t)t : -1;
+#else
+    static const CURLINFO infos[] = { CURLINFO_NAMELOOKUP_TIME, CURLINFO_CONNECT_TIME, CURLINFO_APPCONNECT_TIME, CURLINFO_STARTTRANSFER_TIME };
+    double t;
+    return curl_easy_getinfo(curl, infos[phase], &t) == CURLE_OK ? (apr_interval_time_t)(t * APR_USEC_PER_SEC) : -1;
+#endif
+}
+
+/*
+ * Splits an NVP transfer into DNS, TCP connect, TLS handshake and server
+ * time. libcurl reports when each phase ended, counted from the start of
+ * the transfer, so each phase is recorded as the difference to the end of
+ * the one before. A phase that did not happen, such as the handshake of a
+ * plain HTTP or reused connection, is recorded as 0.
+ */
+static void recordCurlTimings(CURL* curl)
+{
+    apr_interval_time_t previous = 0;
+    apr_interval_time_t t;
+    int i;
+    if (stats == NULL)
+    {
+        return;
+    }
+    for (i = 0; i <= STAT_CURL_STARTTRANSFER - STAT_CURL_NAMELOOKUP; i++)
+    {
+        t = curlElapsed(curl, i);
+        if (t < 0)
+        {
+            continue;
+        }
+        if (t < previous)
+        {
+            t = previous;
+        }
+        recordLatency(STAT_CURL_NAMELOOKUP + i, t - previous);
+        previous = t;
+    }
+}
+
+static apr_uint64_t histogramPercentile(const ec_histogram* h, apr_uint32_t count, double p)
+{
+    apr_uint64_t target = (apr_uint64_t)(count * p);
+    apr_uint64_t seen = 0;
+    int i;
+    if (count == 0)
+    {
+        return 0;
+    }
+    for (i = 0; i < STAT_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen > target)
+        {
+            return statBucketValue(i);
+        }
+    }
+    return statBucketValue(STAT_BUCKETS - 1);
+}
+
+/*
+ * Per-request trace: events are collected in the request pool while the
+ * checkout runs and written as one line when the request is logged. The
+ * sampling decision is made once per request so a sampled request is
+ * always traced completely.
+ */
+static void startTrace(request_rec *r)
+{
+    ec_trace* trace;
+    int rate = config.traceSampleRate > 0 ? config.traceSampleRate : 1;
+    if (config.traceLevel == TRACE_OFF)
+    {
+        return;
+    }
+    if (rate > 1 && apr_atomic_inc32(&traceCounter) % rate != 0)
+    {
+        return;
+    }
+    trace = apr_pcalloc(r->pool, sizeof(ec_trace));
+    trace->start = apr_time_now();
+    ap_set_module_config(r->request_config, &paypal_ec_module, trace);
+}
+
+static int traceEnabled(request_rec *r, int level)
+{
+    return level <= config.traceLevel && ap_get_module_config(r->request_config, &paypal_ec_module) != NULL;
+}
+
+static void traceEvent(request_rec *r, int level, const char* fmt, ...)
+{
+    ec_trace* trace = ap_get_module_config(r->request_config, &paypal_ec_module);
+    va_list args;
+    if (trace == NULL || trace->count >= TRACE_MAX_EVENTS)
+    {
+        return;
+    }
+    va_start(args, fmt);
+    trace->events[trace->count].offset = apr_time_now() - trace->start;
+    trace->events[trace->count].level = level;
+    trace->events[trace->count].message = apr_pvsprintf(r->pool, fmt, args);
+    trace->count++;
+    va_end(args);
+}
+
+static int log_delivery(request_rec *r)
+{
+    request_rec *last = r;
+    if (apr_table_get(r->notes, DELIVERY_NOTE) == NULL)
+    {
+        return DECLINED;
+    }
+    while (last->next != NULL)
+    {
+        last = last->next;
+    }
+    recordBytes(last->bytes_sent);
+    return DECLINED;
+}
+
+static int log_trace(request_rec *r)
+{
+    ec_trace* trace = ap_get_module_config(r->request_config, &paypal_ec_module);
+    const char* line = "";
+    int i;
+    if (trace == NULL || trace->count == 0)
+    {
+        return DECLINED;
+    }
+    for (i = 0; i < trace->count; i++)
+    {
+        line = apr_psprintf(r->pool, "%s%s+%" APR_TIME_T_FMT "us %s", line, i > 0 ? "; " : "",
+                            trace->events[i].offset, trace->events[i].message);
+    }
+    ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "checkout trace uri=%s status=%d total=%" APR_TIME_T_FMT "us events=[%s]",
+                  r->uri, r->status, apr_time_now() - trace->start, line);
+    return DECLINED;
+}
+
+#if APR_POOL_DEBUG
+/* Largest request pool seen, for the soak harness; needs a pool debug APR */
+static int log_footprint(request_rec *r)
+{
+    apr_uint32_t bytes = (apr_uint32_t)apr_pool_num_bytes(r->pool, 1);
+    apr_uint32_t peak;
+    if (stats == NULL)
+    {
+        return DECLINED;
+    }
+    do
+    {
+        peak = apr_atomic_read32(&stats->poolPeak);
+    } while (bytes > peak && apr_atomic_cas32(&stats->poolPeak, bytes, peak) != peak);
+    return DECLINED;
+}
+#endif
+
+/*
+ * Circuit breaker shared by all children. ApiBreakerThreshold consecutive
+ * failed calls (transport errors and HTTP 5xx) open it for
+ * ApiBreakerCooldown seconds, during which calls fail at once. After the
+ * cooldown one probe call is let through; its outcome closes the breaker or
+ * opens it for another cooldown. A probe whose child died is replaced after
+ * a further cooldown.
+ */
+static apr_uint32_t breakerAllows(void)
+{
+    ec_breaker* b;
+    apr_uint32_t now, openUntil, probe;
+    int cooldown = config.breakerCooldown > 0 ? config.breakerCooldown : DEFAULT_BREAKER_COOLDOWN;
+    if (stats == NULL)
+    {
+        return 0;
+    }
+    b = &stats->breaker;
+    openUntil = apr_atomic_read32(&b->openUntil);
+    if (openUntil == 0)
+    {
+        return 0;
+    }
+    now = (apr_uint32_t)apr_time_sec(apr_time_now());
+    if (now < openUntil)
+    {
+        return openUntil - now;
+    }
+    probe = apr_atomic_read32(&b->probeStarted);
+    if ((probe == 0 || now - probe > (apr_uint32_t)cooldown) && apr_atomic_cas32(&b->probeStarted, now, probe) == probe)
+    {
+        return 0;
+    }
+    return 1;
+}
+static void breakerRecord(server_rec *s, int failed)
+{
+    ec_breaker* b;
+    apr_uint32_t failures;
+    int threshold = config.breakerThreshold > 0 ? config.breakerThreshold : DEFAULT_BREAKER_THRESHOLD;
+    int cooldown = config.breakerCooldown > 0 ? config.breakerCooldown : DEFAULT_BREAKER_COOLDOWN;
+    if (stats == NULL)
+    {
+        return;
+    }
+    b = &stats->breaker;
+    if (!failed)
+    {
+        /* Only write the shared line when there is something to reset */
+        if (apr_atomic_read32(&b->failures) != 0)
+        {
+            apr_atomic_set32(&b->failures, 0);
+        }
+        if (apr_atomic_read32(&b->openUntil) != 0)
+        {
+            apr_atomic_set32(&b->openUntil, 0);
+            apr_atomic_set32(&b->probeStarted, 0);
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "API circuit breaker closed");
+        }
+        return;
+    }
+    failures = apr_atomic_inc32(&b->failures) + 1;
+    if (failures >= (apr_uint32_t)threshold || apr_atomic_read32(&b->probeStarted) != 0)
+    {
+        apr_atomic_set32(&b->openUntil, (apr_uint32_t)apr_time_sec(apr_time_now()) + cooldown);
+        apr_atomic_set32(&b->probeStarted, 0);
+        if (failures == (apr_uint32_t)threshold)
+        {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "API circuit breaker opened after %u failed calls", failures);
+        }
+    }
+}
+
+/*
+ * Consumed token ledger. Tokens whose payment has completed, or which PayPal
+ * reported as already processed, are remembered in a socache so a replayed
+ * return URL is answered without an outbound call. The ledger is only an
+ * early answer: PayPal still rejects a duplicate that slips past it.
+ */
+static int isTokenConsumed(request_rec *r, const char* token)
+{
+    unsigned char value[BUFSIZE];
+    unsigned int len = sizeof(value);
+    apr_status_t rv;
+    if (config.ledger == NULL)
+    {
+        return 0;
+    }
+    if (ledgerMutex != NULL)
+    {
+        apr_global_mutex_lock(ledgerMutex);
+    }
+    rv = config.ledgerProvider->retrieve(config.ledger, r->server, (const unsigned char*)token, strlen(token),
+                                         value, &len, r->pool);
+    if (ledgerMutex != NULL)
+    {
+        apr_global_mutex_unlock(ledgerMutex);
+    }
+    if (rv == APR_SUCCESS)
+    {
+        recordCounter(stats ? &stats->ledgerHits : NULL);
+        return 1;
+    }
+    return 0;
+}
+
+static void recordConsumedToken(request_rec *r, const char* token, const char* transactionId)
+{
+    const char* value = transactionId != NULL ? transactionId : "";
+    int timeout = config.ledgerTimeout > 0 ? config.ledgerTimeout : DEFAULT_LEDGER_TIMEOUT;
+    apr_status_t rv;
+    if (config.ledger == NULL)
+    {
+        return;
+    }
+    if (ledgerMutex != NULL)
+    {
+        apr_global_mutex_lock(ledgerMutex);
+    }
+    rv = config.ledgerProvider->store(config.ledger, r->server, (const unsigned char*)token, strlen(token),
+                                      apr_time_now() + apr_time_from_sec(timeout),
+                                      (unsigned char*)value, strlen(value) + 1, r->pool);
+    if (ledgerMutex != NULL)
+    {
+        apr_global_mutex_unlock(ledgerMutex);
+    }
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, "Unable to record token %s in the ledger", token);
+    }
+}
+
+static apr_status_t destroyLedger(void *data)
+{
+    server_rec *s = data;
+    if (config.ledger != NULL)
+    {
+        config.ledgerProvider->destroy(config.ledger, s);
+        config.ledger = NULL;
+    }
+    ledgerMutex = NULL;
+    return APR_SUCCESS;
+}
+
+static int createLedger(apr_pool_t *pconf, server_rec *s)
+{
+    static const struct ap_socache_hints hints = { 20, 20, apr_time_from_sec(60) };
+    apr_status_t rv;
+    if (config.ledger == NULL)
+    {
+        return OK;
+    }
+    if (config.ledgerProvider->flags & AP_SOCACHE_FLAG_NOTMPSAFE)
+    {
+        rv = ap_global_mutex_create(&ledgerMutex, NULL, LEDGER_MUTEX_TYPE, NULL, s, pconf, 0);
+        if (rv != APR_SUCCESS)
+        {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Unable to create the token ledger mutex");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+    rv = config.ledgerProvider->init(config.ledger, "paypal-ec-ledger", &hints, s, pconf);
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Unable to initialise the token ledger");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    apr_pool_cleanup_register(pconf, s, destroyLedger, apr_pool_cleanup_null);
+    return OK;
+}
+
+/*
+ * Pre-minted SetExpressCheckout tokens. The SetExpressCheckout request for
+ * a URL depends only on the URL and its price, so tokens for the most
+ * requested URLs can be fetched ahead of time. The table lives in shared
+ * memory: requests count hits and take ready tokens, and one minter thread,
+ * in whichever child holds the lease, keeps each hot item topped up. Every
+ * slot and token moves EMPTY -> BUSY -> READY with compare-and-swap, so a
+ * token is handed out once and only its owner touches a BUSY entry.
+ */
+static apr_uint32_t mintHash(const char* key)
+{
+    apr_uint32_t h = 2166136261u;
+    while (*key)
+    {
+        h = (h ^ (unsigned char)*key++) * 16777619u;
+    }
+    return h;
+}
+static mint_item* findMintItem(ec_params* data)
+{
+    apr_size_t urlLen = strlen(data->appContext);
+    apr_uint32_t start;
+    int i;
+    if (urlLen >= MINT_URL_MAX || strlen(data->name) >= MINT_NAME_MAX || strlen(data->amount) >= MINT_AMOUNT_MAX)
+    {
+        return NULL;
+    }
+    start = mintHash(data->appContext);
+    for (i = 0; i < MINT_PROBE; i++)
+    {
+        mint_item* item = &mintTable->items[(start + i) % MINT_SLOTS];
+        apr_uint32_t gen = apr_atomic_read32(&item->gen);
+        apr_uint32_t state = apr_atomic_read32(&item->state);
+        if (state == MINT_READY)
+        {
+            if (strcmp(item->url, data->appContext) == 0 && apr_atomic_read32(&item->gen) == gen)
+            {
+                return item;
+            }
+        }
+        else if (state == MINT_EMPTY && apr_atomic_cas32(&item->state, MINT_BUSY, MINT_EMPTY) == MINT_EMPTY)
+        {
+            memcpy(item->url, data->appContext, urlLen + 1);
+            apr_cpystrn(item->name, data->name, MINT_NAME_MAX);
+            apr_cpystrn(item->amount, data->amount, MINT_AMOUNT_MAX);
+            item->account = data->account->index;
+            item->stale = 0;
+            item->score = 0;
+            apr_atomic_set32(&item->state, MINT_READY);
+            return item;
+        }
+    }
+    return NULL;
+}
+static const char* takeMintedToken(request_rec *r, ec_params* data)
+{
+    mint_item* item;
+    apr_uint32_t now;
+    int lifetime = config.preMintLifetime > 0 ? config.preMintLifetime : DEFAULT_PREMINT_LIFETIME;
+    int i;
+    if (mintTable == NULL || data->items != NULL || data->name == NULL || data->amount == NULL)
+    {
+        return NULL;
+    }
+    item = findMintItem(data);
+    if (item == NULL)
+    {
+        return NULL;
+    }
+    apr_atomic_inc32(&item->hits);
+    if (strcmp(item->amount, data->amount) != 0)
+    {
+        /* The price changed; the minter drops the item and its tokens */
+        item->stale = 1;
+        return NULL;
+    }
+    now = (apr_uint32_t)apr_time_sec(apr_time_now());
+    for (i = 0; i < MINT_MAX_DEPTH; i++)
+    {
+        minted_token* t = &item->tokens[i];
+        if (apr_atomic_read32(&t->state) == MINT_READY && apr_atomic_cas32(&t->state, MINT_BUSY, MINT_READY) == MINT_READY)
+        {
+            const char* token = apr_pstrdup(r->pool, t->token);
+            int fresh = now - t->mintedAt < (apr_uint32_t)lifetime;
+            apr_atomic_set32(&t->state, MINT_EMPTY);
+            if (fresh)
+            {
+                recordCounter(stats ? &stats->preMintHits : NULL);
+                return token;
+            }
+        }
+    }
+    return NULL;
+}
+static int holdMintLease(void)
+{
+    apr_uint32_t self = (apr_uint32_t)getpid();
+    apr_uint32_t now = (apr_uint32_t)apr_time_sec(apr_time_now());
+    apr_uint32_t lease = apr_atomic_read32(&mintTable->leaseUntil);
+    if (apr_atomic_read32(&mintTable->leaseOwner) == self && now < lease)
+    {
+        apr_atomic_set32(&mintTable->leaseUntil, now + MINT_LEASE);
+        return 1;
+    }
+    if (now >= lease && apr_atomic_cas32(&mintTable->leaseUntil, now + MINT_LEASE, lease) == lease)
+    {
+        apr_atomic_set32(&mintTable->leaseOwner, self);
+        return 1;
+    }
+    return 0;
+}
+/* Empties the READY tokens of an item; returns the number still BUSY */
+static int drainMintItem(mint_item* item, apr_uint32_t olderThan)
+{
+    int busy = 0;
+    int i;
+    for (i = 0; i < MINT_MAX_DEPTH; i++)
+    {
+        minted_token* t = &item->tokens[i];
+        apr_uint32_t state = apr_atomic_read32(&t->state);
+        if (state == MINT_BUSY)
+        {
+            busy++;
+        }
+        else if (state == MINT_READY && t->mintedAt < olderThan
+                 && apr_atomic_cas32(&t->state, MINT_BUSY, MINT_READY) == MINT_READY)
+        {
+            apr_atomic_set32(&t->state, MINT_EMPTY);
+        }
+    }
+    return busy;
+}
+static const char* mintToken(mint_item* item, apr_pool_t* scratch, server_rec* s)
+{
+    ec_params data;
+    nvp_call* call;
+    char* body;
+    apr_size_t len;
+    int failed;
+    apr_time_t start = apr_time_now();
+
+    memset(&data, 0, sizeof(data));
+    if (config.accounts == NULL || item->account < 0 || item->account >= config.accounts->nelts)
+    {
+        return NULL;
+    }
+    data.account = APR_ARRAY_IDX(config.accounts, item->account, ec_account*);
+    data.name = item->name;
+    data.amount = item->amount;
+    data.appContext = item->url;
+    body = populateSetExpressCheckoutRequest(&len, &data, scratch);
+    call = createNvpCall(scratch, NVP_SET, body, len, &data);
+    if (config.transport->start(call, data.account->endPoint, (long)(config.callTimeout > 0 ? config.callTimeout : DEFAULT_CALL_TIMEOUT)) != 0)
+    {
+        return NULL;
+    }
+    failed = config.transport->finish(call);
+    if (!failed && call->httpCode != 200)
+    {
+        call->error = apr_psprintf(scratch, "HTTP status %ld", call->httpCode);
+        failed = 1;
+    }
+    breakerRecord(s, failed);
+    if (failed)
+    {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Pre-minting for %s failed: %s", item->name, call->error);
+        recordCounter(stats ? &stats->transportErrors[NVP_SET] : NULL);
+        return NULL;
+    }
+    finishNvpDecoder(&call->decoder);
+    recordAck(NVP_SET, data.ack);
+    recordLatency(STAT_SET, apr_time_now() - start);
+    if (data.ack == NULL || apr_strnatcasecmp(data.ack, "Success") != 0 || data.respToken == NULL
+        || strlen(data.respToken) >= MINT_TOKEN_MAX)
+    {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Pre-minting for %s failed: %s", item->name, data.errorCode);
+        return NULL;
+    }
+    return data.respToken;
+}
+static void mintRound(apr_pool_t* scratch, server_rec* s, apr_uint32_t round)
+{
+    int lifetime = config.preMintLifetime > 0 ? config.preMintLifetime : DEFAULT_PREMINT_LIFETIME;
+    int hotItems = config.preMintHotItems > 0 ? config.preMintHotItems : DEFAULT_PREMINT_HOT_ITEMS;
+    apr_uint32_t now = (apr_uint32_t)apr_time_sec(apr_time_now());
+    mint_item* hot[MINT_SLOTS];
+    int count = 0;
+    int i, j;
+
+    for (i = 0; i < MINT_SLOTS; i++)
+    {
+        mint_item* item = &mintTable->items[i];
+        if (apr_atomic_read32(&item->state) != MINT_READY)
+        {
+            continue;
+        }
+        /* Hits with the history halved every MINT_DECAY_ROUNDS rounds */
+        if (round % MINT_DECAY_ROUNDS == 0)
+        {
+            item->score /= 2;
+        }
+        item->score += apr_atomic_xchg32(&item->hits, 0);
+        if (item->stale || item->score == 0)
+        {
+            if (drainMintItem(item, now + 1) == 0 && apr_atomic_cas32(&item->state, MINT_BUSY, MINT_READY) == MINT_READY)
+            {
+                apr_atomic_inc32(&item->gen);
+                apr_atomic_set32(&item->state, MINT_EMPTY);
+            }
+            continue;
+        }
+        drainMintItem(item, now - lifetime);
+        if (item->score < MINT_MIN_SCORE)
+        {
+            continue;
+        }
+        /* Insertion into the list of hot items, highest score first */
+        for (j = count; j > 0 && hot[j - 1]->score < item->score; j--)
+        {
+            hot[j] = hot[j - 1];
+        }
+        hot[j] = item;
+        count++;
+    }
+    if (count > hotItems)
+    {
+        count = hotItems;
+    }
+    for (i = 0; i < count; i++)
+    {
+        for (j = 0; j < config.preMintTokens; j++)
+        {
+            minted_token* t = &hot[i]->tokens[j];
+            const char* token;
+            if (apr_atomic_cas32(&t->state, MINT_BUSY, MINT_EMPTY) != MINT_EMPTY)
+            {
+                continue;
+            }
+            token = breakerAllows() == 0 ? mintToken(hot[i], scratch, s) : NULL;
+            if (token == NULL)
+            {
+                apr_atomic_set32(&t->state, MINT_EMPTY);
+                return;
+            }
+            apr_cpystrn(t->token, token, MINT_TOKEN_MAX);
+            t->mintedAt = (apr_uint32_t)apr_time_sec(apr_time_now());
+            apr_atomic_set32(&t->state, MINT_READY);
+        }
+    }
+}
+#if APR_HAS_THREADS
+static void* APR_THREAD_FUNC runTokenMinter(apr_thread_t *thread, void *data)
+{
+    server_rec* s = data;
+    apr_pool_t* scratch;
+    apr_uint32_t round = 0;
+
+    apr_pool_create(&scratch, tokenMinter.pool);
+    apr_thread_mutex_lock(tokenMinter.lock);
+    while (!tokenMinter.stop)
+    {
+        apr_thread_cond_timedwait(tokenMinter.cond, tokenMinter.lock, apr_time_from_sec(MINT_INTERVAL));
+        if (tokenMinter.stop)
+        {
+            break;
+        }
+        apr_thread_mutex_unlock(tokenMinter.lock);
+        if (holdMintLease())
+        {
+            mintRound(scratch, s, ++round);
+            apr_pool_clear(scratch);
+        }
+        apr_thread_mutex_lock(tokenMinter.lock);
+    }
+    apr_thread_mutex_unlock(tokenMinter.lock);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+static apr_status_t stopTokenMinter(void *data)
+{
+    apr_status_t rv;
+    apr_thread_mutex_lock(tokenMinter.lock);
+    tokenMinter.stop = 1;
+    apr_thread_cond_signal(tokenMinter.cond);
+    apr_thread_mutex_unlock(tokenMinter.lock);
+    apr_thread_join(&rv, tokenMinter.thread);
+    return APR_SUCCESS;
+}
+static void startTokenMinter(apr_pool_t *p, server_rec *s)
+{
+    if (mintTable == NULL)
+    {
+        return;
+    }
+    apr_pool_create(&tokenMinter.pool, p);
+    apr_thread_mutex_create(&tokenMinter.lock, APR_THREAD_MUTEX_DEFAULT, p);
+    apr_thread_cond_create(&tokenMinter.cond, p);
+    if (apr_thread_create(&tokenMinter.thread, NULL, runTokenMinter, s, p) != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Unable to start the token minter thread");
+        return;
+    }
+    apr_pool_pre_cleanup_register(p, NULL, stopTokenMinter);
+}
+#endif
+static void createMintTable(apr_pool_t *pconf, server_rec *s)
+{
+    apr_status_t rv;
+    mintTable = NULL;
+    if (config.preMintTokens <= 0)
+    {
+        return;
+    }
+    rv = apr_shm_create(&mintShm, sizeof(mint_table), NULL, pconf);
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Unable to create the shared memory for pre-minted tokens");
+        return;
+    }
+    mintTable = apr_shm_baseaddr_get(mintShm);
+    memset(mintTable, 0, sizeof(mint_table));
+}
+
+/*
+ * Guard in front of SetExpressCheckout, in shared memory. Repeated first
+ * clicks of one client on one URL (double clicks, prefetchers) share one
+ * call: the first claims a flight and makes the call, the others wait a
+ * little for its token and reuse it for CheckoutCoalesceWindow seconds. What is still
+ * left goes through token buckets per client address and per URI, which
+ * answer the excess with 429 instead of calling PayPal.
+ */
+static apr_uint32_t guardNow(void)
+{
+    return (apr_uint32_t)apr_time_as_msec(apr_time_now() - guard->base);
+}
+/*
+ * A client is its address and what its browser sends with every click:
+ * User-Agent, the Accept headers and the site's cookies. Buyers behind one
+ * NAT differ in at least one of them unless their browsers are identical
+ * and the site sets no session cookie. The headers are hashed to bound the
+ * key.
+ */
+static const char* checkoutKey(request_rec *r, ec_params* data)
+{
+    static const char* const clientHeaders[] = { "User-Agent", "Accept", "Accept-Language", "Accept-Encoding", "Cookie" };
+    apr_sha1_ctx_t ctx;
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    char client[APR_SHA1_DIGESTSIZE * 2 + 1];
+    const char* key;
+    int i;
+    if (guard == NULL || config.coalesceWindow <= 0 || data->appContext == NULL)
+    {
+        return NULL;
+    }
+    apr_sha1_init(&ctx);
+    for (i = 0; i < (int)(sizeof(clientHeaders) / sizeof(clientHeaders[0])); i++)
+    {
+        const char* value = apr_table_get(r->headers_in, clientHeaders[i]);
+        if (value != NULL)
+        {
+            apr_sha1_update(&ctx, value, strlen(value));
+        }
+        apr_sha1_update(&ctx, "\n", 1);
+    }
+    apr_sha1_final(digest, &ctx);
+    ap_bin2hex(digest, APR_SHA1_DIGESTSIZE, client);
+    key = apr_pstrcat(r->pool, r->useragent_ip, " ", client, " ", data->amount, " ", data->appContext, NULL);
+    return strlen(key) < GUARD_KEY_MAX ? key : NULL;
+}
+static const char* joinCheckout(request_rec *r, const char* key)
+{
+    int budget = config.checkoutBudget > 0 ? config.checkoutBudget : DEFAULT_CHECKOUT_BUDGET;
+    apr_time_t deadline = r->request_time + (apr_interval_time_t)budget * 1000;
+    apr_interval_time_t step = GUARD_WAIT_STEP;
+    apr_uint32_t start;
+    int waited = 0;
+    int i;
+    if (key == NULL)
+    {
+        return NULL;
+    }
+    start = mintHash(key);
+    for (i = 0; i < GUARD_FLIGHT_PROBE; i++)
+    {
+        checkout_flight* f = &guard->flights[(start + i) % GUARD_FLIGHT_SLOTS];
+        apr_uint32_t gen = apr_atomic_read32(&f->gen);
+        apr_uint32_t state = apr_atomic_read32(&f->state);
+        if (state == FLIGHT_EMPTY || (gen & 1) || strcmp(f->key, key) != 0 || apr_atomic_read32(&f->gen) != gen)
+        {
+            continue;
+        }
+        /*
+         * Same checkout: wait a short while for its call. A call slower
+         * than GUARD_MAX_WAIT is left alone and this click makes its own,
+         * so a stalled call does not hold a thread per repeated click.
+         */
+        if (deadline > apr_time_now() + GUARD_MAX_WAIT)
+        {
+            deadline = apr_time_now() + GUARD_MAX_WAIT;
+        }
+        while (state == FLIGHT_CALLING && apr_time_now() < deadline)
+        {
+            waited = 1;
+            apr_sleep(step);
+            step = step * 2 < GUARD_MAX_STEP ? step * 2 : GUARD_MAX_STEP;
+            state = apr_atomic_read32(&f->state);
+        }
+        if (state == FLIGHT_READY && (apr_int32_t)(guardNow() - apr_atomic_read32(&f->since)) < config.coalesceWindow * 1000)
+        {
+            const char* token = apr_pstrdup(r->pool, f->token);
+            if (apr_atomic_read32(&f->gen) == gen && apr_atomic_read32(&f->state) == FLIGHT_READY)
+            {
+                recordCounter(stats ? &stats->coalesced : NULL);
+                if (waited)
+                {
+                    recordCounter(stats ? &stats->coalescedWaits : NULL);
+                }
+                return token;
+            }
+        }
+        return NULL;
+    }
+    return NULL;
+}
+static checkout_flight* leadCheckout(const char* key)
+{
+    int budget = config.checkoutBudget > 0 ? config.checkoutBudget : DEFAULT_CHECKOUT_BUDGET;
+    apr_uint32_t now;
+    apr_uint32_t start;
+    int i;
+    if (key == NULL)
+    {
+        return NULL;
+    }
+    now = guardNow();
+    start = mintHash(key);
+    for (i = 0; i < GUARD_FLIGHT_PROBE; i++)
+    {
+        checkout_flight* f = &guard->flights[(start + i) % GUARD_FLIGHT_SLOTS];
+        apr_uint32_t state = apr_atomic_read32(&f->state);
+        apr_int32_t age = (apr_int32_t)(now - apr_atomic_read32(&f->since));
+        /* Free, expired, or left behind by a call that never landed */
+        if (state == FLIGHT_EMPTY
+            || (state == FLIGHT_READY && age >= config.coalesceWindow * 1000)
+            || (state == FLIGHT_CALLING && age >= budget))
+        {
+            if (apr_atomic_cas32(&f->state, FLIGHT_CALLING, state) != state)
+            {
+                continue;
+            }
+            apr_atomic_inc32(&f->gen);
+            apr_atomic_set32(&f->since, now);
+            memcpy(f->key, key, strlen(key) + 1);
+            apr_atomic_inc32(&f->gen);
+            return f;
+        }
+    }
+    return NULL;
+}
+static void landCheckout(checkout_flight* flight, const char* token)
+{
+    if (flight == NULL)
+    {
+        return;
+    }
+    if (token != NULL && strlen(token) < MINT_TOKEN_MAX)
+    {
+        memcpy(flight->token, token, strlen(token) + 1);
+        apr_atomic_set32(&flight->since, guardNow());
+        apr_atomic_set32(&flight->state, FLIGHT_READY);
+    }
+    else
+    {
+        apr_atomic_set32(&flight->state, FLIGHT_EMPTY);
+    }
+}
+/* A paid token must not be handed to the next click of the same client */
+static void forgetCheckoutToken(const char* token)
+{
+    int i;
+    if (guard == NULL || config.coalesceWindow <= 0)
+    {
+        return;
+    }
+    for (i = 0; i < GUARD_FLIGHT_SLOTS; i++)
+    {
+        checkout_flight* f = &guard->flights[i];
+        if (apr_atomic_read32(&f->state) == FLIGHT_READY && strcmp(f->token, token) == 0)
+        {
+            apr_atomic_cas32(&f->state, FLIGHT_EMPTY, FLIGHT_READY);
+        }
+    }
+}
+/*
+ * Generic cell rate form of a token bucket: tat is when the bucket would
+ * be full again, and a checkout is allowed while it is at most burst - 1
+ * intervals ahead. A bucket whose tat has passed is full, so its slot can
+ * be taken over by another key.
+ */
+static int takeRateToken(apr_uint32_t key, int perMinute, int burst, apr_uint32_t now, apr_uint32_t* waitMs)
+{
+    apr_uint32_t interval = 60000 / perMinute;
+    apr_uint32_t tolerance = interval * (burst - 1);
+    apr_uint32_t start = key % GUARD_LIMIT_SLOTS;
+    int i;
+    key |= 1;
+    for (i = 0; i < GUARD_LIMIT_PROBE; i++)
+    {
+        rate_bucket* b = &guard->buckets[(start + i) % GUARD_LIMIT_SLOTS];
+        apr_uint32_t owner = apr_atomic_read32(&b->key);
+        apr_uint32_t tat;
+        if (owner != key)
+        {
+            apr_int32_t ahead = (apr_int32_t)(apr_atomic_read32(&b->tat) - now);
+            if (owner != 0 && ahead > 0 && ahead <= GUARD_MAX_AHEAD)
+            {
+                continue;
+            }
+            if (apr_atomic_cas32(&b->key, key, owner) != owner)
+            {
+                continue;
+            }
+            apr_atomic_set32(&b->tat, now);
+        }
+        for (;;)
+        {
+            apr_uint32_t next;
+            apr_int32_t ahead;
+            tat = apr_atomic_read32(&b->tat);
+            ahead = (apr_int32_t)(tat - now);
+            /* Behind now, or so far ahead that the clock wrapped: full */
+            next = ahead > 0 && ahead <= (apr_int32_t)(tolerance + interval) ? tat : now;
+            if (next - now > tolerance)
+            {
+                *waitMs = next - now - tolerance;
+                return 0;
+            }
+            if (apr_atomic_cas32(&b->tat, next + interval, tat) == tat)
+            {
+                return 1;
+            }
+        }
+    }
+    /* Every probed bucket is busy with other keys; let the checkout through */
+    return 1;
+}
+static int limitCheckout(request_rec *r)
+{
+    apr_uint32_t now;
+    apr_uint32_t waitMs = 0;
+    if (guard == NULL)
+    {
+        return OK;
+    }
+    now = guardNow();
+    if (config.clientRate > 0
+        && !takeRateToken(mintHash(r->useragent_ip), config.clientRate, config.clientBurst, now, &waitMs))
+    {
+        recordCounter(stats ? &stats->clientLimited : NULL);
+        EC_TRACE(r, TRACE_INFO, "Checkout refused, client %s is over CheckoutRateLimit", r->useragent_ip);
+    }
+    else if (config.resourceRate > 0
+             && !takeRateToken(~mintHash(r->uri), config.resourceRate, config.resourceBurst, now, &waitMs))
+    {
+        recordCounter(stats ? &stats->resourceLimited : NULL);
+        EC_TRACE(r, TRACE_INFO, "Checkout refused, %s is over CheckoutRateLimit", r->uri);
+    }
+    else
+    {
+        return OK;
+    }
+    apr_table_setn(r->err_headers_out, "Retry-After", apr_psprintf(r->pool, "%u", waitMs / 1000 + 1));
+    return HTTP_TOO_MANY_REQUESTS;
+}
+static void createCheckoutGuard(apr_pool_t *pconf, server_rec *s)
+{
+    apr_status_t rv;
+    guard = NULL;
+    if (config.coalesceWindow <= 0 && config.clientRate <= 0 && config.resourceRate <= 0)
+    {
+        return;
+    }
+    rv = apr_shm_create(&guardShm, sizeof(checkout_guard), NULL, pconf);
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Unable to create the shared memory for checkout coalescing and rate limits");
+        return;
+    }
+    guard = apr_shm_baseaddr_get(guardShm);
+    memset(guard, 0, sizeof(checkout_guard));
+    guard->base = apr_time_now();
+}
+
+/*
+ * SetHandler paypal-ec-status shows the counters and latency histograms
+ * of all children; "?auto" gives the machine-readable form, the same way
+ * mod_status does.
+ */
+static int status_handler(request_rec *r)
+{
+    int autoFormat;
+    int i;
+    apr_uint64_t bytes;
+    apr_uint64_t cacheBytes;
+    if (r->handler == NULL || strcmp(r->handler, "paypal-ec-status") != 0)
+    {
+        return DECLINED;
+    }
+    if (r->method_number != M_GET)
+    {
+        return DECLINED;
+    }
+    if (stats == NULL)
+    {
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    autoFormat = r->args != NULL && strcasecmp(r->args, "auto") == 0;
+    ap_set_content_type(r, "text/plain; charset=ISO-8859-1");
+#if APR_VERSION_AT_LEAST(1,7,0)
+    bytes = apr_atomic_read64(&stats->bytesServed);
+    cacheBytes = apr_atomic_read64(&stats->cacheBytes);
+#else
+    bytes = (apr_uint64_t)apr_atomic_read32(&stats->kbytesServed) << 10;
+    cacheBytes = (apr_uint64_t)apr_atomic_read32(&stats->cacheKbytes) << 10;
+#endif
+
+    if (!autoFormat)
+    {
+        ap_rputs("mod_paypal_ec status\n\n", r);
+    }
+    ap_rprintf(r, "Requests: %u\n", apr_atomic_read32(&stats->requests));
+    ap_rprintf(r, "Downloads: %u\n", apr_atomic_read32(&stats->downloads));
+    ap_rprintf(r, "LedgerHits: %u\n", apr_atomic_read32(&stats->ledgerHits));
+    ap_rprintf(r, "PreMintHits: %u\n", apr_atomic_read32(&stats->preMintHits));
+    ap_rprintf(r, "CartCheckouts: %u\n", apr_atomic_read32(&stats->cartCheckouts));
+    ap_rprintf(r, "CartItems: %u\n", apr_atomic_read32(&stats->cartItems));
+    ap_rprintf(r, "AdmissionRejects: %u\n", apr_atomic_read32(&stats->admissionRejects));
+    ap_rprintf(r, "BreakerRejects: %u\n", apr_atomic_read32(&stats->breakerRejects));
+    ap_rprintf(r, "Coalesced: %u\n", apr_atomic_read32(&stats->coalesced));
+    ap_rprintf(r, "CoalescedWaits: %u\n", apr_atomic_read32(&stats->coalescedWaits));
+    ap_rprintf(r, "ClientRateLimited: %u\n", apr_atomic_read32(&stats->clientLimited));
+    ap_rprintf(r, "ResourceRateLimited: %u\n", apr_atomic_read32(&stats->resourceLimited));
+    ap_rprintf(r, "BreakerOpen: %d\n", apr_atomic_read32(&stats->breaker.openUntil) != 0);
+    ap_rprintf(r, "BytesServed: %" APR_UINT64_T_FMT "\n", bytes);
+    ap_rprintf(r, "CacheHits: %u\n", apr_atomic_read32(&stats->cacheHits));
+    ap_rprintf(r, "CacheMisses: %u\n", apr_atomic_read32(&stats->cacheMisses));
+    ap_rprintf(r, "CacheBytes: %" APR_UINT64_T_FMT "\n", cacheBytes);
+    ap_rprintf(r, "CurlInits: %u\n", apr_atomic_read32(&stats->curlInits));
+    ap_rprintf(r, "ParamTables: %u\n", apr_atomic_read32(&stats->paramTables));
+    ap_rprintf(r, "DecoderGrows: %u\n", apr_atomic_read32(&stats->decoderGrows));
+    ap_rprintf(r, "PaymentRecords: %u\n", apr_atomic_read32(&stats->paymentRecords));
+    ap_rprintf(r, "PaymentDropped: %u\n", apr_atomic_read32(&stats->paymentDropped));
+#if APR_POOL_DEBUG
+    ap_rprintf(r, "RequestPoolPeak: %u\n", apr_atomic_read32(&stats->poolPeak));
+#endif
+    for (i = 0; i < NVP_METHOD_COUNT; i++)
+    {
+        ap_rprintf(r, "%sSuccess: %u\n", nvpMethodNames[i], apr_atomic_read32(&stats->ackSuccess[i]));
+        ap_rprintf(r, "%sFailure: %u\n", nvpMethodNames[i], apr_atomic_read32(&stats->ackFailure[i]));
+        ap_rprintf(r, "%sTransportErrors: %u\n", nvpMethodNames[i], apr_atomic_read32(&stats->transportErrors[i]));
+    }
+    if (!autoFormat)
+    {
+        ap_rprintf(r, "\n%-24s %10s %10s %10s %10s %10s\n", "Latency (us)", "count", "p50", "p90", "p99", "p99.9");
+    }
+    for (i = 0; i < STAT_HISTOGRAM_COUNT; i++)
+    {
+        const ec_histogram* h = &stats->histograms[i];
+        apr_uint32_t count = apr_atomic_read32((volatile apr_uint32_t*)&h->count);
+        if (autoFormat)
+        {
+            ap_rprintf(r, "%sCount: %u\n", statNames[i], count);
+            ap_rprintf(r, "%sP50: %" APR_UINT64_T_FMT "\n", statNames[i], histogramPercentile(h, count, 0.5));
+            ap_rprintf(r, "%sP90: %" APR_UINT64_T_FMT "\n", statNames[i], histogramPercentile(h, count, 0.9));
+            ap_rprintf(r, "%sP99: %" APR_UINT64_T_FMT "\n", statNames[i], histogramPercentile(h, count, 0.99));
+            ap_rprintf(r, "%sP999: %" APR_UINT64_T_FMT "\n", statNames[i], histogramPercentile(h, count, 0.999));
+        }
+        else
+        {
+            ap_rprintf(r, "%-24s %10u %10" APR_UINT64_T_FMT " %10" APR_UINT64_T_FMT " %10" APR_UINT64_T_FMT " %10" APR_UINT64_T_FMT "\n",
+                       statNames[i], count,
+                       histogramPercentile(h, count, 0.5), histogramPercentile(h, count, 0.9),
+                       histogramPercentile(h, count, 0.99), histogramPercentile(h, count, 0.999));
+        }
+    }
+    return OK;
+}
+
+/* The counters live in anonymous shared memory inherited by every child */
+static int createStats(apr_pool_t *pconf, server_rec *s)
+{
+    apr_status_t rv = apr_shm_create(&statsShm, sizeof(ec_stats), NULL, pconf);
+    if (rv != APR_SUCCESS)
+    {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Unable to create the shared memory for the status counters");
+        stats = NULL;
+        return rv;
+    }
+    stats = apr_shm_baseaddr_get(statsShm);
+    memset(stats, 0, sizeof(ec_stats));
+    return APR_SUCCESS;
+}
+
+/*
+ * Per-directory settings. Unset fields are NULL or -1 so a section only
+ * overrides what it sets. The account is inherited as a whole here; the
+ * fields a section's account leaves unset are filled in by resolveAccounts.
+ */
+static void *create_dir_config(apr_pool_t *p, char *dir)
+{
+    ec_dir_config* conf = apr_pcalloc(p, sizeof(ec_dir_config));
+    conf->directCompletion = -1;
+    conf->deliveryMode = -1;
+    conf->pipelinedCapture = -1;
+    return conf;
+}
+static void *merge_dir_config(apr_pool_t *p, void *basev, void *addv)
+{
+    ec_dir_config* base = basev;
+    ec_dir_config* add = addv;
+    ec_dir_config* conf = apr_palloc(p, sizeof(ec_dir_config));
+    conf->pricelist = add->pricelist != NULL ? add->pricelist : base->pricelist;
+    conf->account = add->account != NULL ? add->account : base->account;
+    conf->ecWebUrl = add->ecWebUrl != NULL ? add->ecWebUrl : base->ecWebUrl;
+    conf->ecIncontextUrl = add->ecIncontextUrl != NULL ? add->ecIncontextUrl : base->ecIncontextUrl;
+    conf->ecType = add->ecType != NULL ? add->ecType : base->ecType;
+    conf->directCompletion = add->directCompletion != -1 ? add->directCompletion : base->directCompletion;
+    conf->deliveryMode = add->deliveryMode != -1 ? add->deliveryMode : base->deliveryMode;
+    conf->deliveryPath = add->deliveryMode != -1 ? add->deliveryPath : base->deliveryPath;
+    conf->deliveryBase = add->deliveryMode != -1 ? add->deliveryBase : base->deliveryBase;
+    conf->pipelinedCapture = add->pipelinedCapture != -1 ? add->pipelinedCapture : base->pipelinedCapture;
+    conf->capturePrefix = add->pipelinedCapture != -1 ? add->capturePrefix : base->capturePrefix;
+    return conf;
+}
+static void *create_server_config(apr_pool_t *p, server_rec *s)
+{
+    return apr_pcalloc(p, sizeof(ec_server_config));
+}
+static void *merge_server_config(apr_pool_t *p, void *basev, void *addv)
+{
+    ec_server_config* base = basev;
+    ec_server_config* add = addv;
+    ec_server_config* conf = apr_palloc(p, sizeof(ec_server_config));
+    conf->grantKeys = add->grantKeys != NULL ? add->grantKeys : base->grantKeys;
+    conf->grantLifetime = add->grantLifetime != 0 ? add->grantLifetime : base->grantLifetime;
+    return conf;
+}
+
+static void inheritAccount(ec_account* account, const ec_account* from)
+{
+    if (from == NULL || from == account)
+    {
+        return;
+    }
+    account->endPoint = account->endPoint != NULL ? account->endPoint : from->endPoint;
+    account->userName = account->userName != NULL ? account->userName : from->userName;
+    account->password = account->password != NULL ? account->password : from->password;
+    account->signature = account->signature != NULL ? account->signature : from->signature;
+    account->version = account->version != NULL ? account->version : from->version;
+    account->currencyCode = account->currencyCode != NULL ? account->currencyCode : from->currencyCode;
+}
+static const ec_account* serverAccount(server_rec *s)
+{
+    const ec_dir_config* conf = ap_get_module_config(s->lookup_defaults, &paypal_ec_module);
+    return conf->account;
+}
+/*
+ * Completes every account from its virtual host's account and then from
+ * the main server's, so a <Location> only has to name what differs, and
+ * compiles its request templates.
+ */
+static void resolveAccounts(apr_pool_t *pconf, server_rec *s)
+{
+    const ec_account* main = serverAccount(s);
+    int pass, i;
+    if (config.accounts == NULL)
+    {
+        return;
+    }
+    /* Virtual host accounts first, so sections inherit completed ones */
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (i = 0; i < config.accounts->nelts; i++)
+        {
+            ec_account* account = APR_ARRAY_IDX(config.accounts, i, ec_account*);
+            if (account->serverLevel != (pass == 0))
+            {
+                continue;
+            }
+            if (!account->serverLevel)
+            {
+                inheritAccount(account, serverAccount(account->server));
+            }
+            inheritAccount(account, main);
+        }
+    }
+    for (i = 0; i < config.accounts->nelts; i++)
+    {
+        compileNvpTemplates(APR_ARRAY_IDX(config.accounts, i, ec_account*), pconf);
+    }
+}
+
+static int pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    /* Settings of the previous generation must not leak into a restart */
+    memset(&config, 0, sizeof(config));
+    config.transport = &curlTransport;
+    ap_mutex_register(pconf, LEDGER_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+    ap_mutex_register(pconf, CACHE_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+    ap_mutex_register(pconf, PAYMENT_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+    return OK;
+}
+static int post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+{
+    resolveAccounts(pconf, s);
+    createStats(pconf, s);
+    createMintTable(pconf, s);
+    createCheckoutGuard(pconf, s);
+    if (createFileCache(pconf, s) != OK || createPaymentLedger(pconf, s) != OK || openRecordFile(pconf, s) != OK)
+    {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    return createLedger(pconf, s);
 }
 
 static void register_hooks(apr_pool_t *p)
 {
     ap_hook_check_user_id(authenticate_user,NULL,NULL,APR_HOOK_MIDDLE);
+    ap_hook_pre_config(pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(redirect_handler, NULL, NULL, APR_HOOK_FIRST);
+    ap_hook_log_transaction(log_delivery, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_log_transaction(log_trace, NULL, NULL, APR_HOOK_MIDDLE);
+#if APR_POOL_DEBUG
+    ap_hook_log_transaction(log_footprint, NULL, NULL, APR_HOOK_MIDDLE);
+#endif
 }
 
 module AP_MODULE_DECLARE_DATA   paypal_ec_module =
 {
     STANDARD20_MODULE_STUFF,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
+    create_dir_config,
+    merge_dir_config,
+    create_server_config,
+    merge_server_config,
     ec_directives,
     register_hooks
 };
@@ -18,7 +18,97 @@
 #ifndef _MOD_PAYPAL_EC_H_
 #define _MOD_PAYPAL_EC_H_
 
+#include "pricelist_image.h"
+
 #define BUFSIZE 1024
+#define DEFAULT_POOL_IDLE_TIMEOUT 60
+#define NVP_DECODER_CHUNK 64
+#define NVP_MAX_RESPONSE 65536
+
+#define DEFAULT_PRICELIST_CHECK_INTERVAL 5
+#define DEFAULT_GRANT_LIFETIME 86400
+#define GRANT_COOKIE_NAME "PayPalECGrant"
+#define GRANT_KEY_ID_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+#define GRANT_BLOCK_SIZE 64
+#define GRANT_MAC_LEN 27
+#define DEFAULT_LEDGER_TIMEOUT 10800
+#define LEDGER_MUTEX_TYPE "paypal-ec-ledger"
+#define EC_ALREADY_PROCESSED 4
+#define EC_UNAVAILABLE 5
+
+#define DEFAULT_CONNECT_TIMEOUT 3000
+#define DEFAULT_CALL_TIMEOUT 10000
+#define DEFAULT_CHECKOUT_BUDGET 20000
+#define DEFAULT_BREAKER_THRESHOLD 5
+#define DEFAULT_BREAKER_COOLDOWN 30
+
+#define MINT_SLOTS 64
+#define MINT_PROBE 8
+#define MINT_MAX_DEPTH 8
+#define MINT_URL_MAX 512
+#define MINT_NAME_MAX 128
+#define MINT_AMOUNT_MAX 16
+#define MINT_TOKEN_MAX 32
+#define MINT_INTERVAL 1
+#define MINT_LEASE 5
+#define MINT_DECAY_ROUNDS 60
+#define MINT_MIN_SCORE 3
+#define MINT_EMPTY 0
+#define MINT_BUSY 1
+#define MINT_READY 2
+#define DEFAULT_PREMINT_HOT_ITEMS 8
+#define DEFAULT_PREMINT_LIFETIME 1800
+
+#define GUARD_FLIGHT_SLOTS 256
+#define GUARD_FLIGHT_PROBE 8
+#define GUARD_KEY_MAX 600
+#define GUARD_LIMIT_SLOTS 4096
+#define GUARD_LIMIT_PROBE 8
+#define GUARD_WAIT_STEP 1000
+#define GUARD_MAX_STEP 50000
+/* Longest a repeated click waits for the call of the first one */
+#define GUARD_MAX_WAIT 2000000
+/* Furthest a bucket can run ahead: 1 per minute with a burst of 1000 */
+#define GUARD_MAX_AHEAD (60000 * 1000)
+#define FLIGHT_EMPTY 0
+#define FLIGHT_CALLING 1
+#define FLIGHT_READY 2
+#define DEFAULT_RATE_BURST 5
+
+#define CART_PARAM "items"
+#define CART_MAX_ITEMS 50
+
+#define DELIVERY_MODULE 0
+#define DELIVERY_HANDLER 1
+#define DELIVERY_REDIRECT 2
+#define DELIVERY_NOTE "paypal-ec-paid"
+#define CAPTURE_MAX_PREFIX_KB 1024
+
+#define CACHE_MUTEX_TYPE "paypal-ec-cache"
+#define CACHE_ENTRIES 512
+#define CACHE_BUCKETS 1024
+#define CACHE_NONE (-1)
+#define CACHE_PATH_MAX 512
+#define CACHE_ALIGN 4096
+#define CACHE_EMPTY 0
+#define CACHE_FILLING 1
+#define CACHE_READY 2
+#define CACHE_STALE 3
+#define DEFAULT_CACHE_FILE_MB 8
+
+#define PAYMENT_MUTEX_TYPE "paypal-ec-payments"
+#define PAYMENT_RING_SIZE 1024
+#define PAYMENT_FLUSH_INTERVAL 200
+#define PAYMENT_FIELD_MAX 40
+#define PAYMENT_NAME_MAX 256
+#define DEFAULT_PAYMENT_ROTATE_MB 64
+
+/* curl_multi_poll and curl_multi_wakeup arrived in libcurl 7.68.0 */
+#if APR_HAS_THREADS && LIBCURL_VERSION_NUM >= 0x074400
+#define NVP_ENGINE_SUPPORTED 1
+#else
+#define NVP_ENGINE_SUPPORTED 0
+#endif
 
 #define AP_LOG_POOL_ERR(...) \
 	ap_log_perror(APLOG_MARK, APLOG_ERR, __VA_ARGS__);	
@@ -26,43 +116,696 @@
 #define AP_LOG_REQUEST_ERR(...) \
 	ap_log_rerror(APLOG_MARK, APLOG_ERR, __VA_ARGS__); 
 
+#define TRACE_OFF 0
+#define TRACE_ERROR 1
+#define TRACE_INFO 2
+#define TRACE_DEBUG 3
+#define TRACE_MAX_EVENTS 32
+
+/* Records a step in the trace of a sampled request; costs a test otherwise */
+#define EC_TRACE(r, level, ...) \
+	do { if (traceEnabled((r), (level))) traceEvent((r), (level), __VA_ARGS__); } while (0)
+
+/* Genuine errors are logged right away and also kept in the trace */
+#define EC_ERROR(r, ...) \
+	do { ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, (r), __VA_ARGS__); EC_TRACE((r), TRACE_ERROR, __VA_ARGS__); } while (0)
+
+/*
+ * Immutable price list; replaced as a whole when the file changes. A text
+ * file is parsed into items, a compiled one is mapped as catalog.
+ */
+typedef struct pricelist_snapshot {
+   apr_pool_t* pool;
+   apr_hash_t* items;
+   const catalog_header* catalog;
+   apr_size_t catalogSize;
+   apr_finfo_t finfo;
+   volatile apr_uint32_t refs;
+   apr_time_t retired;
+   struct pricelist_snapshot* nextRetired;
+}pricelist_snapshot;
+
 typedef struct {
    const char* path;
+   volatile void* current;
+   pricelist_snapshot* retired;
+   apr_finfo_t failed;
+}pricelist;
+
+#define NVP_SET 0
+#define NVP_GET 1
+#define NVP_DO 2
+#define NVP_METHOD_COUNT 3
+
+/* Precompiled, already encoded static part of an NVP request body */
+typedef struct {
+    const char* prefix;
+    apr_size_t len;
+}nvp_template;
+
+/* API endpoint, credentials and currency of a server or section */
+typedef struct {
+   int index;
+   server_rec* server;
+   int serverLevel;
    const char* endPoint;
    const char* userName;
    const char* password;
    const char* signature;
    const char* version;
+   const char* currencyCode;
+   nvp_template templates[NVP_METHOD_COUNT];
+}ec_account;
+
+/* Settings that may differ per virtual host, <Location> or <Directory> */
+typedef struct {
+   pricelist* pricelist;
+   ec_account* account;
    const char* ecWebUrl;
    const char* ecIncontextUrl;
    const char* ecType;
-   const char* appContext;
-   const char* currency_code;
-   apr_hash_t *book_data;
-   int loaded;
+   int directCompletion;
+   int deliveryMode;
+   const char *deliveryPath;
+   const char *deliveryBase;
+   int pipelinedCapture;
+   int capturePrefix;
+}ec_dir_config;
+
+typedef struct {
+   apr_array_header_t *grantKeys;
+   int grantLifetime;
+}ec_server_config;
+
+/* Process-wide settings: they size or drive resources shared by the child */
+typedef struct {
+   apr_array_header_t *pricelists;
+   apr_array_header_t *accounts;
+   int pricelistCheckInterval;
+   int poolSize;
+   int poolIdleTimeout;
+   int asyncEngine;
+   int traceLevel;
+   int traceSampleRate;
+   const ap_socache_provider_t *ledgerProvider;
+   ap_socache_instance_t *ledger;
+   int ledgerTimeout;
+   int connectTimeout;
+   int callTimeout;
+   int checkoutBudget;
+   int maxInFlight;
+   int breakerThreshold;
+   int breakerCooldown;
+   int preMintTokens;
+   int preMintHotItems;
+   int preMintLifetime;
+   const struct nvp_transport* transport;
+   int fakeLatency;
+   int fakeJitter;
+   const char* transportFile;
+   apr_file_t* recordFile;
+   struct nvp_replay* replay;
+   int coalesceWindow;
+   int clientRate;
+   int clientBurst;
+   int resourceRate;
+   int resourceBurst;
+   int cacheSize;
+   int cacheFileLimit;
+   const char* paymentLedger;
+   int paymentRotate;
 }app_config;
 
+/* Signing key for download grants with its HMAC pads already absorbed */
+typedef struct {
+   const char* id;
+   apr_sha1_ctx_t inner;
+   apr_sha1_ctx_t outer;
+}grant_key;
+
 static app_config config;
 
+#define EC_PARAM_REQUEST 0
+#define EC_PARAM_RESPONSE 1
+
+/* One priced line of a cart checkout and the grant it earned */
+typedef struct {
+    const char* name;
+    const char* amount;
+    const char* grant;
+}cart_item;
+
+/*
+ * Parameters of one checkout request: the known request and NVP response
+ * keys in fixed slots, any other key in the lazily created table. dir and
+ * account are the request's configuration, set once in ec_handler. A cart
+ * checkout sets items; name and amount then hold the list and the total.
+ */
+typedef struct {
+    const char* name;
+    const char* amount;
+    const char* token;
+    const char* payerId;
+    const char* status;
+    const char* grant;
+    const char* ack;
+    const char* respToken;
+    const char* checkoutStatus;
+    const char* transactionId;
+    const char* errorCode;
+    const char* grantIssued;
+    const char* appContext;
+    const ec_dir_config* dir;
+    const ec_account* account;
+    cart_item* items;
+    int itemCount;
+    apr_table_t* other;
+}ec_params;
+
+static const char* const nvpMethodNames[NVP_METHOD_COUNT] = { "SetExpressCheckout", "GetExpressCheckout", "DoExpressCheckout" };
+
+#define STAT_SET 0
+#define STAT_GET 1
+#define STAT_DO 2
+#define STAT_SEND 3
+#define STAT_CURL_NAMELOOKUP 4
+#define STAT_CURL_CONNECT 5
+#define STAT_CURL_APPCONNECT 6
+#define STAT_CURL_STARTTRANSFER 7
+#define STAT_PAYMENT_ENQUEUE 8
+#define STAT_PAYMENT_FLUSH 9
+#define STAT_HISTOGRAM_COUNT 10
+#define STAT_BUCKETS 240
+
+static const char* const statNames[STAT_HISTOGRAM_COUNT] = {
+    "SetExpressCheckout", "GetExpressCheckout", "DoExpressCheckout", "SendFile",
+    "CurlNameLookup", "CurlConnect", "CurlAppConnect", "CurlStartTransfer",
+    "PaymentEnqueue", "PaymentFlush"
+};
+
+typedef struct {
+    volatile apr_uint32_t count;
+    volatile apr_uint32_t buckets[STAT_BUCKETS];
+}ec_histogram;
+
+/* Circuit breaker state; times are in seconds since the epoch, 0 when unset */
+typedef struct {
+    volatile apr_uint32_t failures;
+    volatile apr_uint32_t openUntil;
+    volatile apr_uint32_t probeStarted;
+}ec_breaker;
+
+/* Counters shared by all children, updated with atomic operations only */
+typedef struct {
+    volatile apr_uint32_t requests;
+    volatile apr_uint32_t downloads;
+    volatile apr_uint32_t ledgerHits;
+    volatile apr_uint32_t preMintHits;
+    volatile apr_uint32_t cartCheckouts;
+    volatile apr_uint32_t cartItems;
+    volatile apr_uint32_t admissionRejects;
+    volatile apr_uint32_t breakerRejects;
+    volatile apr_uint32_t coalesced;
+    volatile apr_uint32_t coalescedWaits;
+    volatile apr_uint32_t clientLimited;
+    volatile apr_uint32_t resourceLimited;
+    volatile apr_uint32_t cacheHits;
+    volatile apr_uint32_t cacheMisses;
+    volatile apr_uint32_t curlInits;
+    volatile apr_uint32_t paramTables;
+    volatile apr_uint32_t decoderGrows;
+    volatile apr_uint32_t poolPeak;
+    volatile apr_uint32_t paymentRecords;
+    volatile apr_uint32_t paymentDropped;
+    volatile apr_uint32_t ackSuccess[NVP_METHOD_COUNT];
+    volatile apr_uint32_t ackFailure[NVP_METHOD_COUNT];
+    volatile apr_uint32_t transportErrors[NVP_METHOD_COUNT];
+#if APR_VERSION_AT_LEAST(1,7,0)
+    volatile apr_uint64_t bytesServed;
+    volatile apr_uint64_t cacheBytes;
+#else
+    volatile apr_uint32_t kbytesServed;
+    volatile apr_uint32_t cacheKbytes;
+#endif
+    ec_histogram histograms[STAT_HISTOGRAM_COUNT];
+    ec_breaker breaker;
+}ec_stats;
+
+static apr_shm_t* statsShm;
+static ec_stats* stats;
+
+typedef struct {
+    apr_interval_time_t offset;
+    int level;
+    const char* message;
+}ec_trace_event;
+
+/* Trace of one sampled request, kept in its request_config */
+typedef struct {
+    apr_time_t start;
+    int count;
+    ec_trace_event events[TRACE_MAX_EVENTS];
+}ec_trace;
+
+static volatile apr_uint32_t traceCounter;
+
+/* Only set when the ledger's socache provider is not safe across processes */
+static apr_global_mutex_t* ledgerMutex;
+
+module AP_MODULE_DECLARE_DATA paypal_ec_module;
+
+static const nvp_template emptyTemplate = { "", 0 };
+
+/* State of the incremental NVP response decoder between curl chunks */
 typedef struct {
     apr_pool_t* pool;
-    char *ptr;
-}string;
+    ec_params* data;
+    char* buf;
+    apr_size_t len;
+    apr_size_t cap;
+    const char* key;
+    apr_size_t klen;
+    int inValue;
+    int escape;
+    char pending;
+    apr_size_t total;
+    char* raw;
+    apr_size_t rawLen;
+    apr_size_t rawCap;
+}nvp_decoder;
+
+/* Per-child libcurl state shared by every NVP call of the process */
+typedef struct {
+    CURLSH* share;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t* locks[CURL_LOCK_DATA_LAST];
+    apr_reslist_t* handles;
+#else
+    CURL* handle;
+#endif
+    int idleTimeout;
+    int size;
+    volatile apr_uint32_t inFlight;
+    apr_uint32_t maxInFlight;
+}curl_pool;
+
+static curl_pool curlPool;
+
+/* One outstanding NVP transfer, allocated from the pool of its request */
+typedef struct nvp_call {
+    CURL* curl;
+    nvp_decoder decoder;
+    int method;
+    const char* body;
+    apr_size_t len;
+    const char* fields;
+    apr_time_t started;
+    long httpCode;
+    const char* error;
+    CURLcode result;
+    int done;
+    int synchronous;
+#if APR_HAS_THREADS
+    apr_thread_cond_t* cond;
+#endif
+    struct nvp_call* next;
+    struct nvp_call* prev;
+}nvp_call;
+
+/* Per-child I/O thread multiplexing NVP transfers on one curl_multi handle */
+typedef struct {
+#if NVP_ENGINE_SUPPORTED
+    CURLM* multi;
+    apr_thread_t* thread;
+    apr_thread_mutex_t* lock;
+#endif
+    nvp_call* pending;
+    nvp_call* active;
+    int stop;
+}nvp_engine;
+
+static nvp_engine nvpEngine;
+
+/*
+ * A cached file, or its first bytes, in the shared arena. Only touched
+ * under cacheMutex; refs counts the requests sending from it, and an entry
+ * is only evicted or refilled at 0. Entries are linked by index, as the
+ * segment is mapped at another address in each child: in a hash bucket
+ * (or the free list), in recency order and in arena order.
+ */
+typedef struct {
+    int state;
+    apr_uint32_t hash;
+    apr_uint32_t refs;
+    int hashNext;
+    int lruPrev;
+    int lruNext;
+    int arenaPrev;
+    int arenaNext;
+    apr_off_t fileSize;
+    apr_time_t mtime;
+    apr_size_t offset;
+    apr_size_t length;
+    apr_size_t capacity;
+    char path[CACHE_PATH_MAX];
+}cache_entry;
+
+typedef struct {
+    apr_size_t arenaSize;
+    int freeHead;
+    int lruHead;
+    int lruTail;
+    int arenaHead;
+    int buckets[CACHE_BUCKETS];
+    cache_entry entries[CACHE_ENTRIES];
+}file_cache;
+
+static apr_shm_t* cacheShm;
+static file_cache* fileCache;
+static char* cacheArena;
+static apr_global_mutex_t* cacheMutex;
+
+/*
+ * A completed payment waiting in the ring for the ledger writer. seq hands
+ * the slot over: it equals the position a producer may claim, and
+ * position + 1 once the record is written and the writer may take it.
+ */
+typedef struct {
+    volatile apr_uint32_t seq;
+    apr_time_t paidAt;
+    apr_interval_time_t checkoutTime;
+    apr_interval_time_t captureTime;
+    char transactionId[PAYMENT_FIELD_MAX];
+    char token[PAYMENT_FIELD_MAX];
+    char payerId[PAYMENT_FIELD_MAX];
+    char amount[PAYMENT_FIELD_MAX];
+    char currency[8];
+    char name[PAYMENT_NAME_MAX];
+}payment_record;
+
+/* Per-child ring of payment records and the thread that writes them out */
+typedef struct {
+    volatile apr_uint32_t tail;
+    volatile apr_uint32_t head;
+    payment_record* ring;
+    apr_pool_t* filePool;
+    apr_file_t* file;
+#if APR_HAS_THREADS
+    apr_pool_t* pool;
+    apr_thread_t* thread;
+    apr_thread_mutex_t* lock;
+    apr_thread_cond_t* cond;
+#endif
+    int stop;
+}payment_writer;
+
+static payment_writer paymentWriter;
+static apr_global_mutex_t* paymentMutex;
+
+/* A paid file opened and read ahead while its capture is in flight */
+typedef struct {
+    int status;
+    apr_file_t* fd;
+    char* prefix;
+    apr_size_t prefixLen;
+    cache_entry* cached;
+    apr_time_t start;
+}prepared_file;
+
+/*
+ * How an NVP call reaches the endpoint. start may complete the call at
+ * once; finish waits for it, leaves the response in the call's decoder and
+ * returns nonzero on a transport failure, described by the call's error.
+ */
+typedef struct nvp_transport {
+    const char* name;
+    int network;
+    int (*start)(nvp_call* call, const char* endPoint, long timeoutMs);
+    int (*finish)(nvp_call* call);
+}nvp_transport;
+
+/* One recorded call as written by ApiTransport record */
+typedef struct {
+    int method;
+    apr_interval_time_t latency;
+    const char* response;
+}nvp_exchange;
+
+/* Recorded calls for ApiTransport replay, by request and by method */
+typedef struct nvp_replay {
+    apr_hash_t* byRequest;
+    apr_array_header_t* byMethod[NVP_METHOD_COUNT];
+    volatile apr_uint32_t next[NVP_METHOD_COUNT];
+}nvp_replay;
+
+static volatile apr_uint32_t fakeCounter;
+
+/* Per-child thread that reloads the Pricelist when the file changes */
+typedef struct {
+#if APR_HAS_THREADS
+    apr_pool_t* pool;
+    apr_thread_t* thread;
+    apr_thread_mutex_t* lock;
+    apr_thread_cond_t* cond;
+#endif
+    int stop;
+}pricelist_watcher;
+
+static pricelist_watcher pricelistWatcher;
+
+typedef struct {
+    volatile apr_uint32_t state;
+    apr_uint32_t mintedAt;
+    char token[MINT_TOKEN_MAX];
+}minted_token;
+
+/* One tracked URL; hits is bumped by requests, score only by the minter */
+typedef struct {
+    volatile apr_uint32_t state;
+    volatile apr_uint32_t gen;
+    volatile apr_uint32_t hits;
+    apr_uint32_t score;
+    int account;
+    volatile int stale;
+    char url[MINT_URL_MAX];
+    char name[MINT_NAME_MAX];
+    char amount[MINT_AMOUNT_MAX];
+    minted_token tokens[MINT_MAX_DEPTH];
+}mint_item;
+
+typedef struct {
+    volatile apr_uint32_t leaseUntil;
+    volatile apr_uint32_t leaseOwner;
+    mint_item items[MINT_SLOTS];
+}mint_table;
+
+static apr_shm_t* mintShm;
+static mint_table* mintTable;
+
+typedef struct {
+#if APR_HAS_THREADS
+    apr_pool_t* pool;
+    apr_thread_t* thread;
+    apr_thread_mutex_t* lock;
+    apr_thread_cond_t* cond;
+#endif
+    int stop;
+}token_minter;
+
+static token_minter tokenMinter;
+
+/*
+ * One first-leg checkout of a client for a URL: CALLING while its
+ * SetExpressCheckout is in flight, READY with the token for the coalescing
+ * window. gen is odd while the key is being written.
+ */
+typedef struct {
+    volatile apr_uint32_t state;
+    volatile apr_uint32_t gen;
+    volatile apr_uint32_t since;
+    char key[GUARD_KEY_MAX];
+    char token[MINT_TOKEN_MAX];
+}checkout_flight;
+
+/* Token bucket kept as its theoretical arrival time; key is 0 when free */
+typedef struct {
+    volatile apr_uint32_t key;
+    volatile apr_uint32_t tat;
+}rate_bucket;
+
+/* Times are milliseconds since base, so they fit 32 bit atomics */
+typedef struct {
+    apr_time_t base;
+    checkout_flight flights[GUARD_FLIGHT_SLOTS];
+    rate_bucket buckets[GUARD_LIMIT_SLOTS];
+}checkout_guard;
+
+static apr_shm_t* guardShm;
+static checkout_guard* guard;
 
 static int ec_handler(request_rec *r);
 static void register_hooks(apr_pool_t *p);
-static void parseInput(char* token, apr_table_t* data,apr_pool_t* pool);
-static int validate(request_rec *r, apr_table_t* data);
-static char* substring(const char* str, size_t begin, size_t len);
+static void parseRequestUri(const char* uri, ec_params* data, apr_pool_t* pool);
+static void decodeNvpChunk(nvp_decoder* d, const char* chunk, apr_size_t len);
+static void finishNvpDecoder(nvp_decoder* d);
+static void parsePairs(char* buf, char* end, ec_params* data, int source, apr_pool_t* pool);
+static void setParam(ec_params* data, const char* key, apr_size_t klen, const char* value, int source, apr_pool_t* pool);
+static const char* getParam(const ec_params* data, const char* key);
+static apr_size_t unescapeInPlace(char* start, const char* end, int plusIsSpace);
+static int validate(request_rec *r, ec_params* data);
 static int sendResponse(request_rec *r, const char* str);
-static int setExpressCheckout(request_rec *r, apr_table_t* data);
-static int doExpressCheckout(request_rec *r, apr_table_t* data);
-static int getExpressCheckout(request_rec *r, apr_table_t* data);
-static void redirectToPayPal(request_rec *r, apr_table_t* data);
-static int sendFile(request_rec *r, apr_table_t *data);
+static int setExpressCheckout(request_rec *r, ec_params* data);
+static int doExpressCheckout(request_rec *r, ec_params* data);
+static int getExpressCheckout(request_rec *r, ec_params* data);
+static void redirectToPayPal(request_rec *r, ec_params* data);
+static char* buildNvpRequest(apr_pool_t* pool, const nvp_template* tmpl, const char* const* names, const char* const* values, int n, apr_size_t* len);
+static void compileNvpTemplates(ec_account* account, apr_pool_t* pool);
+static char* populateSetExpressCheckoutRequest(apr_size_t* len, ec_params* data, apr_pool_t* pool);
+static char* populateDoExpressCheckoutRequest(apr_size_t* len, ec_params* data, apr_pool_t* pool);
+static char* populateGetExpressCheckoutRequest(apr_size_t* len, ec_params* data, apr_pool_t* pool);
+static int callNvpApi(request_rec *r, int method, const char* body, apr_size_t len, ec_params* data);
+static int admitNvpCall(request_rec *r, int method, long* timeoutMs);
+static void releaseNvpSlot(void);
+static nvp_call* startNvpCall(request_rec *r, apr_pool_t* pool, int method, const char* body, apr_size_t len, ec_params* data, int* status);
+static int finishNvpCall(request_rec *r, nvp_call* call);
+static void clearNvpResponse(ec_params* data);
+static nvp_call* createNvpCall(apr_pool_t* pool, int method, const char* body, apr_size_t len, ec_params* data);
+static int curlStart(nvp_call* call, const char* endPoint, long timeoutMs);
+static int curlFinish(nvp_call* call);
+static int recordStart(nvp_call* call, const char* endPoint, long timeoutMs);
+static int isPrivateNvpKey(const char* key, apr_size_t len);
+static char* redactNvpResponse(apr_pool_t* pool, const char* raw, apr_size_t len, apr_size_t* outLen);
+static int recordFinish(nvp_call* call);
+static int fakeStart(nvp_call* call, const char* endPoint, long timeoutMs);
+static int fakeFinish(nvp_call* call);
+static int replayFinish(nvp_call* call);
+static void waitLatency(nvp_call* call, apr_interval_time_t latency);
+static void feedNvpResponse(nvp_call* call, const char* response);
+static const char* loadReplay(apr_pool_t* pool, const char* path);
+static int openRecordFile(apr_pool_t *pconf, server_rec *s);
+
+static const nvp_transport curlTransport = { "curl", 1, curlStart, curlFinish };
+static const nvp_transport recordTransport = { "record", 1, recordStart, recordFinish };
+static const nvp_transport fakeTransport = { "fake", 0, fakeStart, fakeFinish };
+static const nvp_transport replayTransport = { "replay", 0, fakeStart, replayFinish };
+static apr_status_t submitNvpCall(nvp_call* call, apr_pool_t* pool);
+static void waitNvpCall(nvp_call* call);
+#if NVP_ENGINE_SUPPORTED
+static void completeNvpCall(nvp_call* call, CURLcode result);
+static void startNvpEngine(apr_pool_t *p, server_rec *s);
+#endif
+static CURL* createCurlHandle(void);
+static CURL* acquireCurlHandle(void);
+static void releaseCurlHandle(CURL *curl, int failed);
+static void warmCurlPool(server_rec *s, const char* endPoint);
+static void recordLatency(int which, apr_interval_time_t us);
+static void recordCounter(volatile apr_uint32_t* counter);
+static void recordBytes(apr_size_t bytes);
+static void recordCacheBytes(apr_size_t bytes);
+static void recordAck(int method, const char* ack);
+static apr_interval_time_t curlElapsed(CURL* curl, int phase);
+static void recordCurlTimings(CURL* curl);
+static void startTrace(request_rec *r);
+static int traceEnabled(request_rec *r, int level);
+static void traceEvent(request_rec *r, int level, const char* fmt, ...);
+static int log_trace(request_rec *r);
+#if APR_POOL_DEBUG
+static int log_footprint(request_rec *r);
+#endif
+static apr_uint32_t breakerAllows(void);
+static void breakerRecord(server_rec *s, int failed);
+static int isTokenConsumed(request_rec *r, const char* token);
+static void recordConsumedToken(request_rec *r, const char* token, const char* transactionId);
+static apr_status_t destroyLedger(void *data);
+static int createLedger(apr_pool_t *pconf, server_rec *s);
+static apr_uint32_t mintHash(const char* key);
+static mint_item* findMintItem(ec_params* data);
+static const char* takeMintedToken(request_rec *r, ec_params* data);
+static int holdMintLease(void);
+static int drainMintItem(mint_item* item, apr_uint32_t olderThan);
+static const char* mintToken(mint_item* item, apr_pool_t* scratch, server_rec* s);
+static void mintRound(apr_pool_t* scratch, server_rec* s, apr_uint32_t round);
+#if APR_HAS_THREADS
+static void startTokenMinter(apr_pool_t *p, server_rec *s);
+#endif
+static void createMintTable(apr_pool_t *pconf, server_rec *s);
+static apr_uint32_t guardNow(void);
+static const char* checkoutKey(request_rec *r, ec_params* data);
+static const char* joinCheckout(request_rec *r, const char* key);
+static checkout_flight* leadCheckout(const char* key);
+static void landCheckout(checkout_flight* flight, const char* token);
+static void forgetCheckoutToken(const char* token);
+static int takeRateToken(apr_uint32_t key, int perMinute, int burst, apr_uint32_t now, apr_uint32_t* waitMs);
+static int limitCheckout(request_rec *r);
+static void createCheckoutGuard(apr_pool_t *pconf, server_rec *s);
+static int status_handler(request_rec *r);
+static void *create_dir_config(apr_pool_t *p, char *dir);
+static void *merge_dir_config(apr_pool_t *p, void *basev, void *addv);
+static void *create_server_config(apr_pool_t *p, server_rec *s);
+static void *merge_server_config(apr_pool_t *p, void *basev, void *addv);
+static void inheritAccount(ec_account* account, const ec_account* from);
+static const ec_account* serverAccount(server_rec *s);
+static void resolveAccounts(apr_pool_t *pconf, server_rec *s);
+static int pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp);
+static int post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s);
+static void child_init(apr_pool_t *p, server_rec *s);
+static int deliverFile(request_rec *r, ec_params *data);
+static int priceCart(request_rec *r, ec_params *data, const pricelist_snapshot* prices, const char* list);
+static const char* formatCents(apr_pool_t* pool, apr_int64_t cents);
+static int sendCartPage(request_rec *r, ec_params* data);
+static char* buildCartRequest(apr_size_t* len, ec_params* data, int method, const char* const* names, const char* const* values, apr_pool_t* pool);
+static const char* deliveryTarget(request_rec *r, const ec_dir_config* dir, const char* name);
+static int redirect_handler(request_rec *r);
+static int log_delivery(request_rec *r);
+static int sendFile(request_rec *r, ec_params *data);
+static void prepareFile(request_rec *r, prepared_file* file, apr_size_t prefix);
+static int sendPreparedFile(request_rec *r, prepared_file* file);
+static cache_entry* lookupCachedFile(request_rec *r);
+static cache_entry* findCachedEntry(const char* path, apr_uint32_t hash, int state);
+static void touchCachedEntry(cache_entry* e);
+static void dropCachedEntry(cache_entry* e);
+static apr_size_t findCacheSpace(apr_size_t capacity, int* after);
+static apr_off_t cachedBytesSent(request_rec *r, apr_size_t cached);
+static cache_entry* reserveCachedFile(request_rec *r, apr_size_t length);
+static void fillCachedFile(request_rec *r, prepared_file* file);
+static apr_status_t releaseCachedFile(void *data);
+static int createFileCache(apr_pool_t *pconf, server_rec *s);
+static void recordPayment(request_rec *r, ec_params* data, apr_interval_time_t captureTime);
+static void cleanPaymentField(char* field);
+static apr_size_t formatPayment(char* buf, apr_size_t size, payment_record* rec);
+static void openPaymentLedger(server_rec* s);
+static void flushPayments(apr_pool_t* scratch, server_rec* s);
+#if APR_HAS_THREADS
+static void startPaymentWriter(apr_pool_t *p, server_rec *s);
+#endif
+static void initPaymentWriter(apr_pool_t *p, server_rec *s);
+static int createPaymentLedger(apr_pool_t *pconf, server_rec *s);
+static int pipelinedCapture(request_rec *r, ec_params* data, prepared_file* file);
+static int checkDoResponse(request_rec *r, ec_params* data);
+static const char *coalesce_window_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *rate_limit_handler(cmd_parms *cmd, void *cfg, const char *scope, const char *rate, const char *burst);
+static const char *download_cache_handler(cmd_parms *cmd, void *cfg, const char *size, const char *fileLimit);
+static const char *payment_ledger_handler(cmd_parms *cmd, void *cfg, const char *path, const char *rotate);
+static const char *pipelined_capture_handler(cmd_parms *cmd, void *cfg, const char *flag, const char *prefix);
+static void signGrant(const grant_key* key, const char* payload, const char* uri, const char* amt, char* mac);
+static void issueGrant(request_rec *r, ec_params* data);
+static int verifyGrant(request_rec *r, ec_params* data);
 static int authenticate_user(request_rec *r);
-static void loadConfigFile(apr_pool_t *p, apr_hash_t *data);
+static const char* loadConfigFile(apr_pool_t *pool, const char* path, apr_hash_t *data, server_rec* s);
+static int isValidAmount(const char* value);
+static const char* mapCatalog(apr_pool_t *pool, apr_file_t *fd, pricelist_snapshot* snap);
+static const char* loadPricelist(apr_pool_t *pool, const char* path, pricelist_snapshot* snap, server_rec* s);
+static const char* lookupPrice(const pricelist_snapshot* snap, const char* name);
+static unsigned int pricelistCount(const pricelist_snapshot* snap);
+static pricelist_snapshot* acquirePricelist(request_rec *r, pricelist* list);
+#if APR_HAS_THREADS
+static void reloadPricelist(pricelist* list, apr_pool_t* pool, apr_pool_t* scratch, server_rec* s);
+static void reclaimPricelists(pricelist* list, apr_interval_time_t grace);
+static void startPricelistWatcher(apr_pool_t *p, server_rec *s);
+#endif
 static const char *app_config_path_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *pricelist_interval_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static ec_account* dirAccount(cmd_parms *cmd, ec_dir_config* conf);
 static const char *api_endpoint_handler(cmd_parms *cmd, void *cfg, const char *arg);
 static const char *api_username_handler(cmd_parms *cmd, void *cfg, const char *arg);
 static const char *api_password_handler(cmd_parms *cmd, void *cfg, const char *arg);
@@ -72,6 +815,22 @@ static const char *api_currency_code(cmd_parms *cmd, void *cfg, const char *arg)
 static const char *web_url_handler(cmd_parms *cmd, void *cfg, const char *arg);
 static const char *incontext_url_handler(cmd_parms *cmd, void *cfg, const char *arg);
 static const char *ec_type_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *api_pool_size_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *api_pool_idle_timeout_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *api_limit_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *api_async_engine_handler(cmd_parms *cmd, void *cfg, int flag);
+static const char *trace_level_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *trace_sample_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *grant_key_handler(cmd_parms *cmd, void *cfg, const char *id, const char *secret);
+static const char *grant_lifetime_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *ledger_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *ledger_timeout_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *delivery_handler(cmd_parms *cmd, void *cfg, const char *mode, const char *path);
+static const char *premint_tokens_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *premint_items_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *premint_lifetime_handler(cmd_parms *cmd, void *cfg, const char *arg);
+static const char *api_transport_handler(cmd_parms *cmd, void *cfg, const char *mode, const char *arg1, const char *arg2);
+static const char *direct_completion_handler(cmd_parms *cmd, void *cfg, int flag);
 
 #endif
 
@@ -0,0 +1,110 @@
+/*
+ * mod_paypal_ec - Apache Module to secure URIs using PayPal Express Checkout
+ * Copyright 2013 PayPal, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Form encoding of NVP request bodies, kept apart so that nvp_build_bench
+ * can time the same code. The includer provides nvp_template.
+ */
+
+#ifndef _NVP_BUILD_H_
+#define _NVP_BUILD_H_
+
+#include <string.h>
+#include <apr_pools.h>
+
+/* The characters a form-encoded value keeps as they are */
+static const unsigned char unreserved[256] = {
+   0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,0,
+   1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,
+   0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+   1,1,1,1,1,1,1,1,1,1,1,0,0,0,0,1,
+   0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+   1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,0,
+   0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+};
+
+static int isUnreserved(unsigned char c)
+{
+   return unreserved[c];
+}
+
+/* Appends "&name=value" with value form-encoded; returns the new end */
+static char* appendNvpField(char* out, const char* name, const char* value)
+{
+   static const char hex[] = "0123456789ABCDEF";
+   const unsigned char* in = (const unsigned char*)value;
+   apr_size_t nlen = strlen(name);
+   *out++ = '&';
+   memcpy(out, name, nlen);
+   out += nlen;
+   *out++ = '=';
+   for (; in != NULL && *in != '\0'; in++) {
+      if (isUnreserved(*in)) {
+         *out++ = *in;
+      } else {
+         *out++ = '%';
+         *out++ = hex[*in >> 4];
+         *out++ = hex[*in & 0x0f];
+      }
+   }
+   return out;
+}
+
+static apr_size_t nvpFieldLength(const char* name, const char* value)
+{
+   const unsigned char* in = (const unsigned char*)value;
+   apr_size_t len = strlen(name) + 2;
+   for (; in != NULL && *in != '\0'; in++) {
+      len += isUnreserved(*in) ? 1 : 3;
+   }
+   return len;
+}
+
+/*
+ * Builds a POST body from the precompiled static part of a method and
+ * its per-request fields, measured first so it is allocated exactly once.
+ */
+static char* buildNvpRequest(apr_pool_t* pool, const nvp_template* tmpl, const char* const* names, const char* const* values, int n, apr_size_t* len)
+{
+   apr_size_t total = tmpl->len;
+   char* body;
+   char* out;
+   int i;
+   for (i = 0; i < n; i++) {
+      total += nvpFieldLength(names[i], values[i]);
+   }
+   body = apr_palloc(pool, total + 1);
+   memcpy(body, tmpl->prefix, tmpl->len);
+   out = body + tmpl->len;
+   for (i = 0; i < n; i++) {
+      out = appendNvpField(out, names[i], values[i]);
+   }
+   *out = '\0';
+   *len = total;
+   return body;
+}
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * mod_paypal_ec - Apache Module to secure URIs using PayPal Express Checkout
+ * Copyright 2013 PayPal, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * nvp_build_bench - times the module's building of NVP request bodies
+ * (nvp_build.h) against the populate*URL functions it replaced. For each
+ * API method it prints the mean time per request, before and after.
+ *
+ *   nvp_build_bench [iterations]
+ *
+ * Before is what each API call did: populateApiCredential and one
+ * apr_pstrcat of the whole URL, credentials and fixed fields included.
+ * After is compileNvpTemplates once at startup and buildNvpRequest of the
+ * per-request fields on every call. The old code did not encode values,
+ * the new one does, so after pays for encoding that before skipped.
+ * Every iteration starts on a cleared pool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <apr_general.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+
+/* The parts of mod_paypal_ec.h that nvp_build.h uses */
+typedef struct {
+    const char* prefix;
+    apr_size_t len;
+}nvp_template;
+
+#include "nvp_build.h"
+
+#define NVP_SET 0
+#define NVP_GET 1
+#define NVP_DO 2
+#define NVP_METHOD_COUNT 3
+
+static const nvp_template emptyTemplate = { "", 0 };
+
+/* A sandbox account and a single-file checkout */
+static const char* const endPoint = "https://api-3t.sandbox.paypal.com/nvp";
+static const char* const userName = "seller_1360000000_biz_api1.example.com";
+static const char* const password = "1360000000";
+static const char* const signature = "AFcWxV21C7fd0v3bYYYRCpSSRl31A1b2c3d4e5f6g7h8i9j0kLmNoPqRsT";
+static const char* const version = "84.0";
+static const char* const currencyCode = "USD";
+static const char* const appContext = "https://shop.example.com/paid/books/book.pdf";
+static const char* const amount = "9.99";
+static const char* const name = "book.pdf";
+static const char* const token = "EC-4RT28474PR5931543";
+static const char* const payerId = "QFWCN7TQRX9AE";
+
+static nvp_template templates[NVP_METHOD_COUNT];
+
+/* populateApiCredential and the populate*URL functions as they were */
+static char* populateApiCredential(apr_pool_t* pool) {
+   return apr_pstrcat(pool, endPoint, "?USER=", userName,"&PWD=",password, "&SIGNATURE=", signature, "&VERSION=", version,NULL);
+}
+
+static char* buildBefore(int method, apr_pool_t* pool)
+{
+   switch (method) {
+   case NVP_SET:
+      return apr_pstrcat(pool, populateApiCredential(pool),"&METHOD=SetExpressCheckout&","RETURNURL=", appContext, "?status=ok", "&CANCELURL=", appContext,"?status=cancel", "&PAYMENTREQUEST_0_AMT=", amount,"&PAYMENTREQUEST_0_CURRENCYCODE=",currencyCode ,"&PAYMENTREQUEST_0_ITEMAMT=", amount,"&PAYMENTREQUEST_0_PAYMENTACTION=Sale&L_PAYMENTREQUEST_0_NAME0=", name, "&L_PAYMENTREQUEST_0_AMT0=", amount, "&L_PAYMENTREQUEST_0_ITEMCATEGORY0=Digital","&REQCONFIRMSHIPPING=0","&NOSHIPPING=1","&L_PAYMENTREQUEST_0_QTY0=1",NULL);
+   case NVP_GET:
+      return apr_pstrcat(pool, populateApiCredential(pool),"&METHOD=GetExpressCheckoutDetails&", "TOKEN=", token,NULL);
+   default:
+      return apr_pstrcat(pool, populateApiCredential(pool),"&METHOD=DoExpressCheckoutPayment&", "TOKEN=", token, "&PAYERID=", payerId, "&PAYMENTREQUEST_0_AMT=",amount, "&PAYMENTREQUEST_0_ITEMAMT=", amount, "&PAYMENTREQUEST_0_PAYMENTACTION=Sale&L_PAYMENTREQUEST_0_NAME0=", name, "&L_PAYMENTREQUEST_0_AMT0=", amount, "&L_PAYMENTREQUEST_0_ITEMCATEGORY0=Digital","&L_PAYMENTREQUEST_0_QTY0=1",NULL);
+   }
+}
+
+/* compileNvpTemplates of the module for the account above */
+static void compileTemplates(apr_pool_t* pool)
+{
+   static const char* const credentialNames[] = { "USER", "PWD", "SIGNATURE", "VERSION" };
+   static const char* const currencyNames[] = { "PAYMENTREQUEST_0_CURRENCYCODE" };
+   const char* credentials[4];
+   apr_size_t len;
+   char* base;
+   char* currency;
+
+   credentials[0] = userName;
+   credentials[1] = password;
+   credentials[2] = signature;
+   credentials[3] = version;
+   base = buildNvpRequest(pool, &emptyTemplate, credentialNames, credentials, 4, &len) + 1;
+   currency = buildNvpRequest(pool, &emptyTemplate, currencyNames, &currencyCode, 1, &len);
+   templates[NVP_SET].prefix = apr_pstrcat(pool, base, "&METHOD=SetExpressCheckout", currency,
+        "&PAYMENTREQUEST_0_PAYMENTACTION=Sale&L_PAYMENTREQUEST_0_ITEMCATEGORY0=Digital",
+        "&REQCONFIRMSHIPPING=0&NOSHIPPING=1&L_PAYMENTREQUEST_0_QTY0=1", NULL);
+   templates[NVP_GET].prefix = apr_pstrcat(pool, base, "&METHOD=GetExpressCheckoutDetails", NULL);
+   templates[NVP_DO].prefix = apr_pstrcat(pool, base, "&METHOD=DoExpressCheckoutPayment", currency,
+        "&PAYMENTREQUEST_0_PAYMENTACTION=Sale&L_PAYMENTREQUEST_0_ITEMCATEGORY0=Digital",
+        "&L_PAYMENTREQUEST_0_QTY0=1", NULL);
+   templates[NVP_SET].len = strlen(templates[NVP_SET].prefix);
+   templates[NVP_GET].len = strlen(templates[NVP_GET].prefix);
+   templates[NVP_DO].len = strlen(templates[NVP_DO].prefix);
+}
+
+/* The populate*Request functions of the module for a single file */
+static char* buildAfter(int method, apr_pool_t* pool, apr_size_t* len)
+{
+   static const char* const setNames[] = { "RETURNURL", "CANCELURL", "PAYMENTREQUEST_0_AMT", "PAYMENTREQUEST_0_ITEMAMT", "L_PAYMENTREQUEST_0_NAME0", "L_PAYMENTREQUEST_0_AMT0" };
+   static const char* const doNames[] = { "TOKEN", "PAYERID", "PAYMENTREQUEST_0_AMT", "PAYMENTREQUEST_0_ITEMAMT", "L_PAYMENTREQUEST_0_NAME0", "L_PAYMENTREQUEST_0_AMT0" };
+   static const char* const getNames[] = { "TOKEN" };
+   const char* values[6];
+   switch (method) {
+   case NVP_SET:
+      values[0] = apr_pstrcat(pool, appContext, "?", "status=ok", NULL);
+      values[1] = apr_pstrcat(pool, appContext, "?", "status=cancel", NULL);
+      values[2] = amount;
+      values[3] = amount;
+      values[4] = name;
+      values[5] = amount;
+      return buildNvpRequest(pool, &templates[NVP_SET], setNames, values, 6, len);
+   case NVP_GET:
+      values[0] = token;
+      return buildNvpRequest(pool, &templates[NVP_GET], getNames, values, 1, len);
+   default:
+      values[0] = token;
+      values[1] = payerId;
+      values[2] = amount;
+      values[3] = amount;
+      values[4] = name;
+      values[5] = amount;
+      return buildNvpRequest(pool, &templates[NVP_DO], doNames, values, 6, len);
+   }
+}
+
+/* Every field name of the old query string must be in the new body */
+static int sameFields(const char* before, const char* after, apr_pool_t* pool)
+{
+   char* query = apr_pstrdup(pool, strchr(before, '?') + 1);
+   const char* body = apr_pstrcat(pool, "&", after, NULL);
+   char* last;
+   char* field;
+   for (field = apr_strtok(query, "&", &last); field != NULL; field = apr_strtok(NULL, "&", &last)) {
+      char* eq = strchr(field, '=');
+      if (eq == NULL || strstr(body, apr_pstrcat(pool, "&", apr_pstrmemdup(pool, field, eq - field + 1), NULL)) == NULL) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+/* Mean ns per request; variant 0 is before, 1 after */
+static double timeBuild(int method, apr_pool_t* pool, int iterations, int variant)
+{
+   apr_time_t start = apr_time_now();
+   apr_size_t len = 0;
+   int i;
+   for (i = 0; i < iterations; i++)
+   {
+      char* body = variant == 0 ? buildBefore(method, pool) : buildAfter(method, pool, &len);
+      apr_pool_clear(pool);
+      if (body == NULL)
+      {
+         fprintf(stderr, "nvp_build_bench: no request built\n");
+         exit(1);
+      }
+   }
+   return (double)(apr_time_now() - start) * 1000 / iterations;
+}
+
+int main(int argc, char** argv)
+{
+   static const char* const methods[] = { "set", "get", "do" };
+   int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+   apr_pool_t* pconf;
+   apr_pool_t* pool;
+   int m;
+
+   if (iterations <= 0)
+   {
+      fprintf(stderr, "usage: nvp_build_bench [iterations]\n");
+      return 2;
+   }
+   apr_initialize();
+   apr_pool_create(&pconf, NULL);
+   apr_pool_create(&pool, NULL);
+   compileTemplates(pconf);
+   printf("%-8s %6s %6s %12s %12s %8s\n", "method", "before", "after", "before_ns", "after_ns", "speedup");
+   for (m = NVP_SET; m < NVP_METHOD_COUNT; m++)
+   {
+      apr_size_t len;
+      char* before = buildBefore(m, pool);
+      char* after = buildAfter(m, pool, &len);
+      int beforeLen = (int)strlen(before);
+      double beforeNs;
+      double afterNs;
+      if (len != strlen(after) || !sameFields(before, after, pool))
+      {
+         fprintf(stderr, "nvp_build_bench: %s request differs from the old one\n", methods[m]);
+         return 1;
+      }
+      apr_pool_clear(pool);
+      beforeNs = timeBuild(m, pool, iterations, 0);
+      afterNs = timeBuild(m, pool, iterations, 1);
+      printf("%-8s %6d %6d %12.0f %12.0f %7.1fx\n", methods[m], beforeLen, (int)len, beforeNs, afterNs,
+             afterNs > 0 ? beforeNs / afterNs : 0);
+   }
+   apr_pool_destroy(pool);
+   apr_pool_destroy(pconf);
+   apr_terminate();
+   return 0;
+}
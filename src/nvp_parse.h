@@ -0,0 +1,273 @@
+/*
+ * mod_paypal_ec - Apache Module to secure URIs using PayPal Express Checkout
+ * Copyright 2013 PayPal, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Decoding of the request URI and of NVP responses, kept apart so that
+ * nvp_parse_bench can time the same code. The includer provides
+ * ec_params, nvp_decoder, EC_PARAM_REQUEST and EC_PARAM_RESPONSE,
+ * NVP_DECODER_CHUNK, recordCounter() and stats with paramTables and
+ * decoderGrows.
+ */
+
+#ifndef _NVP_PARSE_H_
+#define _NVP_PARSE_H_
+
+#include <string.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+
+static int hexValue(char c)
+{
+   if (c >= '0' && c <= '9') {
+      return c - '0';
+   }
+   if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+   }
+   if (c >= 'A' && c <= 'F') {
+      return c - 'A' + 10;
+   }
+   return -1;
+}
+
+/*
+ * Percent-decodes [start, end) in place, NUL terminates the result and
+ * returns its length. The decoded text is never longer than the input,
+ * so the terminator lands on the separator that ended the field.
+ */
+static apr_size_t unescapeInPlace(char* start, const char* end, int plusIsSpace)
+{
+   char* out = start;
+   const char* in = start;
+   while (in < end) {
+      if (*in == '%' && end - in >= 3 && hexValue(in[1]) >= 0 && hexValue(in[2]) >= 0) {
+         *out++ = (char)((hexValue(in[1]) << 4) | hexValue(in[2]));
+         in += 3;
+      } else if (*in == '+' && plusIsSpace) {
+         *out++ = ' ';
+         in++;
+      } else {
+         *out++ = *in++;
+      }
+   }
+   *out = '\0';
+   return out - start;
+}
+
+/*
+ * Stores one decoded pair. Keys the module acts on land in fixed fields,
+ * anything else goes to a small table that is only created when needed.
+ * Request keys and NVP response keys are kept apart so a query string can
+ * never pose as a PayPal answer; NAME and AMOUNT are never taken from the
+ * query string.
+ */
+static void setParam(ec_params* data, const char* key, apr_size_t klen, const char* value, int source, apr_pool_t* pool)
+{
+   const char** field = NULL;
+   if (source == EC_PARAM_REQUEST) {
+      switch (klen) {
+      case 5:
+         if (memcmp(key, "token", 5) == 0) field = &data->token;
+         else if (memcmp(key, "grant", 5) == 0) field = &data->grant;
+         break;
+      case 6:
+         if (memcmp(key, "status", 6) == 0) field = &data->status;
+         break;
+      case 7:
+         if (memcmp(key, "PayerID", 7) == 0) field = &data->payerId;
+         break;
+      }
+      if (field == NULL && (strcmp(key, "NAME") == 0 || strcmp(key, "AMOUNT") == 0)) {
+         return;
+      }
+   } else {
+      switch (klen) {
+      case 3:
+         if (memcmp(key, "ACK", 3) == 0) field = &data->ack;
+         break;
+      case 5:
+         if (memcmp(key, "TOKEN", 5) == 0) field = &data->respToken;
+         break;
+      case 12:
+         if (memcmp(key, "L_ERRORCODE0", 12) == 0) field = &data->errorCode;
+         break;
+      case 14:
+         if (memcmp(key, "CHECKOUTSTATUS", 14) == 0) field = &data->checkoutStatus;
+         break;
+      case 27:
+         if (memcmp(key, "PAYMENTINFO_0_TRANSACTIONID", 27) == 0) field = &data->transactionId;
+         break;
+      }
+   }
+   if (field != NULL) {
+      *field = value;
+      return;
+   }
+   if (data->other == NULL) {
+      data->other = apr_table_make(pool, 4);
+      recordCounter(stats ? &stats->paramTables : NULL);
+   }
+   apr_table_setn(data->other, key, value);
+}
+
+static const char* getParam(const ec_params* data, const char* key)
+{
+   return data->other == NULL ? NULL : apr_table_get(data->other, key);
+}
+
+/* Splits "k=v&k=v" in one pass, decoding keys and values where they lie */
+static void parsePairs(char* buf, char* end, ec_params* data, int source, apr_pool_t* pool)
+{
+   char* amp;
+   char* eq;
+   apr_size_t klen;
+   while (buf < end) {
+      amp = memchr(buf, '&', end - buf);
+      if (amp == NULL) {
+         amp = end;
+      }
+      eq = memchr(buf, '=', amp - buf);
+      if (eq != NULL && eq > buf) {
+         klen = unescapeInPlace(buf, eq, 1);
+         unescapeInPlace(eq + 1, amp, 1);
+         setParam(data, buf, klen, eq + 1, source, pool);
+      }
+      buf = amp + 1;
+   }
+}
+
+/*
+ * Takes NAME from the last path segment of the request URI and the known
+ * query parameters from the query string, with a single copy of the URI.
+ */
+static void parseRequestUri(const char* uri, ec_params* data, apr_pool_t* pool) 
+{
+   apr_size_t len = strlen(uri);
+   char* buf = apr_pstrmemdup(pool, uri, len);
+   char* end = buf + len;
+   char* query = memchr(buf, '?', len);
+   char* name;
+   char* pathEnd = query != NULL ? query : end;
+   for (name = pathEnd; name > buf && name[-1] != '/'; name--)
+      ;
+   if (name < pathEnd) {
+      unescapeInPlace(name, pathEnd, 0);
+      data->name = name;
+   }
+   if (query != NULL) {
+      parsePairs(query + 1, end, data, EC_PARAM_REQUEST, pool);
+   }
+}
+
+static void decoderPut(nvp_decoder* d, char c)
+{
+  if (d->len == d->cap) {
+     apr_size_t cap = d->cap == 0 ? NVP_DECODER_CHUNK : d->cap * 2;
+     char* buf = apr_palloc(d->pool, cap);
+     recordCounter(stats ? &stats->decoderGrows : NULL);
+     if (d->len > 0) {
+        memcpy(buf, d->buf, d->len);
+     }
+     d->buf = buf;
+     d->cap = cap;
+  }
+  d->buf[d->len++] = c;
+}
+
+/* Ends the key or value being decoded; a completed value stores the pair */
+static void decoderEndField(nvp_decoder* d)
+{
+  char* field;
+  if (d->escape > 0) {
+     /* A '%' not followed by two hex digits is kept as it was */
+     decoderPut(d, '%');
+     if (d->escape == 2) {
+        decoderPut(d, d->pending);
+     }
+     d->escape = 0;
+  }
+  field = apr_pstrmemdup(d->pool, d->len > 0 ? d->buf : "", d->len);
+  if (!d->inValue) {
+     d->key = field;
+     d->klen = d->len;
+  } else if (d->key != NULL && d->klen > 0) {
+     setParam(d->data, d->key, d->klen, field, EC_PARAM_RESPONSE, d->pool);
+  }
+  d->len = 0;
+}
+
+/*
+ * Incremental NVP decoder fed from the curl write callback. Escapes and
+ * key/value boundaries may be split anywhere between chunks; only the
+ * field currently being decoded is buffered, never the whole body.
+ */
+static void decodeNvpChunk(nvp_decoder* d, const char* chunk, apr_size_t len)
+{
+  const char* end = chunk + len;
+  int value;
+  for (; chunk < end; chunk++) {
+     char c = *chunk;
+     if (d->escape > 0) {
+        value = hexValue(c);
+        if (value < 0) {
+           decoderPut(d, '%');
+           if (d->escape == 2) {
+              decoderPut(d, d->pending);
+           }
+           d->escape = 0;
+        } else if (d->escape == 1) {
+           d->pending = c;
+           d->escape = 2;
+           continue;
+        } else {
+           decoderPut(d, (char)((hexValue(d->pending) << 4) | value));
+           d->escape = 0;
+           continue;
+        }
+     }
+     if (c == '&') {
+        if (d->inValue) {
+           decoderEndField(d);
+        }
+        d->inValue = 0;
+        d->key = NULL;
+        d->len = 0;
+     } else if (c == '=' && !d->inValue) {
+        decoderEndField(d);
+        d->inValue = 1;
+     } else if (c == '%') {
+        d->escape = 1;
+     } else if (c == '+') {
+        decoderPut(d, ' ');
+     } else {
+        decoderPut(d, c);
+     }
+  }
+}
+
+static void finishNvpDecoder(nvp_decoder* d)
+{
+  if (d->inValue) {
+     decoderEndField(d);
+  }
+  d->inValue = 0;
+  d->key = NULL;
+  d->len = 0;
+}
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * mod_paypal_ec - Apache Module to secure URIs using PayPal Express Checkout
+ * Copyright 2013 PayPal, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * nvp_parse_bench - times the module's decoding of the request URI and of
+ * NVP responses (nvp_parse.h) against the parseInput it replaced. For
+ * each case it prints the mean time per parse, before and after.
+ *
+ *   nvp_parse_bench [iterations]
+ *
+ * Before is what ec_handler and the API calls did per request: an
+ * apr_table sized for 100000 entries, curl_unescape of the whole response
+ * and parseInput into the table. After is the single pass into ec_params,
+ * with a response fed to the decoder in one chunk and in 16-byte chunks,
+ * as curl may split it. Every iteration starts on a cleared pool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <apr_general.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_time.h>
+#include <curl/curl.h>
+
+/* The parts of mod_paypal_ec.h that nvp_parse.h uses */
+#define NVP_DECODER_CHUNK 64
+#define EC_PARAM_REQUEST 0
+#define EC_PARAM_RESPONSE 1
+
+typedef struct {
+    const char* name;
+    const char* token;
+    const char* payerId;
+    const char* status;
+    const char* grant;
+    const char* ack;
+    const char* respToken;
+    const char* checkoutStatus;
+    const char* transactionId;
+    const char* errorCode;
+    apr_table_t* other;
+}ec_params;
+
+typedef struct {
+    apr_pool_t* pool;
+    ec_params* data;
+    char* buf;
+    apr_size_t len;
+    apr_size_t cap;
+    const char* key;
+    apr_size_t klen;
+    int inValue;
+    int escape;
+    char pending;
+}nvp_decoder;
+
+static struct {
+    volatile apr_uint32_t paramTables;
+    volatile apr_uint32_t decoderGrows;
+}* stats;
+
+static void recordCounter(volatile apr_uint32_t* counter)
+{
+    if (counter != NULL)
+    {
+        (*counter)++;
+    }
+}
+
+#include "nvp_parse.h"
+
+#define BEFORE_TABLE_SIZE 100000
+#define CHUNK 16
+
+/* parseInput as it was, with key initialized so a URI without '=' is defined */
+static void parseInput(char* token, apr_table_t* data, apr_pool_t* pool) 
+{
+   int i = 0;
+   int start = 0;
+   char* key = NULL;
+   char* value;
+   int nameFound = 1;
+   while(token[i] != '\0') 
+   {
+     i++;
+     if(token[i] == '/') {
+       start = i +1;
+       continue;
+     }
+     if(token[i] == '?') {
+       apr_table_setn(data, "NAME",apr_pstrmemdup(pool,token+start, (i - start)));
+       nameFound = 0;
+       start = i+1;
+       continue;
+     }
+     if(token[i] == '=') {
+       key = apr_pstrmemdup(pool,token+start, (i - start));
+       start = i+1;
+       continue;
+     }
+     if(token[i] == '&') {
+       value = apr_pstrmemdup(pool,token+start, (i - start));
+       start = i+1;
+       apr_table_setn(data, key, value);
+     }
+   }
+   if(nameFound != 0) {
+      key = "NAME";
+   } 
+   if(key != NULL && strcmp(key, "AMOUNT") != 0) {
+      value = apr_pstrmemdup(pool,token+start, (i - start));
+      apr_table_setn(data, key, value);
+   }
+} 
+
+typedef struct {
+    const char* name;
+    int request;
+    const char* input;
+    const char* ack;
+}bench_case;
+
+static const bench_case cases[] = {
+    { "request", 1,
+      "/paid/books/book.pdf?status=ok&token=EC-4RT28474PR5931543&PayerID=QFWCN7TQRX9AE", NULL },
+    { "set", 0,
+      "TOKEN=EC%2d4RT28474PR5931543&TIMESTAMP=2026%2d10%2d17T19%3a45%3a47Z&CORRELATIONID=8f7a6e1c2b3d4"
+      "&ACK=Success&VERSION=84%2e0&BUILD=23484380", "Success" },
+    { "get", 0,
+      "TOKEN=EC%2d4RT28474PR5931543&BILLINGAGREEMENTACCEPTEDSTATUS=0&CHECKOUTSTATUS=PaymentActionNotInitiated"
+      "&TIMESTAMP=2026%2d10%2d17T19%3a45%3a49Z&CORRELATIONID=5c1d9e2f7a4b8&ACK=Success&VERSION=84%2e0"
+      "&BUILD=23484380&EMAIL=buyer%40example%2ecom&PAYERID=QFWCN7TQRX9AE&PAYERSTATUS=verified"
+      "&FIRSTNAME=Jane&LASTNAME=Doe&COUNTRYCODE=US&SHIPTONAME=Jane%20Doe&SHIPTOSTREET=1%20Main%20St"
+      "&SHIPTOCITY=San%20Jose&SHIPTOSTATE=CA&SHIPTOZIP=95131&SHIPTOCOUNTRYCODE=US"
+      "&SHIPTOCOUNTRYNAME=United%20States&ADDRESSSTATUS=Confirmed&CURRENCYCODE=USD&AMT=9%2e99"
+      "&ITEMAMT=9%2e99&SHIPPINGAMT=0%2e00&HANDLINGAMT=0%2e00&TAXAMT=0%2e00&INSURANCEAMT=0%2e00"
+      "&SHIPDISCAMT=0%2e00&L_NAME0=book%2epdf&L_QTY0=1&L_TAXAMT0=0%2e00&L_AMT0=9%2e99"
+      "&L_ITEMCATEGORY0=Digital&PAYMENTREQUEST_0_CURRENCYCODE=USD&PAYMENTREQUEST_0_AMT=9%2e99"
+      "&PAYMENTREQUEST_0_ITEMAMT=9%2e99&PAYMENTREQUEST_0_INSURANCEOPTIONOFFERED=false"
+      "&PAYMENTREQUESTINFO_0_ERRORCODE=0", "Success" },
+    { "do", 0,
+      "TOKEN=EC%2d4RT28474PR5931543&SUCCESSPAGEREDIRECTREQUESTED=false&TIMESTAMP=2026%2d10%2d17T19%3a45%3a51Z"
+      "&CORRELATIONID=3e8b7c6d5f4a1&ACK=Success&VERSION=84%2e0&BUILD=23484380&INSURANCEOPTIONSELECTED=false"
+      "&SHIPPINGOPTIONISDEFAULT=false&PAYMENTINFO_0_TRANSACTIONID=1AB23456CD789012E"
+      "&PAYMENTINFO_0_TRANSACTIONTYPE=cart&PAYMENTINFO_0_PAYMENTTYPE=instant"
+      "&PAYMENTINFO_0_ORDERTIME=2026%2d10%2d17T19%3a45%3a50Z&PAYMENTINFO_0_AMT=9%2e99"
+      "&PAYMENTINFO_0_FEEAMT=0%2e59&PAYMENTINFO_0_TAXAMT=0%2e00&PAYMENTINFO_0_CURRENCYCODE=USD"
+      "&PAYMENTINFO_0_PAYMENTSTATUS=Completed&PAYMENTINFO_0_PENDINGREASON=None"
+      "&PAYMENTINFO_0_REASONCODE=None&PAYMENTINFO_0_PROTECTIONELIGIBILITY=Ineligible"
+      "&PAYMENTINFO_0_PROTECTIONELIGIBILITYTYPE=None&PAYMENTINFO_0_SECUREMERCHANTACCOUNTID=XV5ZQ6S4ZJ6E2"
+      "&PAYMENTINFO_0_ERRORCODE=0&PAYMENTINFO_0_ACK=Success", "Success" },
+};
+
+static int parseBefore(const bench_case* c, apr_pool_t* pool)
+{
+    apr_table_t* data = apr_table_make(pool, BEFORE_TABLE_SIZE);
+    const char* ack;
+    char* line;
+    if (c->request)
+    {
+        parseInput((char*)c->input, data, pool);
+        return apr_table_get(data, "token") != NULL;
+    }
+    /* The old code leaked this copy; it is freed here so the loop does not grow */
+    line = curl_unescape(c->input, strlen(c->input));
+    parseInput(line, data, pool);
+    ack = apr_table_get(data, "ACK");
+    curl_free(line);
+    return ack != NULL && strcmp(ack, c->ack) == 0 && apr_table_get(data, "VERSION") != NULL;
+}
+
+static int parseAfter(const bench_case* c, apr_pool_t* pool, apr_size_t chunk)
+{
+    ec_params* data = apr_pcalloc(pool, sizeof(ec_params));
+    nvp_decoder d;
+    apr_size_t len;
+    apr_size_t at;
+    if (c->request)
+    {
+        parseRequestUri(c->input, data, pool);
+        return data->token != NULL;
+    }
+    memset(&d, 0, sizeof(d));
+    d.pool = pool;
+    d.data = data;
+    len = strlen(c->input);
+    for (at = 0; at < len; at += chunk)
+    {
+        decodeNvpChunk(&d, c->input + at, len - at < chunk ? len - at : chunk);
+    }
+    finishNvpDecoder(&d);
+    return data->ack != NULL && strcmp(data->ack, c->ack) == 0 && getParam(data, "VERSION") != NULL;
+}
+
+/* Mean ns per parse; variant 0 is before, else the decoder chunk size */
+static double timeParse(const bench_case* c, apr_pool_t* pool, int iterations, apr_size_t variant)
+{
+    apr_time_t start = apr_time_now();
+    int i;
+    for (i = 0; i < iterations; i++)
+    {
+        int ok = variant == 0 ? parseBefore(c, pool) : parseAfter(c, pool, variant);
+        apr_pool_clear(pool);
+        if (!ok)
+        {
+            fprintf(stderr, "nvp_parse_bench: %s parsed wrong %s\n", c->name, variant == 0 ? "before" : "after");
+            exit(1);
+        }
+    }
+    return (double)(apr_time_now() - start) * 1000 / iterations;
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    apr_pool_t* pool;
+    size_t i;
+
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "usage: nvp_parse_bench [iterations]\n");
+        return 2;
+    }
+    apr_initialize();
+    apr_pool_create(&pool, NULL);
+    printf("%-8s %6s %12s %12s %12s %8s\n", "case", "bytes", "before_ns", "after_ns", "chunked_ns", "speedup");
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const bench_case* c = &cases[i];
+        double before = timeParse(c, pool, iterations, 0);
+        double after = timeParse(c, pool, iterations, (apr_size_t)-1);
+        double chunked = c->request ? after : timeParse(c, pool, iterations, CHUNK);
+        printf("%-8s %6d %12.0f %12.0f %12.0f %7.1fx\n", c->name, (int)strlen(c->input), before, after, chunked,
+               after > 0 ? before / after : 0);
+    }
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}
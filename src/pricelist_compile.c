@@ -0,0 +1,463 @@
+/*
+ * mod_paypal_ec - Apache Module to secure URIs using PayPal Express Checkout
+ * Copyright 2013 PayPal, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * pricelist_compile - turns a text Pricelist (<name>=<amount> per line) into
+ * the binary image described in pricelist_image.h.
+ *
+ *   pricelist_compile books.pricelist books.catalog
+ *
+ * Lines are read with the same rules as the module: '#' starts a comment,
+ * amounts must be digits with at most two decimals, and a later line for
+ * the same name wins. The image is written next to the output and renamed
+ * into place, so a running server never maps a half written file.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "pricelist_image.h"
+
+/* Average keys per bucket; larger buckets are placed first */
+#define LAMBDA 4
+#define MAX_DISPLACEMENT (1u << 20)
+#define MAX_SEEDS 16
+
+typedef struct {
+    char* name;
+    size_t nameLen;
+    char* amount;
+    uint64_t hash;
+}item;
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+}strings;
+
+static item* items;
+static size_t count;
+static size_t capacity;
+
+static void die(const char* fmt, const char* arg)
+{
+    fprintf(stderr, "pricelist_compile: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static int isValidAmount(const char* value)
+{
+    const char* dot = strchr(value, '.');
+    size_t digits = strspn(value, "0123456789");
+    if (digits == 0)
+    {
+        return 0;
+    }
+    if (dot == NULL)
+    {
+        return value[digits] == '\0';
+    }
+    return dot == value + digits && strspn(dot + 1, "0123456789") == strlen(dot + 1) && strlen(dot + 1) <= 2;
+}
+
+/* Open addressing index over items, used to let a later line win */
+static size_t* nameIndex;
+static size_t indexSize;
+
+static size_t* findSlot(const char* name, size_t len)
+{
+    size_t i = (size_t)catalogHash(name, len, 0) & (indexSize - 1);
+    while (nameIndex[i] != 0)
+    {
+        item* it = &items[nameIndex[i] - 1];
+        if (it->nameLen == len && memcmp(it->name, name, len) == 0)
+        {
+            break;
+        }
+        i = (i + 1) & (indexSize - 1);
+    }
+    return &nameIndex[i];
+}
+
+static void growIndex(void)
+{
+    size_t i;
+    free(nameIndex);
+    indexSize = indexSize ? indexSize * 2 : 1024;
+    nameIndex = calloc(indexSize, sizeof(size_t));
+    if (nameIndex == NULL)
+    {
+        die("%s", strerror(errno));
+    }
+    for (i = 0; i < count; i++)
+    {
+        *findSlot(items[i].name, items[i].nameLen) = i + 1;
+    }
+}
+
+static void addItem(const char* name, const char* amount)
+{
+    size_t len = strlen(name);
+    size_t* slot;
+    if ((count + 1) * 2 > indexSize)
+    {
+        growIndex();
+    }
+    slot = findSlot(name, len);
+    if (*slot != 0)
+    {
+        free(items[*slot - 1].amount);
+        items[*slot - 1].amount = strdup(amount);
+        return;
+    }
+    if (count == capacity)
+    {
+        capacity = capacity ? capacity * 2 : 1024;
+        items = realloc(items, capacity * sizeof(item));
+        if (items == NULL)
+        {
+            die("%s", strerror(errno));
+        }
+    }
+    items[count].name = strdup(name);
+    items[count].nameLen = len;
+    items[count].amount = strdup(amount);
+    count++;
+    *slot = count;
+}
+
+static void readPricelist(const char* path)
+{
+    FILE* in = fopen(path, "r");
+    char* line = NULL;
+    size_t size = 0;
+    int lineNo = 0;
+    const char* delim = "=\n\r";
+    if (in == NULL)
+    {
+        die("can't open %s", path);
+    }
+    while (getline(&line, &size, in) != -1)
+    {
+        char* last;
+        char* key;
+        char* value;
+        lineNo++;
+        key = strtok_r(line, delim, &last);
+        if (key == NULL || key[0] == '#')
+        {
+            continue;
+        }
+        value = strtok_r(NULL, delim, &last);
+        if (value == NULL || !isValidAmount(value))
+        {
+            fprintf(stderr, "pricelist_compile: %s:%d: expected <name>=<amount>\n", path, lineNo);
+            exit(1);
+        }
+        addItem(key, value);
+    }
+    free(line);
+    fclose(in);
+}
+
+static uint32_t intern(strings* s, const char* value, size_t len)
+{
+    uint32_t offset = (uint32_t)s->len;
+    if (s->len + len + 1 > UINT32_MAX)
+    {
+        die("%s", "string table exceeds 4 GB");
+    }
+    while (s->len + len + 1 > s->cap)
+    {
+        s->cap = s->cap ? s->cap * 2 : 1 << 20;
+        s->data = realloc(s->data, s->cap);
+        if (s->data == NULL)
+        {
+            die("%s", strerror(errno));
+        }
+    }
+    memcpy(s->data + s->len, value, len);
+    s->data[s->len + len] = '\0';
+    s->len += len + 1;
+    return offset;
+}
+
+/* Bucket ids ordered by decreasing size, with their keys grouped by bucket */
+static uint32_t* order;
+static uint32_t* bucketStart;
+static uint32_t* members;
+
+static void groupBuckets(uint32_t buckets)
+{
+    uint32_t* sizes = calloc(buckets, sizeof(uint32_t));
+    uint32_t* fill = calloc(buckets, sizeof(uint32_t));
+    uint32_t* bySize;
+    uint32_t maxSize = 0;
+    uint32_t b;
+    size_t i;
+
+    bucketStart = realloc(bucketStart, (buckets + 1) * sizeof(uint32_t));
+    members = realloc(members, count * sizeof(uint32_t));
+    order = realloc(order, buckets * sizeof(uint32_t));
+    if (sizes == NULL || fill == NULL || bucketStart == NULL || members == NULL || order == NULL)
+    {
+        die("%s", strerror(errno));
+    }
+    for (i = 0; i < count; i++)
+    {
+        b = catalogBucket(items[i].hash, buckets);
+        if (++sizes[b] > maxSize)
+        {
+            maxSize = sizes[b];
+        }
+    }
+    bucketStart[0] = 0;
+    for (b = 0; b < buckets; b++)
+    {
+        bucketStart[b + 1] = bucketStart[b] + sizes[b];
+    }
+    for (i = 0; i < count; i++)
+    {
+        b = catalogBucket(items[i].hash, buckets);
+        members[bucketStart[b] + fill[b]++] = (uint32_t)i;
+    }
+    /* Counting sort of the buckets by size, largest first */
+    bySize = calloc(maxSize + 2, sizeof(uint32_t));
+    if (bySize == NULL)
+    {
+        die("%s", strerror(errno));
+    }
+    for (b = 0; b < buckets; b++)
+    {
+        bySize[maxSize - sizes[b] + 1]++;
+    }
+    for (i = 1; i <= maxSize + 1; i++)
+    {
+        bySize[i] += bySize[i - 1];
+    }
+    for (b = 0; b < buckets; b++)
+    {
+        order[bySize[maxSize - sizes[b]]++] = b;
+    }
+    free(bySize);
+    free(fill);
+    free(sizes);
+}
+
+/* Returns 0 when every key found a slot, -1 to retry with another seed */
+static int placeKeys(uint32_t buckets, uint32_t* displacements, uint32_t* slots, unsigned char* used)
+{
+    uint32_t n = (uint32_t)count;
+    uint32_t nextFree = 0;
+    uint32_t o;
+    memset(used, 0, n);
+    for (o = 0; o < buckets; o++)
+    {
+        uint32_t b = order[o];
+        uint32_t first = bucketStart[b];
+        uint32_t size = bucketStart[b + 1] - first;
+        uint32_t d;
+        uint32_t k;
+        if (size == 0)
+        {
+            displacements[b] = 0;
+            continue;
+        }
+        if (size == 1)
+        {
+            /* Singletons take the next free slot directly */
+            while (used[nextFree])
+            {
+                nextFree++;
+            }
+            used[nextFree] = 1;
+            slots[members[first]] = nextFree;
+            displacements[b] = nextFree | CATALOG_DIRECT;
+            continue;
+        }
+        for (d = 0; d < MAX_DISPLACEMENT; d++)
+        {
+            for (k = 0; k < size; k++)
+            {
+                uint32_t slot = catalogSlot(items[members[first + k]].hash, d, n);
+                if (used[slot])
+                {
+                    break;
+                }
+                used[slot] = 1;
+                slots[members[first + k]] = slot;
+            }
+            if (k == size)
+            {
+                break;
+            }
+            while (k-- > 0)
+            {
+                used[slots[members[first + k]]] = 0;
+            }
+        }
+        if (d == MAX_DISPLACEMENT)
+        {
+            return -1;
+        }
+        displacements[b] = d;
+    }
+    return 0;
+}
+
+static void writeAll(FILE* out, const void* data, size_t len, const char* path)
+{
+    if (len > 0 && fwrite(data, 1, len, out) != len)
+    {
+        die("can't write %s", path);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    catalog_header header;
+    catalog_entry* entries;
+    uint32_t* displacements;
+    uint32_t* slots;
+    unsigned char* used;
+    uint32_t buckets;
+    strings names = { NULL, 0, 0 };
+    uint64_t seed;
+    size_t i;
+    char* tmp;
+    FILE* out;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: pricelist_compile <pricelist> <catalog>\n");
+        return 2;
+    }
+    readPricelist(argv[1]);
+    if (count >= CATALOG_DIRECT)
+    {
+        die("%s has too many items", argv[1]);
+    }
+    buckets = count > 0 ? (uint32_t)((count + LAMBDA - 1) / LAMBDA) : 1;
+    displacements = calloc(buckets, sizeof(uint32_t));
+    slots = calloc(count + 1, sizeof(uint32_t));
+    used = calloc(count + 1, 1);
+    entries = calloc(count + 1, sizeof(catalog_entry));
+    if (displacements == NULL || slots == NULL || used == NULL || entries == NULL)
+    {
+        die("%s", strerror(errno));
+    }
+
+    for (seed = 0; count > 0; seed++)
+    {
+        if (seed == MAX_SEEDS)
+        {
+            die("no perfect hash found for %s", argv[1]);
+        }
+        for (i = 0; i < count; i++)
+        {
+            items[i].hash = catalogHash(items[i].name, items[i].nameLen, seed);
+        }
+        groupBuckets(buckets);
+        if (placeKeys(buckets, displacements, slots, used) == 0)
+        {
+            break;
+        }
+    }
+
+    {
+        /* Amounts repeat a lot; each distinct one is stored once */
+        size_t* amountIndex;
+        size_t amountSize = 1024;
+        while (amountSize < count * 2)
+        {
+            amountSize *= 2;
+        }
+        amountIndex = calloc(amountSize, sizeof(size_t));
+        if (amountIndex == NULL)
+        {
+            die("%s", strerror(errno));
+        }
+        for (i = 0; i < count; i++)
+        {
+            const char* amount = items[i].amount;
+            size_t len = strlen(amount);
+            size_t h = (size_t)catalogHash(amount, len, 0) & (amountSize - 1);
+            while (amountIndex[h] != 0 && strcmp(names.data + amountIndex[h] - 1, amount) != 0)
+            {
+                h = (h + 1) & (amountSize - 1);
+            }
+            if (amountIndex[h] == 0)
+            {
+                amountIndex[h] = (size_t)intern(&names, amount, len) + 1;
+            }
+            entries[slots[i]].amount = (uint32_t)(amountIndex[h] - 1);
+        }
+        free(amountIndex);
+    }
+    for (i = 0; i < count; i++)
+    {
+        entries[slots[i]].name = intern(&names, items[i].name, items[i].nameLen);
+        entries[slots[i]].nameLen = (uint32_t)items[i].nameLen;
+    }
+    if (names.len == 0)
+    {
+        intern(&names, "", 0);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+    header.version = CATALOG_VERSION;
+    header.byteOrder = CATALOG_BYTE_ORDER;
+    header.count = (uint32_t)count;
+    header.buckets = buckets;
+    header.seed = count > 0 ? seed : 0;
+    header.displacementsOffset = sizeof(header);
+    header.entriesOffset = header.displacementsOffset + (uint64_t)buckets * sizeof(uint32_t);
+    header.stringsOffset = header.entriesOffset + (uint64_t)count * sizeof(catalog_entry);
+    header.stringsSize = names.len;
+
+    tmp = malloc(strlen(argv[2]) + 5);
+    if (tmp == NULL)
+    {
+        die("%s", strerror(errno));
+    }
+    sprintf(tmp, "%s.tmp", argv[2]);
+    out = fopen(tmp, "wb");
+    if (out == NULL)
+    {
+        die("can't create %s", tmp);
+    }
+    writeAll(out, &header, sizeof(header), tmp);
+    writeAll(out, displacements, (size_t)buckets * sizeof(uint32_t), tmp);
+    writeAll(out, entries, count * sizeof(catalog_entry), tmp);
+    writeAll(out, names.data, names.len, tmp);
+    if (fclose(out) != 0)
+    {
+        die("can't write %s", tmp);
+    }
+    if (rename(tmp, argv[2]) != 0)
+    {
+        die("can't rename to %s", argv[2]);
+    }
+    printf("%s: %lu items, %lu bytes of strings\n", argv[2], (unsigned long)count, (unsigned long)names.len);
+    return 0;
+}
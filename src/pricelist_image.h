@@ -0,0 +1,99 @@
+/*
+ * mod_paypal_ec - Apache Module to secure URIs using PayPal Express Checkout
+ * Copyright 2013 PayPal, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Binary image of a compiled price list, written by pricelist_compile and
+ * mapped read-only by the module. Layout, in native byte order:
+ *
+ *   catalog_header
+ *   uint32_t displacements[buckets]
+ *   catalog_entry entries[count]
+ *   char strings[stringsSize]      NUL terminated names and amounts
+ *
+ * Lookups use a minimal perfect hash (hash and displace): the key hash
+ * picks a bucket, the bucket's displacement turns the same hash into the
+ * entry slot. A displacement with CATALOG_DIRECT set holds the slot itself.
+ * The name stored in the entry is compared, so unknown names are rejected.
+ */
+
+#ifndef _PRICELIST_IMAGE_H_
+#define _PRICELIST_IMAGE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define CATALOG_MAGIC "PPECCAT"
+#define CATALOG_VERSION 1
+#define CATALOG_BYTE_ORDER 0x01020304u
+#define CATALOG_DIRECT 0x80000000u
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t count;
+    uint32_t buckets;
+    uint64_t seed;
+    uint64_t displacementsOffset;
+    uint64_t entriesOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+}catalog_header;
+
+typedef struct {
+    uint32_t name;
+    uint32_t nameLen;
+    uint32_t amount;
+}catalog_entry;
+
+static inline uint64_t catalogMix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint64_t catalogHash(const char* key, size_t len, uint64_t seed)
+{
+    uint64_t h = 14695981039346656037ULL ^ seed;
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return catalogMix(h);
+}
+
+static inline uint32_t catalogBucket(uint64_t h, uint32_t buckets)
+{
+    return (uint32_t)(h >> 32) % buckets;
+}
+
+static inline uint32_t catalogSlot(uint64_t h, uint32_t displacement, uint32_t count)
+{
+    if (displacement & CATALOG_DIRECT)
+    {
+        return displacement & ~CATALOG_DIRECT;
+    }
+    return (uint32_t)(catalogMix(h + displacement * 0x9e3779b97f4a7c15ULL) % count);
+}
+
+#endif